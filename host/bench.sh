@@ -0,0 +1,57 @@
+#!/bin/sh
+# Throughput benchmark: runs the firmware in the simulator once per logging
+# configuration and tabulates what each one captured and cost.
+#
+# Usage:  ./bench.sh [SECONDS] [--replay CSV | --haul P,H,T]
+#
+# Every run starts from an empty card at the same RTC time with the same load
+# source, so results only change when the firmware or the cost model does.
+#
+#   read      conversions the firmware read from the NAU7802 (the rest were
+#             overwritten before it got to them)
+#   on_card   records in the log at the stop time
+#   us/read   working time per conversion read, not counting polling for the next one
+#   cpu%      share of the time spent working
+#   bytes/h   SD card bytes written per hour
+
+set -e
+cd "$(dirname "$0")"
+
+SECONDS_TO_RUN=${1:-600}
+[ $# -gt 0 ] && shift
+SOURCE=${*:---haul 800,20,120}
+START=1790000000
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+make -s lcl_sim
+
+# label log_format log_interval sync_interval
+CASES="csv-1s        0 1000 10000
+csv-100ms      0 100  10000
+csv-all        0 0    10000
+bin-1s         1 1000 10000
+bin-all        1 0    10000
+bin-all-sync1s 1 0    1000
+packed-all     2 0    10000"
+
+printf '%-16s %8s %9s %9s %9s %8s %6s %10s\n' config seconds conv read on_card us/read cpu% bytes/h
+echo "$CASES" | while read -r label format interval sync; do
+  card="$WORK/$label"
+  mkdir -p "$card"
+  cat > "$WORK/$label.txt" <<EOF
+echo = 0
+log_interval = $interval
+sync_interval = $sync
+cal_factor = 44.74
+zero_offset = 4229.00
+trip_value = 1700
+log_format = $format
+deploy_hours = 24
+EOF
+  # shellcheck disable=SC2086
+  ./lcl_sim --sd "$card" --config "$WORK/$label.txt" --start $START --seconds "$SECONDS_TO_RUN" \
+    --report $SOURCE | while IFS="$(printf '\t')" read -r secs conv read logged us cpu bph serial; do
+    printf '%-16s %8s %9s %9s %9s %8s %6s %10s\n' "$label" "$secs" "$conv" "$read" "$logged" "$us" "$cpu" "$bph"
+  done
+done
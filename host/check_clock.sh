@@ -0,0 +1,63 @@
+#!/bin/sh
+# Clock check: runs the firmware in the simulator past the micros() wrap (71.6
+# minutes) with RTC reads and the RTC fast, slow and exact, then decodes the
+# log and every event capture and checks that record times and UTC only ever
+# step forward, and by no more than a minute.
+#
+# Usage:  ./check_clock.sh [SECONDS]
+#
+# Prints one line per run and exits non zero if any file fails.
+
+set -e
+cd "$(dirname "$0")"
+
+SECONDS_TO_RUN=${1:-4500}
+START=1790000000
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+make -s lcl_sim lcl_decode
+
+cat > "$WORK/config.txt" <<EOF
+echo = 0
+log_interval = 1000
+sync_interval = 10000
+cal_factor = 44.74
+zero_offset = 4229.00
+trip_value = 1700
+log_format = 1
+deploy_hours = 24
+EOF
+
+# Fails on a record whose micros or time is behind the one before it or more than
+# a minute on. ISO times in one form sort as text.
+check() {
+  ./lcl_decode "$1" 2>/dev/null | awk -F, -v file="$1" '
+    NR == 1 { next }
+    NR > 2 && ($NF < us || $NF - us > 60000000 || $2 < utc) {
+      printf "%s: %s,%s after %s,%s\n", file, $NF, $2, us, utc; bad = 1; exit
+    }
+    { us = $NF; utc = $2 }
+    END {
+      if (NR < 2) { printf "%s: no records\n", file; exit 1 }
+      exit bad
+    }'
+}
+
+failed=0
+for ppm in 0 20 -20; do
+  card="$WORK/card$ppm"
+  mkdir -p "$card"
+  ./lcl_sim --sd "$card" --config "$WORK/config.txt" --start $START --seconds "$SECONDS_TO_RUN" \
+    --rtc-ppm $ppm --haul 800,20,120 --quiet --no-stdin > /dev/null 2>&1
+  files=0
+  bad=0
+  for file in "$card"/*.BIN "$card"/*.EVT; do
+    [ "$(head -c 4 "$file")" = LCLB ] || continue
+    files=$((files + 1))
+    check "$file" || bad=$((bad + 1))
+  done
+  printf 'rtc %+4d ppm  %d files  %d failed\n' $ppm $files $bad
+  [ $bad -eq 0 ] || failed=1
+done
+exit $failed
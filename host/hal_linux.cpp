@@ -0,0 +1,1018 @@
+/*
+Linux backend for the logger hardware abstraction. See hal_linux.h.
+*/
+
+#include "hal_linux.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+HalSerial Serial;
+TwoWire Wire;
+HalCosts hal_costs;
+HalStats hal_stats;
+
+// ***********************************************************************
+// * VIRTUAL TIME
+// ***********************************************************************
+static HalConfig config;
+static uint64_t clock_us = 0;
+static int isr_depth = 0;
+static bool stopping = false;
+static void (*stop_callback)(void) = NULL;
+
+static void (*irq_handlers[NUM_PINS])(void);
+static uint32_t pin_values[NUM_PINS];
+
+// Load cell conversion state
+static SoakSensor default_sensor;
+static SimSensor *sensor = &default_sensor;
+static uint32_t conversion_us = 3125;
+static uint64_t next_conversion_us = 3125;
+static int32_t adc_register = 0;
+static bool adc_ready = false;
+
+// RTC square wave: the number of the next 1 Hz edge, and whether it is enabled
+static uint64_t next_sqw_index = 1;
+static bool sqw_enabled = false;
+
+// Virtual time of RTC second boundary number index
+static uint64_t sqwTime(uint64_t index) {
+  return (uint64_t)ceil(index * 1e6 / (1.0 + config.rtc_ppm / 1e6));
+}
+
+static void runIsr(int pin) {
+  if (pin < 0 || pin >= NUM_PINS || irq_handlers[pin] == NULL) return;
+  isr_depth++;
+  irq_handlers[pin]();
+  isr_depth--;
+}
+
+// Complete the conversion due at clock_us
+static void convert() {
+  adc_register = sensor->rawAt(clock_us);
+  hal_stats.conversions++;
+  bool edge = !adc_ready;
+  adc_ready = true;
+  // DRDY stays high until the result is read, so an unread result gives no new edge
+  if (edge) runIsr(config.drdy_pin);
+}
+
+// Host clock, for HalConfig::realtime
+static uint64_t host_start_us = 0;
+
+static uint64_t hostMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Move virtual time forward, firing whatever falls due on the way. busy is false
+// for delay(), where the Feather would be idling rather than working.
+static void advance(uint64_t us, bool busy) {
+  if (busy) hal_stats.busy_us += us;
+  if (isr_depth > 0) {
+    clock_us += us;
+    return;
+  }
+  uint64_t target = clock_us + us;
+  while (true) {
+    uint64_t next_sqw_us = sqwTime(next_sqw_index);
+    if (next_conversion_us <= target && next_conversion_us <= next_sqw_us) {
+      if (next_conversion_us > clock_us) clock_us = next_conversion_us;
+      next_conversion_us += conversion_us;
+      convert();
+    } else if (next_sqw_us <= target) {
+      if (next_sqw_us > clock_us) clock_us = next_sqw_us;
+      next_sqw_index++;
+      if (sqw_enabled) runIsr(config.sqw_pin);
+    } else {
+      break;
+    }
+  }
+  if (target > clock_us) clock_us = target;
+  if (config.realtime) {
+    uint64_t wall_us = hostMicros() - host_start_us;
+    if (clock_us > wall_us + 1000) usleep(clock_us - wall_us);
+  }
+  if (config.stop_us != 0 && clock_us >= config.stop_us && !stopping) {
+    stopping = true;
+    if (stop_callback) stop_callback();
+    fflush(NULL);
+    exit(0);
+  }
+}
+
+uint64_t halMicros64() { return clock_us; }
+void halAdvance(uint64_t us) { advance(us, true); }
+void halOnStop(void (*callback)(void)) { stop_callback = callback; }
+uint32_t halPinValue(uint32_t pin) { return pin < NUM_PINS ? pin_values[pin] : 0; }
+
+static void i2cTransaction(uint32_t bytes) {
+  hal_stats.i2c_transactions++;
+  advance(hal_costs.i2c_overhead_us + bytes * hal_costs.i2c_byte_us, true);
+}
+
+// ***********************************************************************
+// * ARDUINO CORE
+// ***********************************************************************
+uint32_t millis() {
+  advance(hal_costs.clock_read_us, true);
+  return (uint32_t)(clock_us / 1000);
+}
+
+uint32_t micros() {
+  advance(hal_costs.clock_read_us, true);
+  return (uint32_t)clock_us;
+}
+
+void delay(uint32_t ms) { advance((uint64_t)ms * 1000, false); }
+void delayMicroseconds(uint32_t us) { advance(us, true); }
+
+void pinMode(uint32_t pin, uint32_t mode) { (void)pin; (void)mode; }
+
+void digitalWrite(uint32_t pin, uint32_t value) {
+  if (pin < NUM_PINS) pin_values[pin] = value;
+  advance(hal_costs.pin_us, true);
+}
+
+int digitalRead(uint32_t pin) {
+  advance(hal_costs.pin_us, true);
+  if ((int)pin == config.drdy_pin) return adc_ready ? HIGH : LOW;
+  return pin < NUM_PINS ? (pin_values[pin] ? HIGH : LOW) : LOW;
+}
+
+void analogWrite(uint32_t pin, uint32_t value) {
+  if (pin < NUM_PINS) pin_values[pin] = value;
+  advance(hal_costs.pin_us, true);
+}
+
+// Only the battery divider on A7 is connected: half the battery voltage against 3.3 V, 10 bits
+int analogRead(uint32_t pin) {
+  advance(hal_costs.adc_us, true);
+  if (pin != A7) return 0;
+  return (int)(config.battery_mv / 2.0 / 3300.0 * 1024.0);
+}
+
+int digitalPinToInterrupt(uint32_t pin) { return (int)pin; }
+
+void attachInterrupt(int irq, void (*callback)(void), uint32_t mode) {
+  (void)mode;
+  if (irq >= 0 && irq < NUM_PINS) irq_handlers[irq] = callback;
+}
+
+void detachInterrupt(int irq) {
+  if (irq >= 0 && irq < NUM_PINS) irq_handlers[irq] = NULL;
+}
+
+void interrupts() {}
+void noInterrupts() {}
+
+static uint64_t nextSerialInput();
+
+void halSleep() {
+  uint64_t wake = (clock_us / 1000 + 1) * 1000;
+  if (config.drdy_pin >= 0 && irq_handlers[config.drdy_pin] && next_conversion_us < wake) {
+    wake = next_conversion_us;
+  }
+  if (sqw_enabled && irq_handlers[config.sqw_pin] && sqwTime(next_sqw_index) < wake) {
+    wake = sqwTime(next_sqw_index);
+  }
+  uint64_t input_us = nextSerialInput();
+  if (input_us < wake) wake = input_us > clock_us ? input_us : clock_us;
+  uint64_t start = clock_us;
+  advance(wake - clock_us, false);
+  hal_stats.sleep_us += clock_us - start;
+}
+
+// Print and Stream, following the Arduino core's formatting
+size_t Print::write(const uint8_t *buffer, size_t size) {
+  size_t n = 0;
+  while (size--) n += write(*buffer++);
+  return n;
+}
+
+size_t Print::print(long n, int base) {
+  if (base == 10 && n < 0) {
+    return print('-') + printNumber((unsigned long)(-n), 10);
+  }
+  return printNumber((unsigned long)n, base);
+}
+
+size_t Print::printNumber(unsigned long n, int base) {
+  char buf[8 * sizeof(long) + 1];
+  char *str = &buf[sizeof(buf) - 1];
+  *str = '\0';
+  if (base < 2) base = 10;
+  do {
+    char c = n % base;
+    n /= base;
+    *--str = c < 10 ? c + '0' : c + 'A' - 10;
+  } while (n);
+  return write(str);
+}
+
+size_t Print::printFloat(double number, int digits) {
+  if (isnan(number)) return print("nan");
+  if (isinf(number)) return print("inf");
+  if (number > 4294967040.0 || number < -4294967040.0) return print("ovf");
+  size_t n = 0;
+  if (number < 0.0) {
+    n += print('-');
+    number = -number;
+  }
+  double rounding = 0.5;
+  for (int i = 0; i < digits; i++) rounding /= 10.0;
+  number += rounding;
+  unsigned long int_part = (unsigned long)number;
+  double remainder = number - (double)int_part;
+  n += print(int_part);
+  if (digits > 0) n += print('.');
+  while (digits-- > 0) {
+    remainder *= 10.0;
+    unsigned int digit = (unsigned int)remainder;
+    n += print(digit);
+    remainder -= digit;
+  }
+  return n;
+}
+
+int Stream::timedRead() {
+  uint32_t start = millis();
+  do {
+    int c = read();
+    if (c >= 0) return c;
+    delay(1);
+  } while (millis() - start < timeout_);
+  return -1;
+}
+
+int Stream::timedPeek() {
+  uint32_t start = millis();
+  do {
+    int c = peek();
+    if (c >= 0) return c;
+    delay(1);
+  } while (millis() - start < timeout_);
+  return -1;
+}
+
+long Stream::parseInt() {
+  int c;
+  do {
+    c = timedPeek();
+    if (c < 0) return 0;
+    if (c == '-' || (c >= '0' && c <= '9')) break;
+    read();
+  } while (true);
+  bool negative = false;
+  long value = 0;
+  do {
+    if (c == '-') {
+      negative = true;
+    } else {
+      value = value * 10 + c - '0';
+    }
+    read();
+    c = timedPeek();
+  } while (c >= '0' && c <= '9');
+  return negative ? -value : value;
+}
+
+float Stream::parseFloat() {
+  int c;
+  do {
+    c = timedPeek();
+    if (c < 0) return 0;
+    if (c == '-' || c == '.' || (c >= '0' && c <= '9')) break;
+    read();
+  } while (true);
+  bool negative = false;
+  bool fraction = false;
+  double value = 0;
+  double scale = 1.0;
+  do {
+    if (c == '-') {
+      negative = true;
+    } else if (c == '.') {
+      fraction = true;
+    } else {
+      value = value * 10 + c - '0';
+      if (fraction) scale *= 0.1;
+    }
+    read();
+    c = timedPeek();
+  } while ((c >= '0' && c <= '9') || (c == '.' && !fraction));
+  value *= scale;
+  return negative ? -value : value;
+}
+
+size_t Stream::readBytes(char *buffer, size_t length) {
+  size_t count = 0;
+  while (count < length) {
+    int c = timedRead();
+    if (c < 0) break;
+    *buffer++ = (char)c;
+    count++;
+  }
+  return count;
+}
+
+// ***********************************************************************
+// * SERIAL
+// ***********************************************************************
+struct ScheduledInput {
+  uint64_t at_us;
+  std::string text;
+};
+static std::vector<ScheduledInput> scheduled_input;
+static std::deque<char> serial_rx;
+static bool stdin_open = true;
+
+static uint64_t nextSerialInput() {
+  return scheduled_input.empty() ? UINT64_MAX : scheduled_input.front().at_us;
+}
+
+void halSerialInput(uint64_t at_us, const char *text) {
+  ScheduledInput input = {at_us, text};
+  auto it = scheduled_input.begin();
+  while (it != scheduled_input.end() && it->at_us <= at_us) ++it;
+  scheduled_input.insert(it, input);
+}
+
+static void pollSerialInput() {
+  while (!scheduled_input.empty() && scheduled_input.front().at_us <= clock_us) {
+    for (char c : scheduled_input.front().text) serial_rx.push_back(c);
+    scheduled_input.erase(scheduled_input.begin());
+  }
+  int fd = config.serial_fd >= 0 ? config.serial_fd : STDIN_FILENO;
+  if ((config.serial_fd < 0 && !config.serial_stdin) || !stdin_open) return;
+  struct pollfd pfd = {fd, POLLIN, 0};
+  if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & (POLLIN | POLLHUP))) return;
+  char buf[256];
+  ssize_t n = ::read(fd, buf, sizeof(buf));
+  if (n <= 0) {
+    stdin_open = false;
+    return;
+  }
+  for (ssize_t i = 0; i < n; i++) serial_rx.push_back(buf[i]);
+}
+
+int HalSerial::available() {
+  advance(hal_costs.serial_poll_us, true);
+  pollSerialInput();
+  return (int)serial_rx.size();
+}
+
+int HalSerial::read() {
+  pollSerialInput();
+  if (serial_rx.empty()) return -1;
+  char c = serial_rx.front();
+  serial_rx.pop_front();
+  return (uint8_t)c;
+}
+
+int HalSerial::peek() {
+  pollSerialInput();
+  return serial_rx.empty() ? -1 : (uint8_t)serial_rx.front();
+}
+
+size_t HalSerial::write(uint8_t c) { return write(&c, 1); }
+
+size_t HalSerial::write(const uint8_t *buffer, size_t size) {
+  hal_stats.serial_bytes_out += size;
+  advance((uint64_t)size * hal_costs.serial_byte_us, true);
+  if (config.serial_fd >= 0) {
+    // Blocks while the other end isn't reading, like USB flow control
+    size_t done = 0;
+    while (done < size) {
+      ssize_t n = ::write(config.serial_fd, buffer + done, size - done);
+      if (n < 0 && errno != EINTR && errno != EAGAIN) break;
+      if (n > 0) done += n;
+    }
+    return size;
+  }
+  if (!config.serial_quiet) fwrite(buffer, 1, size, config.serial_out ? config.serial_out : stdout);
+  return size;
+}
+
+// ***********************************************************************
+// * RTC
+// ***********************************************************************
+// Days since 1970-01-01 for a civil date, and back (H. Hinnant's algorithms)
+static int64_t daysFromCivil(int64_t y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  int64_t era = (y >= 0 ? y : y - 399) / 400;
+  unsigned yoe = (unsigned)(y - era * 400);
+  unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (int64_t)doe - 719468;
+}
+
+DateTime::DateTime(uint32_t t) {
+  int64_t z = t / 86400 + 719468;
+  uint32_t secs = t % 86400;
+  int64_t era = z / 146097;
+  unsigned doe = (unsigned)(z - era * 146097);
+  unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  unsigned mp = (5 * doy + 2) / 153;
+  d_ = doy - (153 * mp + 2) / 5 + 1;
+  m_ = mp < 10 ? mp + 3 : mp - 9;
+  y_ = (uint16_t)(yoe + era * 400 + (m_ <= 2));
+  hh_ = secs / 3600;
+  mm_ = secs / 60 % 60;
+  ss_ = secs % 60;
+}
+
+DateTime::DateTime(uint16_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t min, uint8_t sec)
+    : y_(year < 100 ? year + 2000 : year), m_(month), d_(day), hh_(hour), mm_(min), ss_(sec) {}
+
+// Compiler __DATE__ "Mmm dd yyyy" and __TIME__ "hh:mm:ss"
+DateTime::DateTime(const char *date, const char *time) {
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  const char *found = strstr(months, std::string(date, 3).c_str());
+  m_ = found ? (found - months) / 3 + 1 : 1;
+  d_ = atoi(date + 4);
+  y_ = atoi(date + 7);
+  hh_ = atoi(time);
+  mm_ = atoi(time + 3);
+  ss_ = atoi(time + 6);
+}
+
+uint32_t DateTime::unixtime() const {
+  return (uint32_t)(daysFromCivil(y_, m_, d_) * 86400 + hh_ * 3600 + mm_ * 60 + ss_);
+}
+
+static int64_t rtc_base_unix = 0; // RTC time at virtual time zero
+
+// Whole seconds the RTC has counted since virtual time zero
+static int64_t rtcSeconds() {
+  return (int64_t)((double)clock_us * (1.0 + config.rtc_ppm / 1e6) / 1e6);
+}
+
+void RTC_PCF8523::writeSqwPinMode(Pcf8523SqwPinMode mode) {
+  i2cTransaction(2);
+  sqw_enabled = mode == PCF8523_SquareWave1HZ && config.sqw_pin >= 0;
+}
+
+bool RTC_PCF8523::initialized() {
+  i2cTransaction(1);
+  return true;
+}
+
+void RTC_PCF8523::adjust(const DateTime &dt) {
+  i2cTransaction(8);
+  rtc_base_unix = 0;
+  rtc_base_unix = (int64_t)dt.unixtime() - rtcSeconds();
+}
+
+DateTime RTC_PCF8523::now() {
+  i2cTransaction(7);
+  return DateTime((uint32_t)(rtc_base_unix + rtcSeconds()));
+}
+
+// ***********************************************************************
+// * LOAD CELL
+// ***********************************************************************
+int32_t SoakSensor::rawAt(uint64_t t_us) {
+  (void)t_us;
+  lcg_ = lcg_ * 1103515245 + 12345;
+  return offset_ + (int32_t)((lcg_ >> 16) % (2 * noise_ + 1)) - noise_;
+}
+
+// As the library: with initialize, reset and power up, then gain 128 at 80 samples per
+// second and an AFE calibration, which the firmware then changes and repeats
+bool NAU7802::begin(TwoWire &wire, bool initialize) {
+  (void)wire;
+  if (!isConnected()) return false;
+  if (!initialize) return true;
+  reset();
+  powerUp();
+  setLDO(NAU7802_LDO_3V3);
+  setGain(NAU7802_GAIN_128);
+  setSampleRate(NAU7802_SPS_80);
+  setRegister(NAU7802_ADC, getRegister(NAU7802_ADC) | 0x30);
+  setBit(NAU7802_PGA_PWR_PGA_CAP_EN, NAU7802_PGA_PWR);
+  calibrateAFE();
+  return true;
+}
+
+bool NAU7802::isConnected() {
+  i2cTransaction(1);
+  return true;
+}
+
+// Register reset, then the library waits a millisecond before clearing it
+bool NAU7802::reset() {
+  i2cTransaction(4);
+  delay(1);
+  i2cTransaction(4);
+  return true;
+}
+
+// The power up ready bit comes up after about 200 us of polling
+bool NAU7802::powerUp() {
+  i2cTransaction(8);
+  delayMicroseconds(200);
+  i2cTransaction(4);
+  return true;
+}
+
+bool NAU7802::setLDO(uint8_t ldoValue) {
+  (void)ldoValue;
+  i2cTransaction(8);
+  return true;
+}
+
+uint8_t NAU7802::getRegister(uint8_t registerAddress) {
+  (void)registerAddress;
+  i2cTransaction(2);
+  return 0;
+}
+
+bool NAU7802::setRegister(uint8_t registerAddress, uint8_t value) {
+  (void)registerAddress;
+  (void)value;
+  i2cTransaction(2);
+  return true;
+}
+
+bool NAU7802::setBit(uint8_t bitNumber, uint8_t registerAddress) {
+  setRegister(registerAddress, getRegister(registerAddress) | (1 << bitNumber));
+  return true;
+}
+
+bool NAU7802::clearBit(uint8_t bitNumber, uint8_t registerAddress) {
+  setRegister(registerAddress, getRegister(registerAddress) & ~(1 << bitNumber));
+  return true;
+}
+
+bool NAU7802::available() {
+  uint64_t start = clock_us;
+  i2cTransaction(1);
+  if (!adc_ready) hal_stats.idle_poll_us += clock_us - start;
+  return adc_ready;
+}
+
+int32_t NAU7802::getReading() {
+  i2cTransaction(3);
+  if (adc_ready) hal_stats.conversions_read++;
+  adc_ready = false;
+  return adc_register;
+}
+
+// Same as the library: wait for each conversion, give up with 0 on timeout
+int32_t NAU7802::getAverage(uint8_t samplesToTake, unsigned long timeout_ms) {
+  int64_t total = 0;
+  uint8_t samples = 0;
+  uint32_t start = millis();
+  while (true) {
+    if (available()) {
+      total += getReading();
+      if (++samples == samplesToTake) break;
+    }
+    if (millis() - start > timeout_ms) return 0;
+    delay(1);
+  }
+  return (int32_t)(total / samplesToTake);
+}
+
+void NAU7802::calculateZeroOffset(uint8_t averageAmount, unsigned long timeout_ms) {
+  setZeroOffset(getAverage(averageAmount, timeout_ms));
+}
+
+void NAU7802::calculateCalibrationFactor(float weightOnScale, uint8_t averageAmount, unsigned long timeout_ms) {
+  int32_t onScale = getAverage(averageAmount, timeout_ms);
+  setCalibrationFactor((onScale - zero_offset_) / weightOnScale);
+}
+
+float NAU7802::getWeight(bool allowNegativeWeights, uint8_t samplesToTake, unsigned long timeout_ms) {
+  int32_t onScale = getAverage(samplesToTake, timeout_ms);
+  if (!allowNegativeWeights && onScale < zero_offset_) onScale = zero_offset_;
+  return (onScale - zero_offset_) / cal_factor_;
+}
+
+bool NAU7802::setSampleRate(uint8_t rate) {
+  static const uint16_t rates[] = {10, 20, 40, 80, 80, 80, 80, 320};
+  i2cTransaction(2);
+  conversion_us = 1000000 / rates[rate & 7];
+  next_conversion_us = clock_us + conversion_us;
+  return true;
+}
+
+// Internal offset calibration takes a few conversion cycles
+bool NAU7802::calibrateAFE() {
+  i2cTransaction(4);
+  delay(4 * conversion_us / 1000);
+  return true;
+}
+
+// ***********************************************************************
+// * SD CARD
+// ***********************************************************************
+// Pre-allocated files, by host path, and the card sectors they occupy
+struct Extent {
+  uint32_t first;
+  uint32_t last;
+};
+static std::map<std::string, Extent> extents;
+static uint32_t next_free_sector = 0x2000;
+static uint64_t card_busy_until = 0;
+static uint64_t card_sectors_programmed = 0;
+static int stream_fd = -1;
+static uint32_t stream_sector = 0;
+static std::string stream_path;
+
+static void cardWaitReady() {
+  if (card_busy_until > clock_us) advance(card_busy_until - clock_us, true);
+}
+
+static void cardProgrammed() {
+  card_sectors_programmed++;
+  uint64_t busy = hal_costs.sd_program_us;
+  if (hal_costs.sd_stall_every && card_sectors_programmed % hal_costs.sd_stall_every == 0) {
+    busy = hal_costs.sd_stall_us;
+  }
+  card_busy_until = clock_us + busy;
+  hal_stats.sd_sectors_written++;
+  hal_stats.sd_bytes_written += 512;
+}
+
+static const Extent *findExtent(uint32_t sector, std::string *path) {
+  for (auto &entry : extents) {
+    if (sector >= entry.second.first && sector <= entry.second.last) {
+      if (path) *path = entry.first;
+      return &entry.second;
+    }
+  }
+  return NULL;
+}
+
+static bool sectorIo(uint32_t sector, uint8_t *dst, const uint8_t *src) {
+  std::string path;
+  const Extent *extent = findExtent(sector, &path);
+  if (!extent) return false;
+  int fd = ::open(path.c_str(), src ? O_WRONLY : O_RDONLY);
+  if (fd < 0) return false;
+  off_t offset = (off_t)(sector - extent->first) * 512;
+  ssize_t n = src ? pwrite(fd, src, 512, offset) : pread(fd, dst, 512, offset);
+  if (dst && n >= 0 && n < 512) memset(dst + n, 0, 512 - n);
+  ::close(fd);
+  return n >= 0;
+}
+
+bool SdCard::isBusy() {
+  advance(hal_costs.pin_us, true);
+  return card_busy_until > clock_us;
+}
+
+bool SdCard::erase(uint32_t firstSector, uint32_t lastSector) {
+  std::string path;
+  const Extent *extent = findExtent(firstSector, &path);
+  if (!extent || lastSector > extent->last) return false;
+  cardWaitReady();
+  // Erase to zeros. Dropping and re-extending the file does that without writing them.
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) return false;
+  off_t start = (off_t)(firstSector - extent->first) * 512;
+  off_t end = (off_t)(lastSector - extent->first + 1) * 512;
+  if (end >= st.st_size) {
+    if (::truncate(path.c_str(), start) != 0 || ::truncate(path.c_str(), st.st_size) != 0) return false;
+  } else {
+    static const uint8_t zeros[512] = {0};
+    for (uint32_t s = firstSector; s <= lastSector; s++) sectorIo(s, NULL, zeros);
+  }
+  card_busy_until = clock_us + hal_costs.sd_erase_us;
+  return true;
+}
+
+bool SdCard::readSector(uint32_t sector, uint8_t *dst) {
+  cardWaitReady();
+  advance(hal_costs.sd_sector_us, true);
+  return sectorIo(sector, dst, NULL);
+}
+
+// Single sector write, which SdFat waits out the programming of
+bool SdCard::writeSector(uint32_t sector, const uint8_t *src) {
+  cardWaitReady();
+  advance(hal_costs.sd_sector_us, true);
+  bool ok = sectorIo(sector, NULL, src);
+  cardProgrammed();
+  cardWaitReady();
+  return ok;
+}
+
+bool SdCard::writeStart(uint32_t sector) {
+  cardWaitReady();
+  advance(hal_costs.sd_sector_us / 8, true);
+  std::string path;
+  if (!findExtent(sector, &path)) return false;
+  if (stream_fd >= 0) ::close(stream_fd);
+  stream_fd = ::open(path.c_str(), O_WRONLY);
+  stream_path = path;
+  stream_sector = sector;
+  return stream_fd >= 0;
+}
+
+bool SdCard::writeData(const uint8_t *src) {
+  if (stream_fd < 0) return false;
+  cardWaitReady();
+  advance(hal_costs.sd_sector_us, true);
+  auto it = extents.find(stream_path);
+  if (it == extents.end() || stream_sector > it->second.last) return false;
+  off_t offset = (off_t)(stream_sector - it->second.first) * 512;
+  if (pwrite(stream_fd, src, 512, offset) != 512) return false;
+  stream_sector++;
+  cardProgrammed();
+  return true;
+}
+
+bool SdCard::writeStop() {
+  cardWaitReady();
+  advance(hal_costs.sd_sector_us / 8, true);
+  if (stream_fd >= 0) ::close(stream_fd);
+  stream_fd = -1;
+  card_busy_until = clock_us + hal_costs.sd_program_us;
+  return true;
+}
+
+// FAT names are case insensitive. Find the host entry matching a card path, or
+// build the host path a new entry should get.
+static std::string hostPath(const char *path, bool *exists) {
+  std::string dir = config.sd_root;
+  while (*path == '/') path++;
+  *exists = true;
+  if (*path == '\0') return dir;
+  std::string name = path;
+  DIR *d = opendir(dir.c_str());
+  if (d) {
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+      if (strcasecmp(entry->d_name, name.c_str()) == 0) {
+        name = entry->d_name;
+        closedir(d);
+        return dir + "/" + name;
+      }
+    }
+    closedir(d);
+  }
+  *exists = false;
+  return dir + "/" + name;
+}
+
+bool SdFat::begin(uint8_t csPin) {
+  (void)csPin;
+  advance(hal_costs.sd_command_us * 4, true);
+  ::mkdir(config.sd_root, 0777);
+  struct stat st;
+  return stat(config.sd_root, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+bool SdFat::exists(const char *path) {
+  advance(hal_costs.sd_command_us, true);
+  bool found;
+  hostPath(path, &found);
+  return found;
+}
+
+bool SdFat::remove(const char *path) {
+  advance(hal_costs.sd_command_us, true);
+  bool found;
+  std::string host = hostPath(path, &found);
+  if (!found) return false;
+  extents.erase(host);
+  return ::unlink(host.c_str()) == 0;
+}
+
+bool SdFat::rename(const char *oldPath, const char *newPath) {
+  advance(hal_costs.sd_command_us, true);
+  bool found;
+  std::string from = hostPath(oldPath, &found);
+  if (!found) return false;
+  std::string to = hostPath(newPath, &found);
+  if (found) return false;
+  auto it = extents.find(from);
+  if (it != extents.end()) {
+    extents[to] = it->second;
+    extents.erase(it);
+  }
+  return ::rename(from.c_str(), to.c_str()) == 0;
+}
+
+bool SdFat::mkdir(const char *path) {
+  advance(hal_costs.sd_command_us, true);
+  bool found;
+  std::string host = hostPath(path, &found);
+  return !found && ::mkdir(host.c_str(), 0777) == 0;
+}
+
+File SdFat::open(const char *path, oflag_t oflag) {
+  advance(hal_costs.sd_command_us, true);
+  bool found;
+  std::string host = hostPath(path, &found);
+  if (!found && !(oflag & O_CREAT)) return File();
+  if (found && (oflag & O_CREAT) && (oflag & O_EXCL)) return File();
+  File file;
+  file.openHost(host.c_str(), oflag);
+  return file;
+}
+
+// ***********************************************************************
+// * FILE
+// ***********************************************************************
+// A directory opens as a DIR*, anything else as a file descriptor
+bool File::openHost(const char *host, oflag_t oflag) {
+  release();
+  snprintf(path_, sizeof(path_), "%s", host);
+  pos_ = 0;
+  struct stat st;
+  if (stat(path_, &st) == 0 && S_ISDIR(st.st_mode)) {
+    dir_ = opendir(path_);
+    return dir_ != NULL;
+  }
+  flags_ = oflag;
+  fd_ = ::open(path_, oflag & ~O_AT_END, 0666);
+  if (fd_ < 0) return false;
+  pos_ = (oflag & O_AT_END) ? fileSize() : 0;
+  auto it = extents.find(path_);
+  first_sector_ = it != extents.end() ? it->second.first : 0;
+  last_sector_ = it != extents.end() ? it->second.last : 0;
+  return true;
+}
+
+File::File(const File &other) { *this = other; }
+
+File &File::operator=(const File &other) {
+  if (this == &other) return *this;
+  release();
+  strcpy(path_, other.path_);
+  flags_ = other.flags_;
+  pos_ = other.pos_;
+  first_sector_ = other.first_sector_;
+  last_sector_ = other.last_sector_;
+  if (other.fd_ >= 0) fd_ = dup(other.fd_);
+  if (other.dir_) dir_ = opendir(path_);
+  return *this;
+}
+
+File::~File() { release(); }
+
+void File::release() {
+  if (fd_ >= 0) ::close(fd_);
+  if (dir_) closedir((DIR *)dir_);
+  fd_ = -1;
+  dir_ = NULL;
+}
+
+size_t File::getName(char *name, size_t size) {
+  const char *slash = strrchr(path_, '/');
+  snprintf(name, size, "%s", slash ? slash + 1 : path_);
+  return strlen(name);
+}
+
+uint64_t File::fileSize() const {
+  struct stat st;
+  if (fd_ < 0 || fstat(fd_, &st) != 0) return 0;
+  return st.st_size;
+}
+
+bool File::seekSet(uint64_t pos) {
+  if (fd_ < 0 || pos > fileSize()) return false;
+  pos_ = pos;
+  return true;
+}
+
+int File::available() {
+  uint64_t size = fileSize();
+  uint64_t left = size > pos_ ? size - pos_ : 0;
+  return left > 0x7FFF ? 0x7FFF : (int)left;
+}
+
+int File::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+int File::read(void *buf, size_t count) {
+  if (fd_ < 0) return -1;
+  ssize_t n = pread(fd_, buf, count, pos_);
+  if (n < 0) return -1;
+  pos_ += n;
+  // Whole sectors move over SPI, partial ones come out of SdFat's cache
+  advance(1 + (uint64_t)n * hal_costs.sd_sector_us / 512, true);
+  return (int)n;
+}
+
+int File::peek() {
+  uint8_t c;
+  if (fd_ < 0 || pread(fd_, &c, 1, pos_) != 1) return -1;
+  return c;
+}
+
+size_t File::write(const uint8_t *buf, size_t count) {
+  if (fd_ < 0 || (flags_ & O_ACCMODE) == O_RDONLY) return 0;
+  if (flags_ & O_APPEND) pos_ = fileSize();
+  ssize_t n = pwrite(fd_, buf, count, pos_);
+  if (n < 0) return 0;
+  // Each sector boundary crossed flushes SdFat's cache and waits out programming
+  uint64_t sectors = (pos_ + n) / 512 - pos_ / 512;
+  pos_ += n;
+  hal_stats.sd_bytes_written += n;
+  advance(1 + (uint64_t)n / 16, true);
+  for (uint64_t i = 0; i < sectors; i++) {
+    cardWaitReady();
+    advance(hal_costs.sd_sector_us, true);
+    cardProgrammed();
+  }
+  return n;
+}
+
+// Writing back the cached sector, the directory entry and the FAT
+bool File::sync() {
+  if (fd_ < 0) return false;
+  cardWaitReady();
+  advance(hal_costs.sd_command_us, true);
+  return true;
+}
+
+bool File::truncate(uint64_t length) {
+  if (fd_ < 0 || ftruncate(fd_, length) != 0) return false;
+  if (pos_ > length) pos_ = length;
+  auto it = extents.find(path_);
+  if (it != extents.end()) {
+    it->second.last = it->second.first + (uint32_t)((length + 511) / 512) - 1;
+    last_sector_ = it->second.last;
+  }
+  advance(hal_costs.sd_command_us, true);
+  return true;
+}
+
+// Claim a contiguous run of card sectors for the file and extend it to length
+bool File::preAllocate(uint64_t length) {
+  if (fd_ < 0 || length == 0 || fileSize() != 0) return false;
+  if (ftruncate(fd_, length) != 0) return false;
+  first_sector_ = next_free_sector;
+  last_sector_ = first_sector_ + (uint32_t)((length + 511) / 512) - 1;
+  next_free_sector = last_sector_ + 1;
+  extents[path_] = Extent{first_sector_, last_sector_};
+  advance(hal_costs.sd_command_us * 2, true);
+  return true;
+}
+
+bool File::contiguousRange(uint32_t *bgnSector, uint32_t *endSector) {
+  // A file left by an earlier run gets its sectors now. Host files are all in one piece.
+  if (first_sector_ == 0 && fd_ >= 0 && fileSize() > 0) {
+    first_sector_ = next_free_sector;
+    last_sector_ = first_sector_ + (uint32_t)((fileSize() + 511) / 512) - 1;
+    next_free_sector = last_sector_ + 1;
+    extents[path_] = Extent{first_sector_, last_sector_};
+  }
+  if (first_sector_ == 0) return false;
+  *bgnSector = first_sector_;
+  *endSector = last_sector_;
+  return true;
+}
+
+File File::openNextFile(oflag_t oflag) {
+  File next;
+  if (!dir_) return next;
+  struct dirent *entry;
+  while ((entry = readdir((DIR *)dir_)) != NULL) {
+    if (entry->d_name[0] == '.') continue;
+    advance(hal_costs.sd_command_us / 4, true);
+    next.openHost((std::string(path_) + "/" + entry->d_name).c_str(), oflag);
+    return next;
+  }
+  return next;
+}
+
+void File::rewindDirectory() {
+  if (dir_) rewinddir((DIR *)dir_);
+}
+
+bool File::close() {
+  if (fd_ >= 0) sync();
+  release();
+  return true;
+}
+
+// ***********************************************************************
+// * SETUP
+// ***********************************************************************
+void halBegin(const HalConfig &cfg) {
+  config = cfg;
+  host_start_us = hostMicros();
+  sensor = config.sensor ? config.sensor : &default_sensor;
+  rtc_base_unix = config.start_unix ? config.start_unix : (int64_t)time(NULL);
+  ::mkdir(config.sd_root, 0777);
+}
@@ -0,0 +1,390 @@
+/*
+Linux backend for the logger hardware abstraction (see hal.h).
+
+Provides the subset of the Arduino core, SdFat, RTClib and NAU7802 library
+interfaces the firmware uses, so the sketch compiles and runs as a native
+program:
+
+  - Time is virtual. It only moves when the firmware waits (delay()) or does
+    something that would take time on the Feather - an I2C transaction, an SD
+    command, a serial write. Costs are rough figures for a 48 MHz SAMD21 with
+    100 kHz I2C and a 12 MHz SPI SD card, set in HalCosts.
+  - The SD card is a host directory. Pre-allocated files are mapped onto a
+    range of card sectors so the raw multi-block write path works, and the
+    card reports busy for a programming time after each sector.
+  - The load cell converts every 1/320 s of virtual time from a pluggable
+    SimSensor source, and fires the DRDY interrupt if one is attached.
+  - Serial output goes to stdout (or nowhere), input comes from stdin and
+    from text scheduled at given virtual times.
+*/
+
+#ifndef HAL_LINUX_H
+#define HAL_LINUX_H
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <fcntl.h>
+
+// ***********************************************************************
+// * ARDUINO CORE
+// ***********************************************************************
+typedef uint8_t byte;
+typedef bool boolean;
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+#define LOW 0x0
+#define HIGH 0x1
+#define CHANGE 2
+#define FALLING 3
+#define RISING 4
+#define DEC 10
+#define HEX 16
+#define A7 9
+#define NUM_PINS 32
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void pinMode(uint32_t pin, uint32_t mode);
+void digitalWrite(uint32_t pin, uint32_t value);
+int digitalRead(uint32_t pin);
+void analogWrite(uint32_t pin, uint32_t value);
+int analogRead(uint32_t pin);
+int digitalPinToInterrupt(uint32_t pin);
+void attachInterrupt(int irq, void (*callback)(void), uint32_t mode);
+void detachInterrupt(int irq);
+void interrupts();
+void noInterrupts();
+// Sleep until the next interrupt: SysTick each millisecond, an attached pin, or serial input
+void halSleep();
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+  size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+
+  size_t print(const __FlashStringHelper *s) { return write((const char *)s); }
+  size_t print(const char *s) { return write(s); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char n, int base = DEC) { return printNumber(n, base); }
+  size_t print(int n, int base = DEC) { return print((long)n, base); }
+  size_t print(unsigned int n, int base = DEC) { return printNumber(n, base); }
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC) { return printNumber(n, base); }
+  size_t print(double n, int digits = 2) { return printFloat(n, digits); }
+
+  size_t println() { return write("\r\n"); }
+  template <typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+  template <typename T> size_t println(T value, int format) { size_t n = print(value, format); return n + println(); }
+
+ private:
+  size_t printNumber(unsigned long n, int base);
+  size_t printFloat(double number, int digits);
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  void setTimeout(unsigned long timeout) { timeout_ = timeout; }
+  long parseInt();
+  float parseFloat();
+  size_t readBytes(char *buffer, size_t length);
+
+ protected:
+  int timedRead();
+  int timedPeek();
+  unsigned long timeout_ = 1000;
+};
+
+// USB serial. Output to stdout unless muted, input from stdin and halSerialInput(),
+// or both through HalConfig::serial_fd
+class HalSerial : public Stream {
+ public:
+  void begin(unsigned long baud) { (void)baud; }
+  operator bool() { return true; }
+  int available();
+  int read();
+  int peek();
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *buffer, size_t size);
+  using Print::write;
+};
+extern HalSerial Serial;
+
+// ***********************************************************************
+// * WIRE
+// ***********************************************************************
+class TwoWire {
+ public:
+  void begin() {}
+  void setClock(uint32_t clock) { (void)clock; }
+};
+extern TwoWire Wire;
+
+// ***********************************************************************
+// * RTCLIB
+// ***********************************************************************
+class DateTime {
+ public:
+  DateTime(uint32_t t = 946684800);
+  DateTime(uint16_t year, uint8_t month, uint8_t day, uint8_t hour = 0, uint8_t min = 0, uint8_t sec = 0);
+  DateTime(const char *date, const char *time);
+  DateTime(const __FlashStringHelper *date, const __FlashStringHelper *time)
+      : DateTime((const char *)date, (const char *)time) {}
+  uint16_t year() const { return y_; }
+  uint8_t month() const { return m_; }
+  uint8_t day() const { return d_; }
+  uint8_t hour() const { return hh_; }
+  uint8_t minute() const { return mm_; }
+  uint8_t second() const { return ss_; }
+  uint32_t unixtime() const;
+
+ private:
+  uint16_t y_;
+  uint8_t m_, d_, hh_, mm_, ss_;
+};
+
+enum Pcf8523SqwPinMode { PCF8523_OFF = 7, PCF8523_SquareWave1HZ = 6, PCF8523_SquareWave32HZ = 5 };
+
+class RTC_PCF8523 {
+ public:
+  void writeSqwPinMode(Pcf8523SqwPinMode mode);
+  bool begin(TwoWire *wire = &Wire) { (void)wire; return true; }
+  bool initialized();
+  bool lostPower() { return !initialized(); }
+  void adjust(const DateTime &dt);
+  DateTime now();
+};
+
+// ***********************************************************************
+// * NAU7802
+// ***********************************************************************
+enum {
+  NAU7802_GAIN_1 = 0, NAU7802_GAIN_2, NAU7802_GAIN_4, NAU7802_GAIN_8,
+  NAU7802_GAIN_16, NAU7802_GAIN_32, NAU7802_GAIN_64, NAU7802_GAIN_128,
+};
+enum {
+  NAU7802_SPS_10 = 0, NAU7802_SPS_20 = 1, NAU7802_SPS_40 = 2, NAU7802_SPS_80 = 3, NAU7802_SPS_320 = 7,
+};
+enum { NAU7802_LDO_3V3 = 0b100 };
+// The registers and bits the firmware sets up itself instead of calling begin()
+enum { NAU7802_ADC = 0x15, NAU7802_PGA = 0x1B, NAU7802_PGA_PWR = 0x1C };
+enum { NAU7802_PGA_LDOMODE = 6 };
+enum { NAU7802_PGA_PWR_PGA_CAP_EN = 7 };
+
+class NAU7802 {
+ public:
+  bool begin(TwoWire &wire = Wire, bool initialize = true);
+  bool isConnected();
+  bool reset();
+  bool powerUp();
+  bool setLDO(uint8_t ldoValue);
+  uint8_t getRegister(uint8_t registerAddress);
+  bool setRegister(uint8_t registerAddress, uint8_t value);
+  bool setBit(uint8_t bitNumber, uint8_t registerAddress);
+  bool clearBit(uint8_t bitNumber, uint8_t registerAddress);
+  bool available();
+  int32_t getReading();
+  int32_t getAverage(uint8_t samplesToTake, unsigned long timeout_ms = 1000);
+  void calculateZeroOffset(uint8_t averageAmount = 8, unsigned long timeout_ms = 1000);
+  void setZeroOffset(int32_t newZeroOffset) { zero_offset_ = newZeroOffset; }
+  int32_t getZeroOffset() { return zero_offset_; }
+  void calculateCalibrationFactor(float weightOnScale, uint8_t averageAmount = 8, unsigned long timeout_ms = 1000);
+  void setCalibrationFactor(float calFactor) { cal_factor_ = calFactor; }
+  float getCalibrationFactor() { return cal_factor_; }
+  float getWeight(bool allowNegativeWeights = false, uint8_t samplesToTake = 8, unsigned long timeout_ms = 1000);
+  bool setGain(uint8_t gainValue) { gain_ = gainValue; return true; }
+  bool setSampleRate(uint8_t rate);
+  bool calibrateAFE();
+
+ private:
+  int32_t zero_offset_ = 0;
+  float cal_factor_ = 1.0;
+  uint8_t gain_ = NAU7802_GAIN_128;
+};
+
+// ***********************************************************************
+// * SDFAT
+// ***********************************************************************
+// Open flags are the POSIX ones, as with SdFat's USE_FCNTL_H option, plus SdFat's O_AT_END
+#define O_AT_END 0x40000000
+#define FILE_READ O_RDONLY
+#define FILE_WRITE (O_RDWR | O_CREAT | O_AT_END)
+typedef int oflag_t;
+
+// Raw card access. Sectors are only backed where a file has been pre-allocated.
+class SdCard {
+ public:
+  bool isBusy();
+  bool erase(uint32_t firstSector, uint32_t lastSector);
+  bool readSector(uint32_t sector, uint8_t *dst);
+  bool writeSector(uint32_t sector, const uint8_t *src);
+  bool writeStart(uint32_t sector);
+  bool writeData(const uint8_t *src);
+  bool writeStop();
+  bool syncDevice() { return !isBusy(); }
+};
+
+class File : public Stream {
+ public:
+  File() {}
+  File(const File &other);
+  File &operator=(const File &other);
+  ~File();
+  operator bool() const { return fd_ >= 0 || dir_ != NULL; }
+  bool isOpen() const { return (bool)*this; }
+  bool isDirectory() const { return dir_ != NULL; }
+  size_t getName(char *name, size_t size);
+  uint64_t fileSize() const;
+  uint64_t size() const { return fileSize(); }
+  uint64_t curPosition() const { return pos_; }
+  uint64_t position() const { return pos_; }
+  bool seekSet(uint64_t pos);
+  bool seek(uint64_t pos) { return seekSet(pos); }
+  int available();
+  int read();
+  int read(void *buf, size_t count);
+  int peek();
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const uint8_t *buf, size_t count);
+  size_t write(const void *buf, size_t count) { return write((const uint8_t *)buf, count); }
+  using Print::write;
+  void flush() { sync(); }
+  bool sync();
+  bool truncate(uint64_t length);
+  bool truncate() { return truncate(pos_); }
+  bool preAllocate(uint64_t length);
+  bool contiguousRange(uint32_t *bgnSector, uint32_t *endSector);
+  bool isContiguous() const { return first_sector_ != 0; }
+  File openNextFile(oflag_t oflag = O_RDONLY);
+  void rewindDirectory();
+  bool close();
+
+ private:
+  friend class SdFat;
+  bool openHost(const char *host, oflag_t oflag);
+  void release();
+  char path_[256] = "";
+  int fd_ = -1;
+  void *dir_ = NULL; // DIR* when this is an open directory
+  oflag_t flags_ = 0;
+  uint64_t pos_ = 0;
+  uint32_t first_sector_ = 0;
+  uint32_t last_sector_ = 0;
+};
+
+class SdFat {
+ public:
+  bool begin(uint8_t csPin);
+  bool exists(const char *path);
+  bool remove(const char *path);
+  bool rename(const char *oldPath, const char *newPath);
+  bool mkdir(const char *path);
+  File open(const char *path, oflag_t oflag = FILE_READ);
+  SdCard *card() { return &card_; }
+
+ private:
+  SdCard card_;
+};
+
+// ***********************************************************************
+// * SIMULATION CONTROL
+// ***********************************************************************
+// Everything below is only for the host program that drives the sketch.
+
+// Approximate time the Feather spends on each operation, in microseconds
+struct HalCosts {
+  uint32_t loop_us = 20;            // Overhead of one pass through loop()
+  uint32_t clock_read_us = 1;       // millis()/micros()
+  uint32_t pin_us = 2;              // digitalRead/Write, analogWrite
+  uint32_t adc_us = 430;            // analogRead() with the default averaging
+  uint32_t i2c_byte_us = 90;        // One byte plus ACK at 100 kHz
+  uint32_t i2c_overhead_us = 200;   // Start, address, register and restart
+  uint32_t serial_byte_us = 1;      // USB CDC write per byte
+  uint32_t serial_poll_us = 5;      // Serial.available()
+  uint32_t sd_sector_us = 380;      // Move 512 bytes over SPI at 12 MHz
+  uint32_t sd_program_us = 700;     // Card busy programming after each sector
+  uint32_t sd_stall_us = 120000;    // Occasional long busy (wear levelling, erase)
+  uint32_t sd_stall_every = 512;    // Sectors between long busy periods
+  uint32_t sd_command_us = 3000;    // open/exists/remove/sync, each a directory walk
+  uint32_t sd_erase_us = 250000;    // Erasing a pre-allocated extent
+};
+extern HalCosts hal_costs;
+
+// Source of load cell conversions. rawAt() is called once per conversion, in order.
+class SimSensor {
+ public:
+  virtual ~SimSensor() {}
+  virtual int32_t rawAt(uint64_t t_us) = 0;
+};
+
+// Quiet soak: a fixed offset with a little deterministic noise
+class SoakSensor : public SimSensor {
+ public:
+  SoakSensor(int32_t offset = 4229, int32_t noise = 20) : offset_(offset), noise_(noise) {}
+  int32_t rawAt(uint64_t t_us);
+
+ private:
+  int32_t offset_, noise_;
+  uint32_t lcg_ = 12345;
+};
+
+// Counters kept by the simulated hardware
+struct HalStats {
+  uint64_t conversions = 0;        // Conversions the load cell completed
+  uint64_t conversions_read = 0;   // Conversions read before being overwritten
+  uint64_t serial_bytes_out = 0;
+  uint64_t sd_sectors_written = 0; // Sectors written raw or through File::write
+  uint64_t sd_bytes_written = 0;
+  uint64_t i2c_transactions = 0;
+  uint64_t busy_us = 0;            // Virtual time spent doing something other than delay()
+  uint64_t idle_poll_us = 0;       // Part of busy_us spent asking the NAU7802 for a conversion it didn't have
+  uint64_t sleep_us = 0;           // Virtual time spent in halSleep()
+};
+extern HalStats hal_stats;
+
+struct HalConfig {
+  const char *sd_root = "sdcard";  // Directory standing in for the card
+  uint32_t start_unix = 0;         // RTC time at startup, 0 for the host clock
+  bool serial_quiet = false;       // Discard Serial output
+  FILE *serial_out = NULL;         // Where Serial output goes if not quiet, default stdout
+  bool serial_stdin = true;        // Read Serial input from stdin
+  int serial_fd = -1;              // Serial in and out through this descriptor instead, e.g. a pty
+  bool realtime = false;           // Hold virtual time back to the host clock, for interactive use
+  uint64_t stop_us = 0;            // Exit once virtual time reaches this, 0 to run forever
+  uint16_t battery_mv = 4000;      // What analogRead(VBATPIN) reports
+  int32_t rtc_ppm = 0;             // How fast the RTC runs relative to millis()
+  int drdy_pin = -1;               // Pin the NAU7802 DRDY line is wired to, -1 if none
+  int sqw_pin = -1;                // Pin the PCF8523 INT/SQW line is wired to, -1 if none
+  SimSensor *sensor = NULL;        // Load cell source, SoakSensor if not set
+};
+
+void halBegin(const HalConfig &config);
+// Queue text to arrive on Serial at a virtual time
+void halSerialInput(uint64_t at_us, const char *text);
+// Virtual time, and moving it forward. Fires any interrupts that fall due.
+uint64_t halMicros64();
+void halAdvance(uint64_t us);
+// Current LED pin values as set with analogWrite/digitalWrite
+uint32_t halPinValue(uint32_t pin);
+// Called when virtual time reaches stop_us; the host program's summary goes here
+void halOnStop(void (*callback)(void));
+
+#endif // HAL_LINUX_H
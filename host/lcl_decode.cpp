@@ -0,0 +1,313 @@
+/*
+Decoder for binary load cell logs (log_format = 1 or 2).
+
+Turns a .BIN file written by the logger back into the same
+millis,time,raw_load,load,micros CSV the logger writes in text mode. Record
+times are extended to the full monotonic microsecond count and converted to UTC
+with the clock anchor and drift correction in effect for that record, from the
+file header or the latest clock block. Load comes from the calibration in
+effect for that record.
+
+Packed logs (log_format = 2) decode to the same columns. Their record times
+are the implicit ones from each run's start and spacing, which the logger keeps
+within a fixed tolerance (PACKED_TIME_TOLERANCE_US, 500 us) of the real ones.
+
+Logs of summary records (log_record = 1) decode to the logger's summary CSV
+columns instead.
+
+Event captures (EVENTnnn.EVT) decode the same way; the trip threshold
+crossing that started the capture is reported on stderr.
+
+Rainflow cycle counts (.RFC, see rainflow_format.h) decode to one line per
+histogram bin with any cycles in it, as range_min,range_max,mean_min,mean_max,
+cycles in load units, open ended bins with an empty max. Cycles are whole for
+closed cycles and end in .5 where the residue adds a half cycle.
+
+Build:  make lcl_decode
+Usage:  lcl_decode 23051100.BIN > 23051100.CSV
+        lcl_decode EVENT000.EVT > EVENT000.CSV
+        lcl_decode 23051100.RFC > 23051100_cycles.csv
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "../load_cell_logger_feather/log_format.h"
+#include "../load_cell_logger_feather/fixed_point.h"
+#include "../load_cell_logger_feather/varint.h"
+#include "../load_cell_logger_feather/crc32.h"
+#include "../load_cell_logger_feather/rainflow_format.h"
+
+// Same fixed point calculation and clamping as the firmware
+static int32_t rawToCentiLoad(int32_t raw, const LogCalibration &cal) {
+  return centiLoad(raw, cal.zero_offset, loadScale(cal.cal_factor));
+}
+
+static float rawToLoad(int32_t raw, const LogCalibration &cal) {
+  return rawToCentiLoad(raw, cal) / 100.0;
+}
+
+// ISO UTC string with milliseconds in the same form as the firmware's getUTC()
+static void formatUTC(uint64_t unix_ms, char *out, size_t size) {
+  time_t t = unix_ms / 1000;
+  struct tm utc;
+  gmtime_r(&t, &utc);
+  size_t n = strftime(out, size, "%Y-%m-%dT%H:%M:%S", &utc);
+  snprintf(out + n, size - n, ".%03uZ", (unsigned)(unix_ms % 1000));
+}
+
+// Timing footer, to stderr so the CSV stays clean
+static void printStats(const LogStats &stats, unsigned long seq) {
+  static const char *names[LOG_STAGE_COUNT] = {"loop", "getReading", "getUTC", "log write", "sync"};
+  fprintf(stderr, "block %lu: stats at %lu ms, ring dropped %lu peak %u, missed %lu, sd overruns %lu lost %lu bytes\n",
+          seq, (unsigned long)stats.uptime_ms, (unsigned long)stats.ring_dropped, stats.ring_peak,
+          (unsigned long)stats.missed_samples, (unsigned long)stats.sd_overruns, (unsigned long)stats.sd_lost_bytes);
+  if (stats.uptime_ms > 0) {
+    fprintf(stderr, "  awake %.1f%% of the time\n", 100.0 - 100.0 * stats.sleep_ms / stats.uptime_ms);
+  }
+  for (int i = 0; i < LOG_STAGE_COUNT; i++) {
+    const LogStageStats &stage = stats.stages[i];
+    fprintf(stderr, "  %-10s n=%lu min=%lu max=%lu mean=%lu us, histogram", names[i], (unsigned long)stage.count,
+            (unsigned long)stage.min_us, (unsigned long)stage.max_us, (unsigned long)stage.mean_us);
+    for (int b = 0; b < LOG_STAGE_HIST_BUCKETS; b++) fprintf(stderr, " %lu", (unsigned long)stage.hist[b]);
+    fprintf(stderr, "\n");
+  }
+}
+
+// UTC in microseconds at a monotonic time, from a clock anchor
+static uint64_t clockUnixUs(const LogClock &clock, uint64_t mono_us) {
+  int64_t elapsed = (int64_t)(mono_us - clock.mono_us);
+  return clock.unix_us + elapsed + elapsed * clock.drift_ppm / 1000000;
+}
+
+// One sample record as a CSV line
+static void printRecord(uint64_t mono_us, int32_t raw, const LogCalibration &cal, const LogClock &clock) {
+  char utc[32];
+  formatUTC(clockUnixUs(clock, mono_us) / 1000, utc, sizeof(utc));
+  char load[16];
+  *formatCenti(load, rawToCentiLoad(raw, cal)) = '\0';
+  printf("%lu,%s,%ld, %s,%llu\n", (unsigned long)(uint32_t)(mono_us / 1000), utc, (long)raw, load,
+         (unsigned long long)mono_us);
+}
+
+// Print the runs of a packed block, returning the records in them, or -1 if the block
+// doesn't parse. mono_us is extended from each run's start and left at the last record.
+static long printPacked(const LogBlock &block, const LogCalibration &cal, const LogClock &clock, uint64_t *mono_us) {
+  const uint8_t *in = block.bytes;
+  const uint8_t *end = block.bytes + LOG_BLOCK_PAYLOAD;
+  long records = 0;
+  for (uint8_t r = 0; r < block.header.count; r++) {
+    LogPackedRun run;
+    if (in + sizeof(run) > end) return -1;
+    memcpy(&run, in, sizeof(run));
+    in += sizeof(run);
+    *mono_us += (int32_t)(run.us - (uint32_t)*mono_us);
+    uint64_t start_us = *mono_us;
+    int32_t raw = run.raw;
+    for (uint16_t i = 0; i < run.count; i++) {
+      if (i > 0) {
+        uint32_t delta;
+        uint8_t used = getVarint(in, end, &delta);
+        if (used == 0) return -1;
+        in += used;
+        raw += zigzagDecode(delta);
+      }
+      *mono_us = start_us + ((uint64_t)i * run.period + 8) / 16;
+      printRecord(*mono_us, raw, cal, clock);
+      records++;
+    }
+  }
+  return records;
+}
+
+// Bin edge in load units for a CSV field, empty for the open end of the last bin
+static void formatEdge(char *out, size_t size, int32_t bin, int32_t width, int32_t bins) {
+  if (bin >= bins) {
+    out[0] = '\0';
+  } else {
+    snprintf(out, size, "%.2f", (double)bin * width / 100.0);
+  }
+}
+
+// The latest intact record of a rainflow summary, as CSV
+static int printRainflow(const char *path, const uint8_t *sectors, size_t size) {
+  RainflowRecord record = {};
+  bool found = false;
+  for (size_t slot = 0; slot < RAINFLOW_SLOTS && (slot + 1) * LOG_SECTOR_SIZE <= size; slot++) {
+    RainflowRecord candidate;
+    memcpy(&candidate, sectors + slot * LOG_SECTOR_SIZE, sizeof(candidate));
+    if (candidate.magic != RAINFLOW_MAGIC || candidate.version != RAINFLOW_VERSION ||
+        candidate.size != sizeof(candidate) || crc32(&candidate, offsetof(RainflowRecord, crc)) != candidate.crc) {
+      continue;
+    }
+    if (found && (int32_t)(candidate.seq - record.seq) <= 0) continue;
+    record = candidate;
+    found = true;
+  }
+  if (!found) {
+    fprintf(stderr, "%s: no intact rainflow record\n", path);
+    return 1;
+  }
+  char utc[32];
+  formatUTC((uint64_t)record.start_unix * 1000, utc, sizeof(utc));
+  fprintf(stderr, "%s: rainflow counts over %.2f hours from %s, %lu conversions, max load %.2f\n", path,
+          record.uptime_ms / 3600000.0, utc, (unsigned long)record.samples, record.max_load / 100.0);
+  fprintf(stderr, "%s: %lu closed cycles, %u residue half cycles, gate %.2f\n", path, (unsigned long)record.cycles,
+          record.residue, record.gate / 100.0);
+  printf("range_min,range_max,mean_min,mean_max,cycles\n");
+  for (int i = 0; i < RAINFLOW_RANGE_BINS; i++) {
+    for (int j = 0; j < RAINFLOW_MEAN_BINS; j++) {
+      uint32_t halves = record.half_cycles[i][j];
+      if (halves == 0) continue;
+      char range_min[16], range_max[16], mean_min[16], mean_max[16];
+      formatEdge(range_min, sizeof(range_min), i, record.range_bin, RAINFLOW_RANGE_BINS);
+      formatEdge(range_max, sizeof(range_max), i + 1, record.range_bin, RAINFLOW_RANGE_BINS);
+      formatEdge(mean_min, sizeof(mean_min), j, record.mean_bin, RAINFLOW_MEAN_BINS);
+      formatEdge(mean_max, sizeof(mean_max), j + 1, record.mean_bin, RAINFLOW_MEAN_BINS);
+      printf("%s,%s,%s,%s,%lu%s\n", range_min, range_max, mean_min, mean_max, (unsigned long)(halves / 2),
+             halves % 2 ? ".5" : "");
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s LOGFILE.BIN|LOGFILE.RFC > LOGFILE.CSV\n", argv[0]);
+    return 2;
+  }
+  FILE *in = fopen(argv[1], "rb");
+  if (!in) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  uint8_t sector[LOG_SECTOR_SIZE];
+  if (fread(sector, 1, LOG_SECTOR_SIZE, in) != LOG_SECTOR_SIZE) {
+    fprintf(stderr, "%s: too short for a header\n", argv[1]);
+    return 1;
+  }
+  LogFileHeader header;
+  memcpy(&header, sector, sizeof(header));
+  const char *dot = strrchr(argv[1], '.');
+  if (header.magic == RAINFLOW_MAGIC || (dot && strcasecmp(dot, ".RFC") == 0)) {
+    // Either slot may hold the latest record, or be erased
+    uint8_t sectors[RAINFLOW_SLOTS * LOG_SECTOR_SIZE];
+    memcpy(sectors, sector, LOG_SECTOR_SIZE);
+    size_t size = LOG_SECTOR_SIZE + fread(sectors + LOG_SECTOR_SIZE, 1, sizeof(sectors) - LOG_SECTOR_SIZE, in);
+    fclose(in);
+    return printRainflow(argv[1], sectors, size);
+  }
+  if (header.magic != LOG_MAGIC) {
+    fprintf(stderr, "%s: not a binary load cell log\n", argv[1]);
+    return 1;
+  }
+  // Version 2 is version 3 without packed blocks
+  if (header.format_version < 2 || header.format_version > LOG_FORMAT_VERSION) {
+    fprintf(stderr, "%s: format version %u, this decoder reads versions 2 to %u\n",
+            argv[1], header.format_version, LOG_FORMAT_VERSION);
+    return 1;
+  }
+  fprintf(stderr, "%s: firmware %u.%u, log interval %ld ms, cal factor %.2f, zero offset %ld\n",
+          argv[1], header.fw_major, header.fw_minor, (long)header.log_interval,
+          header.cal.cal_factor, (long)header.cal.zero_offset);
+
+  LogCalibration cal = header.cal;
+  LogClock clock = header.clock;
+  // Latest full monotonic time, to extend record times from. Each record is extended from
+  // the one before it, so this only starts at the header's anchor.
+  uint64_t mono_us = clock.mono_us;
+  uint32_t expected_seq = 0;
+  unsigned long records = 0;
+  char utc[32];
+  if (header.cal.filter != 0) {
+    static const char *lowpass[] = {"none", "boxcar", "IIR", "?"};
+    fprintf(stderr, "%s: filtered, median of %u, low pass %s, decimated by %u\n", argv[1],
+            LOG_FILTER_MEDIAN(header.cal.filter), lowpass[LOG_FILTER_LOWPASS(header.cal.filter)],
+            1u << LOG_FILTER_DECIMATE_SHIFT(header.cal.filter));
+  }
+  fprintf(stderr, "%s: clock disciplined by %s, drift correction %ld ppm\n", argv[1],
+          clock.source == LOG_CLOCK_RTC_SQW ? "RTC square wave" : "RTC reads", (long)clock.drift_ppm);
+  uint8_t columns = 0; // Block type the CSV column headings were printed for
+
+  LogBlock block;
+  while (fread(&block, 1, sizeof(block), in) == sizeof(block)) {
+    // Anything past the last block written is left over card contents
+    if (block.header.seq != expected_seq) break;
+    expected_seq++;
+    if (block.header.type == LOG_BLOCK_CALIBRATION) {
+      cal = block.cal;
+      fprintf(stderr, "block %lu: new cal factor %.2f, zero offset %ld\n",
+              (unsigned long)block.header.seq, cal.cal_factor, (long)cal.zero_offset);
+      continue;
+    }
+    if (block.header.type == LOG_BLOCK_CLOCK) {
+      // For UTC from here on. Record times go on extending from the last record, as logs
+      // from before the logger moved its anchor up to the time of writing can have one
+      // far older than that.
+      clock = block.clock;
+      if ((int64_t)(clock.mono_us - mono_us) > 0) mono_us = clock.mono_us;
+      continue;
+    }
+    if (block.header.type == LOG_BLOCK_STATS) {
+      printStats(block.stats, (unsigned long)block.header.seq);
+      continue;
+    }
+    if (block.header.type == LOG_BLOCK_EVENT) {
+      const LogEvent &event = block.event;
+      formatUTC(clockUnixUs(clock, event.trigger_us) / 1000, utc, sizeof(utc));
+      fprintf(stderr, "event: load %.2f passed %d%% of trip value %.0f at %s (micros %llu), "
+              "%u records before and %u after\n", event.load, event.level == 3 ? 100 : event.level == 2 ? 75 : 50,
+              event.trip_value, utc, (unsigned long long)event.trigger_us, event.pre_count, event.post_count);
+      // The captured records are within seconds of the trigger, which is a full time
+      mono_us = event.trigger_us;
+      continue;
+    }
+    if (block.header.type == LOG_BLOCK_SUMMARY && block.header.count <= LOG_SUMMARIES_PER_BLOCK) {
+      if (columns != LOG_BLOCK_SUMMARY) {
+        printf("millis,time,count,raw_mean,load_mean,load_min,load_max,load_stddev,micros\n");
+        columns = LOG_BLOCK_SUMMARY;
+      }
+      for (uint8_t i = 0; i < block.header.count; i++) {
+        const LogSummary &summary = block.summaries[i];
+        mono_us += (int32_t)(summary.us - (uint32_t)mono_us);
+        formatUTC(clockUnixUs(clock, mono_us) / 1000, utc, sizeof(utc));
+        printf("%lu,%s,%lu,%.2f,%.2f,%.2f,%.2f,%.3f,%llu\n", (unsigned long)(uint32_t)(mono_us / 1000), utc,
+               (unsigned long)summary.count, summary.raw_mean, (summary.raw_mean - cal.zero_offset) / cal.cal_factor,
+               rawToLoad(summary.raw_min, cal), rawToLoad(summary.raw_max, cal), summary.raw_stddev / cal.cal_factor,
+               (unsigned long long)mono_us);
+        records++;
+      }
+      continue;
+    }
+    if (block.header.type != LOG_BLOCK_SAMPLES && block.header.type != LOG_BLOCK_PACKED) break;
+    if (block.header.type == LOG_BLOCK_SAMPLES && block.header.count > LOG_RECORDS_PER_BLOCK) break;
+    // Samples and packed runs print the same columns
+    if (columns != LOG_BLOCK_SAMPLES) {
+      printf("millis,time,raw_load,load,micros\n");
+      columns = LOG_BLOCK_SAMPLES;
+    }
+    if (block.header.type == LOG_BLOCK_PACKED) {
+      long packed = printPacked(block, cal, clock, &mono_us);
+      if (packed < 0) {
+        fprintf(stderr, "block %lu: bad packed run\n", (unsigned long)block.header.seq);
+        break;
+      }
+      records += packed;
+      continue;
+    }
+    for (uint8_t i = 0; i < block.header.count; i++) {
+      const LogRecord &record = block.records[i];
+      // Records can be a little before the anchor, for samples queued before it was taken
+      mono_us += (int32_t)(record.us - (uint32_t)mono_us);
+      printRecord(mono_us, record.raw, cal, clock);
+      records++;
+    }
+  }
+  fclose(in);
+  fprintf(stderr, "%lu records in %lu blocks\n", records, (unsigned long)expected_seq);
+  return 0;
+}
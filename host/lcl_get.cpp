@@ -0,0 +1,307 @@
+/*
+Downloads files from the logger over USB with the file manager's framed binary
+transfer (option b, see transfer_format.h).
+
+Every frame is CRC checked and the finished file is checked against the
+logger's CRC of the whole file. A bad frame or a dropped connection loses
+nothing already received: the download is asked for again from the last good
+byte. A file left part way by an earlier run is resumed from its current length
+in the same way, unless --restart is given.
+
+With --sync, every log, event capture and cycle count on the card (.CSV, .BIN,
+.EVT and .RFC) is fetched in one pass from the logger's file list, which has the
+size and CRC of each file. Files already in the output directory with the same size and CRC are
+skipped, so offloading a logger again only fetches what is new. The log still
+being written is skipped as it is incomplete; close it with q first to include it.
+--list just prints the file list.
+
+The logger keeps logging while files are sent. lcl_get always leaves the file
+manager with x once it is done, so the logger's echo and status messages resume.
+
+Build:  make lcl_get
+Usage:  lcl_get [--out DIR] [--restart] PORT FILE...
+        lcl_get [--out DIR] --sync PORT
+        lcl_get --list PORT
+        lcl_get /dev/ttyACM0 23051100.BIN EVENT000.EVT
+
+To try it against the simulator, start lcl_sim --pty and give lcl_get the
+/dev/pts path it prints.
+*/
+
+#include "serial_port.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "../load_cell_logger_feather/crc32.h"
+
+#define PROMPT_TIMEOUT_MS 5000 // Menu prompts
+#define FRAME_TIMEOUT_MS 5000  // Silence in the middle of a transfer, covers the CRC of a large prefix
+#define LIST_TIMEOUT_MS 300000 // Between list entries, the logger reads each whole file for its CRC
+#define MAX_ATTEMPTS 5         // Requests for one file before giving up
+
+// Answers a menu prompt. The logger empties its input buffer just after printing a
+// prompt, so give it a moment to get there first.
+static bool answer(const char *prompt, const char *reply) {
+  if (!waitFor(prompt, PROMPT_TIMEOUT_MS)) {
+    fprintf(stderr, "no \"%s\" prompt from the logger\n", prompt);
+    return false;
+  }
+  usleep(20000);
+  return writePort(reply);
+}
+
+// Opens the file manager, or just gets a fresh prompt if it is already open. Whatever
+// the logger is still printing is let go by first, so an old prompt isn't taken for
+// the new one.
+static bool enterFileManager() {
+  char c;
+  while (readPort(&c, 1, 200)) {
+  }
+  return writePort("f");
+}
+
+static bool exitFileManager() {
+  usleep(20000);
+  return writePort("x\n");
+}
+
+// CRC-32 and size of a local file, false if it can't be read
+static bool fileCrc(const char *path, uint32_t *size, uint32_t *crc) {
+  FILE *in = fopen(path, "rb");
+  if (!in) return false;
+  uint8_t buf[4096];
+  size_t n;
+  *size = 0;
+  *crc = 0;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+    *crc = crc32(buf, n, *crc);
+    *size += n;
+  }
+  fclose(in);
+  return true;
+}
+
+// Reads frames until the next end or error frame, or anything that isn't a good frame.
+// Returns true once the file is complete and its CRC matches. received is the length
+// of good data in out, which is what the next attempt resumes from.
+static bool receiveFile(FILE *out, const char *name, uint32_t *received) {
+  uint8_t payload[TRANSFER_BLOCK_SIZE];
+  TransferFrame frame;
+  while (readFrame(&frame, payload, FRAME_TIMEOUT_MS, name)) {
+    switch (frame.type) {
+      case TRANSFER_DATA:
+        if (frame.offset != *received) {
+          fprintf(stderr, "%s: expected byte %lu, got %lu\n", name, (unsigned long)*received,
+                  (unsigned long)frame.offset);
+          return false;
+        }
+        if (fwrite(payload, 1, frame.length, out) != frame.length) {
+          perror(name);
+          return false;
+        }
+        *received += frame.length;
+        break;
+      case TRANSFER_END: {
+        TransferEnd end;
+        if (frame.length != sizeof(end)) return false;
+        memcpy(&end, payload, sizeof(end));
+        if (end.size != *received) {
+          fprintf(stderr, "%s: logger has %lu bytes, received %lu\n", name, (unsigned long)end.size,
+                  (unsigned long)*received);
+          return false;
+        }
+        // Check the whole file as written, including any part from an earlier run
+        fflush(out);
+        uint32_t size, crc;
+        if (!fileCrc(name, &size, &crc) || crc != end.crc) {
+          fprintf(stderr, "%s: file CRC %08lx, logger has %08lx\n", name, (unsigned long)crc,
+                  (unsigned long)end.crc);
+          *received = 0; // What we had doesn't match, start over
+          return false;
+        }
+        return true;
+      }
+      case TRANSFER_ERROR:
+        fprintf(stderr, "%s: logger says: %.*s\n", name, (int)frame.length, (const char *)payload);
+        *received = UINT32_MAX;
+        return false;
+      default:
+        fprintf(stderr, "%s: unexpected frame type %u\n", name, frame.type);
+        return false;
+    }
+  }
+  return false;
+}
+
+// The logger's file list
+static bool receiveList(std::vector<TransferEntry> *entries) {
+  uint8_t payload[TRANSFER_BLOCK_SIZE];
+  TransferFrame frame;
+  entries->clear();
+  while (readFrame(&frame, payload, LIST_TIMEOUT_MS, "file list")) {
+    if (frame.type == TRANSFER_LIST && frame.length == sizeof(TransferEntry) && frame.offset == entries->size()) {
+      TransferEntry entry;
+      memcpy(&entry, payload, sizeof(entry));
+      entry.name[sizeof(entry.name) - 1] = 0;
+      entries->push_back(entry);
+    } else if (frame.type == TRANSFER_END && frame.offset == entries->size()) {
+      return true;
+    } else {
+      fprintf(stderr, "file list: unexpected frame type %u\n", frame.type);
+      return false;
+    }
+  }
+  return false;
+}
+
+static bool requestList(std::vector<TransferEntry> *entries) {
+  for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+    if (enterFileManager() && answer("Enter file option:", "n\n") && receiveList(entries)) return true;
+    char c;
+    while (readPort(&c, 1, 500)) {
+    }
+  }
+  fprintf(stderr, "file list: giving up after %d attempts\n", MAX_ATTEMPTS);
+  return false;
+}
+
+// Downloads one file into path, resuming from what is already there
+static bool download(const char *name, const std::string &path, bool restart) {
+  struct stat st;
+  uint32_t received = !restart && stat(path.c_str(), &st) == 0 ? (uint32_t)st.st_size : 0;
+  uint64_t start_ms = nowMs();
+  uint32_t start_bytes = received;
+  for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+    if (received > 0) fprintf(stderr, "%s: resuming at byte %lu\n", name, (unsigned long)received);
+    if (truncate(path.c_str(), received) != 0 && errno != ENOENT) {
+      perror(path.c_str());
+      return false;
+    }
+    FILE *out = fopen(path.c_str(), "ab");
+    if (!out) {
+      perror(path.c_str());
+      return false;
+    }
+    char offset[16];
+    snprintf(offset, sizeof(offset), "%lu\n", (unsigned long)received);
+    bool ok = enterFileManager() && answer("Enter file option:", "b\n") &&
+              answer("Enter FN:", (std::string(name) + "\n").c_str()) && answer("Enter offset:", offset) &&
+              receiveFile(out, path.c_str(), &received);
+    fclose(out);
+    if (ok) {
+      double seconds = (nowMs() - start_ms) / 1000.0;
+      fprintf(stderr, "%s: %lu bytes OK", name, (unsigned long)received);
+      if (seconds > 0) fprintf(stderr, ", %.0f bytes/s", (received - start_bytes) / seconds);
+      fprintf(stderr, "\n");
+      return true;
+    }
+    if (received == UINT32_MAX) return false; // Nothing to retry, the logger refused
+    // Let the rest of a broken transfer go by before asking again
+    char c;
+    while (readPort(&c, 1, 500)) {
+    }
+  }
+  fprintf(stderr, "%s: giving up after %d attempts\n", name, MAX_ATTEMPTS);
+  return false;
+}
+
+// Logs, event captures and cycle counts, the files --sync fetches
+static bool isDataFile(const char *name) {
+  const char *dot = strrchr(name, '.');
+  return dot && (strcasecmp(dot, ".CSV") == 0 || strcasecmp(dot, ".BIN") == 0 || strcasecmp(dot, ".EVT") == 0 ||
+                 strcasecmp(dot, ".RFC") == 0);
+}
+
+// Fetches every data file that isn't already in out_dir with the same size and CRC
+static int syncAll(const std::string &out_dir) {
+  std::vector<TransferEntry> entries;
+  if (!requestList(&entries)) return 1;
+  int failed = 0, fetched = 0, skipped = 0;
+  for (const TransferEntry &entry : entries) {
+    if (!isDataFile(entry.name)) continue;
+    if (entry.flags & TRANSFER_ENTRY_OPEN) {
+      fprintf(stderr, "%s: still being logged, skipped\n", entry.name);
+      continue;
+    }
+    std::string path = out_dir + "/" + entry.name;
+    uint32_t size, crc;
+    bool have = fileCrc(path.c_str(), &size, &crc);
+    if (have && size == entry.size && crc == entry.crc) {
+      skipped++;
+      continue;
+    }
+    // A shorter copy is resumed, download() starts over if its start doesn't match
+    bool restart = have && size >= entry.size;
+    if (download(entry.name, path, restart)) {
+      fetched++;
+    } else {
+      failed++;
+    }
+  }
+  fprintf(stderr, "%d fetched, %d already downloaded, %d failed\n", fetched, skipped, failed);
+  return failed ? 1 : 0;
+}
+
+static int listFiles() {
+  std::vector<TransferEntry> entries;
+  if (!requestList(&entries)) return 1;
+  for (const TransferEntry &entry : entries) {
+    printf("%-12s %10lu %08lx%s\n", entry.name, (unsigned long)entry.size, (unsigned long)entry.crc,
+           entry.flags & TRANSFER_ENTRY_OPEN ? " open" : "");
+  }
+  return 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [--out DIR] [--restart] PORT FILE...\n"
+          "       %s [--out DIR] --sync PORT\n"
+          "       %s --list PORT\n",
+          name, name, name);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  std::string out_dir = ".";
+  bool restart = false, sync_all = false, list_only = false;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+      out_dir = argv[++i];
+    } else if (strcmp(argv[i], "--restart") == 0) {
+      restart = true;
+    } else if (strcmp(argv[i], "--sync") == 0) {
+      sync_all = true;
+    } else if (strcmp(argv[i], "--list") == 0) {
+      list_only = true;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  bool whole_card = sync_all || list_only;
+  if (whole_card ? argc - i != 1 : argc - i < 2) usage(argv[0]);
+  if (!openPort(argv[i++])) return 1;
+  int result = 0;
+  if (list_only) {
+    result = listFiles();
+  } else if (sync_all) {
+    result = syncAll(out_dir);
+  } else {
+    for (; i < argc; i++) {
+      if (!download(argv[i], out_dir + "/" + argv[i], restart)) result = 1;
+    }
+  }
+  exitFileManager();
+  closePort();
+  return result;
+}
@@ -0,0 +1,142 @@
+/*
+Live view of a logger over USB, from its binary stream (the r command, see
+transfer_format.h).
+
+Turns the stream on, then writes every conversion as micros,raw_load,load CSV
+to stdout, or to a file with --csv, until interrupted or --seconds have passed,
+and turns the stream off again on the way out. micros is extended past its 71
+minute wrap, so it keeps counting up for as long as the stream runs; raw_load
+and load are the same filtered counts and calibrated load the logger logs.
+
+Each frame is CRC checked and numbered. Frames lost in transit, or held back by
+the logger while a menu prompt or file transfer had the port, are reported on
+stderr as gaps, along with a count at the end.
+
+The logger keeps logging to the card while it streams. Its menu still works;
+the stream pauses while a prompt waits for a reply.
+
+Build:  make lcl_live
+Usage:  lcl_live [--csv FILE] [--seconds N] PORT
+        lcl_live /dev/ttyACM0 > pull.csv
+
+To try it against the simulator, start lcl_sim --pty and give lcl_live the
+/dev/pts path it prints.
+*/
+
+#include "serial_port.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../load_cell_logger_feather/fixed_point.h"
+
+#define PROMPT_TIMEOUT_MS 5000 // Reply to r
+#define FRAME_TIMEOUT_MS 2000  // Between frames, longer means the logger is busy or gone
+
+static volatile sig_atomic_t stop = 0;
+
+static void onSignal(int) { stop = 1; }
+
+// Toggles the stream with r until the logger reports it in the state wanted
+static bool setLive(bool on) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    usleep(20000);
+    if (!writePort("r") || !waitFor("Live stream O", PROMPT_TIMEOUT_MS)) break;
+    char c;
+    if (!readPort(&c, 1, PROMPT_TIMEOUT_MS)) break;
+    if ((c == 'N') == on) return true;
+  }
+  fprintf(stderr, "no reply from the logger to r\n");
+  return false;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [--csv FILE] [--seconds N] PORT\n", name);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *csv_path = NULL;
+  double seconds = 0;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) {
+      csv_path = argv[++i];
+    } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+      seconds = atof(argv[++i]);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (argc - i != 1) usage(argv[0]);
+  FILE *out = csv_path ? fopen(csv_path, "w") : stdout;
+  if (!out) {
+    perror(csv_path);
+    return 1;
+  }
+  if (!openPort(argv[i])) return 1;
+
+  // No SA_RESTART, so a read in progress gives up and the stream is stopped cleanly
+  struct sigaction sa = {};
+  sa.sa_handler = onSignal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  // Let whatever the logger is printing go by, so an old reply isn't taken for ours
+  char c;
+  while (readPort(&c, 1, 200)) {
+  }
+  if (!setLive(true)) return 1;
+  fprintf(out, "micros,raw_load,load\n");
+
+  uint64_t start_ms = nowMs();
+  uint64_t micros = 0;
+  uint32_t last_us = 0, next_seq = 0;
+  unsigned long frames = 0, records = 0, lost = 0;
+  bool first = true;
+  uint8_t payload[TRANSFER_BLOCK_SIZE];
+  TransferFrame frame;
+  while (!stop && (seconds <= 0 || nowMs() - start_ms < seconds * 1000)) {
+    if (!readFrame(&frame, payload, FRAME_TIMEOUT_MS, "live stream")) continue;
+    if (frame.type != TRANSFER_LIVE || frame.length % sizeof(LiveRecord) != 0) continue;
+    if (frame.offset != next_seq) {
+      // The first frame may not be number 0 if the logger held some back
+      unsigned long missing = frame.offset - next_seq;
+      fprintf(stderr, "live stream: %lu frames lost before frame %lu\n", missing, (unsigned long)frame.offset);
+      lost += missing;
+    }
+    next_seq = frame.offset + 1;
+    frames++;
+    for (uint16_t n = 0; n < frame.length; n += sizeof(LiveRecord)) {
+      LiveRecord record;
+      memcpy(&record, payload + n, sizeof(record));
+      if (first) {
+        micros = record.us;
+        first = false;
+      } else {
+        micros += (uint32_t)(record.us - last_us);
+      }
+      last_us = record.us;
+      char line[64];
+      char *end = formatU64(line, micros);
+      *end++ = ',';
+      end = formatI32(end, record.raw);
+      *end++ = ',';
+      end = formatCenti(end, record.load);
+      *end++ = '\n';
+      fwrite(line, 1, end - line, out);
+      records++;
+    }
+    fflush(out);
+  }
+
+  int result = setLive(false) ? 0 : 1;
+  closePort();
+  if (out != stdout) fclose(out);
+  fprintf(stderr, "%lu frames, %lu conversions, %lu frames lost\n", frames, records, lost);
+  return result;
+}
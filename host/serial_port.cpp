@@ -0,0 +1,124 @@
+/*
+Serial port access for the host tools that talk to the logger. See serial_port.h.
+*/
+
+#include "serial_port.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../load_cell_logger_feather/crc32.h"
+
+#define FRAME_TIMEOUT_MS 5000 // Rest of a frame once its magic has arrived
+
+static int port = -1;
+
+uint64_t nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool openPort(const char *path) {
+  port = ::open(path, O_RDWR | O_NOCTTY);
+  if (port < 0) {
+    perror(path);
+    return false;
+  }
+  // USB CDC ignores the baud rate, but a real serial adapter would want the logger's
+  struct termios tio;
+  if (tcgetattr(port, &tio) == 0) {
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, B9600);
+    tcsetattr(port, TCSANOW, &tio);
+    tcflush(port, TCIOFLUSH);
+  }
+  return true;
+}
+
+bool readPort(void *buf, size_t size, int timeout_ms) {
+  uint8_t *p = (uint8_t *)buf;
+  uint64_t deadline = nowMs() + timeout_ms;
+  while (size > 0) {
+    uint64_t now = nowMs();
+    if (now >= deadline) return false;
+    struct pollfd pfd = {port, POLLIN, 0};
+    int ready = poll(&pfd, 1, (int)(deadline - now));
+    if (ready < 0 && errno != EINTR) return false;
+    if (ready <= 0) continue;
+    ssize_t n = read(port, p, size);
+    if (n < 0 && errno != EINTR && errno != EAGAIN) return false;
+    if (n == 0) return false;
+    if (n > 0) {
+      p += n;
+      size -= n;
+    }
+  }
+  return true;
+}
+
+bool writePort(const char *text) {
+  size_t size = strlen(text);
+  while (size > 0) {
+    ssize_t n = write(port, text, size);
+    if (n < 0 && errno != EINTR && errno != EAGAIN) return false;
+    if (n > 0) {
+      text += n;
+      size -= n;
+    }
+  }
+  return true;
+}
+
+bool waitFor(const char *text, int timeout_ms) {
+  size_t len = strlen(text), matched = 0;
+  uint64_t deadline = nowMs() + timeout_ms;
+  while (matched < len) {
+    uint64_t now = nowMs();
+    char c;
+    if (now >= deadline || !readPort(&c, 1, (int)(deadline - now))) return false;
+    if (c == text[matched]) {
+      matched++;
+    } else {
+      matched = c == text[0] ? 1 : 0;
+    }
+  }
+  return true;
+}
+
+bool readFrame(TransferFrame *frame, uint8_t *payload, int timeout_ms, const char *name) {
+  uint8_t *head = (uint8_t *)frame;
+  uint32_t magic = TRANSFER_MAGIC;
+  size_t have = 0;
+  while (have < sizeof(magic)) {
+    if (!readPort(head + have, 1, timeout_ms)) {
+      fprintf(stderr, "%s: timed out\n", name);
+      return false;
+    }
+    have++;
+    // Slide along a byte at a time until the start matches
+    while (have > 0 && memcmp(head, &magic, have) != 0) memmove(head, head + 1, --have);
+  }
+  uint32_t crc;
+  if (!readPort(head + have, sizeof(*frame) - have, FRAME_TIMEOUT_MS) || frame->length > TRANSFER_BLOCK_SIZE ||
+      !readPort(payload, frame->length, FRAME_TIMEOUT_MS) || !readPort(&crc, sizeof(crc), FRAME_TIMEOUT_MS)) {
+    fprintf(stderr, "%s: bad or short frame\n", name);
+    return false;
+  }
+  if (crc32(payload, frame->length, crc32(frame, sizeof(*frame))) != crc) {
+    fprintf(stderr, "%s: CRC error in frame at %lu\n", name, (unsigned long)frame->offset);
+    return false;
+  }
+  return true;
+}
+
+void closePort() {
+  if (port >= 0) close(port);
+  port = -1;
+}
@@ -0,0 +1,34 @@
+/*
+Serial port access for the host tools that talk to the logger over USB: raw mode
+setup, reads with timeouts, waiting for menu prompts, and reading the CRC checked
+frames of transfer_format.h. One port is open at a time.
+*/
+
+#ifndef SERIAL_PORT_H
+#define SERIAL_PORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../load_cell_logger_feather/transfer_format.h"
+
+// Milliseconds on the host's monotonic clock
+uint64_t nowMs();
+
+// Opens the logger's port, or a pseudo-terminal from lcl_sim --pty, in raw mode
+bool openPort(const char *path);
+void closePort();
+
+// Reads exactly size bytes, false on a timeout or error
+bool readPort(void *buf, size_t size, int timeout_ms);
+bool writePort(const char *text);
+
+// Skips output until text has been seen
+bool waitFor(const char *text, int timeout_ms);
+
+// Reads the next frame into frame and payload, which must hold TRANSFER_BLOCK_SIZE
+// bytes, skipping anything before its magic such as menu text. False on a timeout,
+// a malformed frame or a CRC error, which are reported on stderr under name.
+bool readFrame(TransferFrame *frame, uint8_t *payload, int timeout_ms, const char *name);
+
+#endif // SERIAL_PORT_H
@@ -0,0 +1,274 @@
+/*
+Runs the logger firmware natively against the Linux hardware backend.
+
+setup() and loop() are the sketch's own, compiled unchanged. The SD card is a
+directory (sdcard/ by default), the load cell a simulated source, and time is
+virtual, so a day of logging takes seconds of host time. With a fixed --start and
+no stdin a run is fully deterministic, which is what bench.sh relies on.
+
+Build:  make
+Usage:  lcl_sim [options]
+
+  --sd DIR          directory used as the SD card
+  --config FILE     copy FILE to the card as config.txt before starting
+  --seconds N       stop after N seconds of virtual time (default: run until killed)
+  --start UNIX      RTC time at power on (default: host clock)
+  --quiet           discard Serial output
+  --no-stdin        don't read Serial input from stdin
+  --pty             put Serial on a pseudo-terminal, for host/lcl_get and lcl_live; its path is printed on stderr.
+                    Time runs no faster than real time, as the other end does.
+  --input T:TEXT    type TEXT on the serial port at T seconds, \n for newline, e.g. --input 5:q
+  --replay CSV      replay the raw_load column of a logger CSV
+  --haul P,H,T      synthesize hauls to P lbf, held H s, every T s
+  --rtc-ppm N       run the RTC N ppm fast (negative for slow) relative to millis()
+  --drdy PIN        wire the NAU7802 DRDY line to PIN (match DRDY_PIN in the sketch)
+  --sqw PIN         wire the PCF8523 square wave to PIN (match RTC_SQW_PIN in the sketch)
+  --report          print the run summary as one tab separated line on stdout
+
+The summary counts records on the card at the stop time, so anything still in the
+firmware's buffers is counted as lost, as it would be on a power cut.
+*/
+
+#include "hal_linux.h"
+#include "sim_sensors.h"
+#include "log_format.h"
+#include "varint.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <termios.h>
+
+#include <string>
+
+void setup(void);
+void loop(void);
+
+static HalConfig config;
+static bool report = false;
+
+// Sample records in a CSV log, up to the unwritten part of its extent
+static uint64_t countCsvRecords(FILE *in) {
+  uint64_t records = 0;
+  bool line_start = true;
+  int c;
+  while ((c = fgetc(in)) != EOF && c != 0 && c != 0xFF) {
+    if (line_start && c >= '0' && c <= '9') records++;
+    line_start = c == '\n';
+  }
+  return records;
+}
+
+// Records in the runs of a packed block, up to any run that doesn't parse
+static uint64_t countPackedRecords(const LogBlock &block) {
+  uint64_t records = 0;
+  const uint8_t *in = block.bytes;
+  const uint8_t *end = block.bytes + LOG_BLOCK_PAYLOAD;
+  for (uint8_t r = 0; r < block.header.count; r++) {
+    LogPackedRun run;
+    if (in + sizeof(run) > end) break;
+    memcpy(&run, in, sizeof(run));
+    in += sizeof(run);
+    for (uint16_t i = 1; i < run.count; i++) {
+      uint32_t delta;
+      uint8_t used = getVarint(in, end, &delta);
+      if (used == 0) return records;
+      in += used;
+    }
+    records += run.count;
+  }
+  return records;
+}
+
+// Sample records in a binary log, the way lcl_decode reads it
+static uint64_t countBinRecords(FILE *in) {
+  uint64_t records = 0;
+  LogFileHeader header;
+  uint8_t sector[LOG_SECTOR_SIZE];
+  if (fread(sector, 1, sizeof(sector), in) != sizeof(sector)) return 0;
+  memcpy(&header, sector, sizeof(header));
+  if (header.magic != LOG_MAGIC) return 0;
+  LogBlock block;
+  uint32_t expected_seq = 0;
+  while (fread(&block, 1, sizeof(block), in) == sizeof(block)) {
+    if (block.header.seq != expected_seq++) break;
+    if (block.header.type == LOG_BLOCK_SAMPLES || block.header.type == LOG_BLOCK_SUMMARY) records += block.header.count;
+    if (block.header.type == LOG_BLOCK_PACKED) records += countPackedRecords(block);
+  }
+  return records;
+}
+
+static uint64_t countLoggedRecords() {
+  uint64_t records = 0;
+  DIR *dir = opendir(config.sd_root);
+  if (!dir) return 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    const char *dot = strrchr(entry->d_name, '.');
+    if (!dot) continue;
+    bool csv = strcasecmp(dot, ".CSV") == 0;
+    if (!csv && strcasecmp(dot, ".BIN") != 0) continue;
+    std::string path = std::string(config.sd_root) + "/" + entry->d_name;
+    FILE *in = fopen(path.c_str(), "rb");
+    if (!in) continue;
+    records += csv ? countCsvRecords(in) : countBinRecords(in);
+    fclose(in);
+  }
+  closedir(dir);
+  return records;
+}
+
+static void printSummary() {
+  fflush(stdout);
+  double seconds = halMicros64() / 1e6;
+  uint64_t logged = countLoggedRecords();
+  uint64_t read = hal_stats.conversions_read;
+  // Time the firmware spent working, leaving out polling for a conversion that wasn't ready
+  uint64_t work_us = hal_stats.busy_us - hal_stats.idle_poll_us;
+  double us_per_sample = read ? (double)work_us / read : 0;
+  double sd_bytes_per_hour = seconds > 0 ? hal_stats.sd_bytes_written * 3600.0 / seconds : 0;
+  if (report) {
+    printf("%.0f\t%llu\t%llu\t%llu\t%.1f\t%.1f\t%.0f\t%llu\n", seconds,
+           (unsigned long long)hal_stats.conversions, (unsigned long long)read, (unsigned long long)logged,
+           us_per_sample, 100.0 * work_us / halMicros64(), sd_bytes_per_hour,
+           (unsigned long long)hal_stats.serial_bytes_out);
+    return;
+  }
+  fprintf(stderr, "\nvirtual time %.3f s\n", seconds);
+  fprintf(stderr, "conversions %llu, read %llu, missed %llu, on card %llu\n",
+          (unsigned long long)hal_stats.conversions, (unsigned long long)read,
+          (unsigned long long)(hal_stats.conversions - read), (unsigned long long)logged);
+  fprintf(stderr, "cpu %.1f us per sample read, %.1f%% working, %.1f%% polling, %.1f%% asleep\n", us_per_sample,
+          100.0 * work_us / halMicros64(), 100.0 * hal_stats.idle_poll_us / halMicros64(),
+          100.0 * hal_stats.sleep_us / halMicros64());
+  fprintf(stderr, "sd %llu bytes, %llu sectors, %.0f bytes/hour\n",
+          (unsigned long long)hal_stats.sd_bytes_written, (unsigned long long)hal_stats.sd_sectors_written,
+          sd_bytes_per_hour);
+  fprintf(stderr, "serial %llu bytes, i2c %llu transactions\n", (unsigned long long)hal_stats.serial_bytes_out,
+          (unsigned long long)hal_stats.i2c_transactions);
+}
+
+// Turn the two character sequence \n into a newline
+static std::string unescape(const char *text) {
+  std::string out;
+  for (; *text; text++) {
+    if (text[0] == '\\' && text[1] == 'n') {
+      out += '\n';
+      text++;
+    } else {
+      out += *text;
+    }
+  }
+  return out;
+}
+
+static bool copyFile(const char *from, const std::string &to) {
+  FILE *in = fopen(from, "rb");
+  if (!in) return false;
+  FILE *out = fopen(to.c_str(), "wb");
+  if (!out) {
+    fclose(in);
+    return false;
+  }
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0) fwrite(buf, 1, n, out);
+  fclose(in);
+  return fclose(out) == 0;
+}
+
+// Serial through a pseudo-terminal in raw mode, which a client opens like the logger's
+// /dev/ttyACM port. The slave side is held open too so the port survives clients coming
+// and going.
+static bool openPty() {
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+    perror("pty");
+    return false;
+  }
+  const char *path = ptsname(master);
+  int slave = open(path, O_RDWR | O_NOCTTY);
+  struct termios tio;
+  if (slave < 0 || tcgetattr(slave, &tio) < 0) {
+    perror(path);
+    return false;
+  }
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+  fprintf(stderr, "Serial on %s\n", path);
+  config.serial_fd = master;
+  config.realtime = true;
+  return true;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [--sd DIR] [--config FILE] [--seconds N] [--start UNIX] [--quiet] [--no-stdin] [--pty]\n"
+          "          [--input T:TEXT]... [--replay CSV | --haul P,H,T] [--rtc-ppm N] [--drdy PIN] [--sqw PIN] [--report]\n",
+          name);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *config_file = NULL;
+  static ReplaySensor replay;
+  static HaulProfile haul;
+  static HaulSensor *haul_sensor = NULL;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--sd" && has_value) {
+      config.sd_root = argv[++i];
+    } else if (arg == "--config" && has_value) {
+      config_file = argv[++i];
+    } else if (arg == "--seconds" && has_value) {
+      config.stop_us = (uint64_t)(atof(argv[++i]) * 1e6);
+    } else if (arg == "--start" && has_value) {
+      config.start_unix = strtoul(argv[++i], NULL, 10);
+    } else if (arg == "--quiet") {
+      config.serial_quiet = true;
+    } else if (arg == "--no-stdin") {
+      config.serial_stdin = false;
+    } else if (arg == "--pty") {
+      if (!openPty()) return 1;
+    } else if (arg == "--input" && has_value) {
+      const char *spec = argv[++i];
+      const char *colon = strchr(spec, ':');
+      if (!colon) usage(argv[0]);
+      halSerialInput((uint64_t)(atof(spec) * 1e6), unescape(colon + 1).c_str());
+    } else if (arg == "--replay" && has_value) {
+      const char *path = argv[++i];
+      if (!replay.load(path)) {
+        fprintf(stderr, "%s: no millis,time,raw_load,load records\n", path);
+        return 1;
+      }
+      config.sensor = &replay;
+    } else if (arg == "--haul" && has_value) {
+      if (sscanf(argv[++i], "%f,%f,%f", &haul.peak_lbf, &haul.hold_s, &haul.period_s) < 1) usage(argv[0]);
+      haul_sensor = new HaulSensor(haul);
+      config.sensor = haul_sensor;
+    } else if (arg == "--rtc-ppm" && has_value) {
+      config.rtc_ppm = atoi(argv[++i]);
+    } else if (arg == "--drdy" && has_value) {
+      config.drdy_pin = atoi(argv[++i]);
+    } else if (arg == "--sqw" && has_value) {
+      config.sqw_pin = atoi(argv[++i]);
+    } else if (arg == "--report") {
+      report = true;
+      config.serial_quiet = true;
+      config.serial_stdin = false;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  halBegin(config);
+  if (config_file && !copyFile(config_file, std::string(config.sd_root) + "/config.txt")) {
+    perror(config_file);
+    return 1;
+  }
+  halOnStop(printSummary);
+  setup();
+  while (true) {
+    loop();
+    halAdvance(hal_costs.loop_us);
+  }
+}
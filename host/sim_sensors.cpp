@@ -0,0 +1,60 @@
+/*
+Load cell sources for the simulator. See sim_sensors.h.
+*/
+
+#include "sim_sensors.h"
+
+bool ReplaySensor::load(const char *path) {
+  FILE *in = fopen(path, "r");
+  if (!in) return false;
+  char line[128];
+  uint64_t first_ms = 0;
+  uint64_t last_ms = 0;
+  uint64_t wraps = 0;
+  while (fgets(line, sizeof(line), in)) {
+    unsigned long ms;
+    long raw;
+    // Header, menu echo and blank lines don't parse
+    if (sscanf(line, "%lu,%*[^,],%ld", &ms, &raw) != 2) continue;
+    // millis() wraps after 49.7 days
+    uint64_t t = ms + (wraps << 32);
+    if (!raw_.empty() && t < last_ms) {
+      wraps++;
+      t = ms + (wraps << 32);
+    }
+    if (raw_.empty()) first_ms = t;
+    last_ms = t;
+    t_us_.push_back((t - first_ms) * 1000);
+    raw_.push_back((int32_t)raw);
+  }
+  fclose(in);
+  return !raw_.empty();
+}
+
+// Straight line between the records either side of t_us, holding the last record
+// once the file runs out
+int32_t ReplaySensor::rawAt(uint64_t t_us) {
+  while (index_ + 1 < t_us_.size() && t_us_[index_ + 1] <= t_us) index_++;
+  if (index_ + 1 >= t_us_.size()) return raw_.back();
+  uint64_t span = t_us_[index_ + 1] - t_us_[index_];
+  if (span == 0) return raw_[index_];
+  double f = (double)(t_us - t_us_[index_]) / span;
+  return (int32_t)lround(raw_[index_] + f * (raw_[index_ + 1] - raw_[index_]));
+}
+
+float HaulSensor::loadAt(uint64_t t_us) const {
+  double t = fmod(t_us / 1e6, profile_.period_s);
+  double ramp = profile_.ramp_s;
+  double hold_end = ramp + profile_.hold_s;
+  double surge = profile_.surge_lbf * sin(2 * M_PI * t / profile_.surge_period_s);
+  if (t < ramp) return (float)(profile_.peak_lbf * t / ramp);
+  if (t < hold_end) return (float)(profile_.peak_lbf + surge);
+  if (t < hold_end + ramp) return (float)(profile_.peak_lbf * (hold_end + ramp - t) / ramp);
+  return 0;
+}
+
+int32_t HaulSensor::rawAt(uint64_t t_us) {
+  lcg_ = lcg_ * 1103515245 + 12345;
+  int32_t noise = (int32_t)((lcg_ >> 16) % (2 * profile_.noise + 1)) - profile_.noise;
+  return profile_.zero_offset + (int32_t)lround(loadAt(t_us) * profile_.cal_factor) + noise;
+}
@@ -0,0 +1,55 @@
+/*
+Load cell sources for the simulator, beyond the quiet soak in hal_linux.h.
+
+  ReplaySensor  plays back a CSV the logger wrote (millis,time,raw_load,load),
+                interpolating between its records to the conversion rate
+  HaulSensor    synthesizes repeated hauls: a ramp up to a peak load, a hold with
+                surge from the boat, a ramp back down, then slack
+
+Both are deterministic, so the same options always give the same run.
+*/
+
+#ifndef SIM_SENSORS_H
+#define SIM_SENSORS_H
+
+#include "hal_linux.h"
+
+#include <vector>
+
+class ReplaySensor : public SimSensor {
+ public:
+  // Returns false if the file has no records
+  bool load(const char *path);
+  size_t records() const { return raw_.size(); }
+  int32_t rawAt(uint64_t t_us);
+
+ private:
+  std::vector<uint64_t> t_us_; // Record times relative to the first record
+  std::vector<int32_t> raw_;
+  size_t index_ = 0;
+};
+
+struct HaulProfile {
+  int32_t zero_offset = 4229;    // Raw reading with no load, as in the sample CONFIG.TXT
+  float cal_factor = 44.74;      // Counts per lbf
+  float peak_lbf = 800;          // Load held during a haul
+  float surge_lbf = 150;         // Amplitude of the swell riding on top of the peak
+  float surge_period_s = 6;
+  float ramp_s = 4;              // Up and down ramp time
+  float hold_s = 20;
+  float period_s = 120;          // Start of one haul to the next
+  int32_t noise = 20;            // Raw counts of noise, peak
+};
+
+class HaulSensor : public SimSensor {
+ public:
+  HaulSensor(const HaulProfile &profile) : profile_(profile) {}
+  int32_t rawAt(uint64_t t_us);
+  float loadAt(uint64_t t_us) const;
+
+ private:
+  HaulProfile profile_;
+  uint32_t lcg_ = 12345;
+};
+
+#endif // SIM_SENSORS_H
@@ -0,0 +1,201 @@
+/*
+Integer filters for raw NAU7802 conversions, applied between acquisition and
+the logger. Every stage works on 24 bit counts in int32 with no floating point,
+so the whole chain costs a few microseconds per conversion on a Cortex-M0.
+
+Stages run in a fixed order, each one optional:
+
+  median     median of the last 3 or 5 conversions, removes single spikes
+  low pass   boxcar average of the last BOXCAR_SIZE conversions, or a first
+             order IIR with a time constant of 2^IIR_SHIFT conversions
+  decimate   third order CIC decimator by a power of two up to 32, one
+             output per 2^shift inputs
+
+Each stage is its own class so other chains can be put together in code;
+FilterChain is the one the logger configures from config.txt. The stages add
+delay: (N-1)/2 conversions for the median, about half the boxcar, 2^IIR_SHIFT
+for the IIR and 1.5 output periods for the CIC.
+*/
+
+#ifndef FILTER_CHAIN_H
+#define FILTER_CHAIN_H
+
+#include <stdint.h>
+
+// Values of filter_lowpass in config.txt
+#define FILTER_LOWPASS_NONE 0
+#define FILTER_LOWPASS_BOXCAR 1
+#define FILTER_LOWPASS_IIR 2
+
+// Median of the last n conversions, n odd and at most N
+template <uint8_t N>
+class MedianFilter {
+ public:
+  void begin(uint8_t n) {
+    n_ = n > N ? N : n | 1;
+    count_ = 0;
+    next_ = 0;
+  }
+
+  int32_t process(int32_t x) {
+    buf_[next_] = x;
+    next_ = next_ + 1 == n_ ? 0 : next_ + 1;
+    if (count_ < n_) count_++;
+    // Insertion sort of at most N values
+    int32_t sorted[N];
+    for (uint8_t i = 0; i < count_; i++) {
+      int32_t v = buf_[i];
+      uint8_t j = i;
+      while (j > 0 && sorted[j - 1] > v) {
+        sorted[j] = sorted[j - 1];
+        j--;
+      }
+      sorted[j] = v;
+    }
+    return sorted[count_ / 2];
+  }
+
+ private:
+  int32_t buf_[N];
+  uint8_t n_ = N;
+  uint8_t count_ = 0;
+  uint8_t next_ = 0;
+};
+
+// Mean of the last N conversions, from a running sum. 24 bit counts leave room for
+// N up to 128 in the int32 sum.
+template <uint8_t N>
+class BoxcarFilter {
+  static_assert(N > 0 && N <= 128, "boxcar length must fit the int32 running sum");
+
+ public:
+  void begin() {
+    sum_ = 0;
+    count_ = 0;
+    next_ = 0;
+  }
+
+  int32_t process(int32_t x) {
+    if (count_ == N) {
+      sum_ -= buf_[next_];
+    } else {
+      count_++;
+    }
+    buf_[next_] = x;
+    sum_ += x;
+    next_ = next_ + 1 == N ? 0 : next_ + 1;
+    // Round to nearest, away from zero on a tie
+    return sum_ >= 0 ? (sum_ + count_ / 2) / count_ : -((-sum_ + count_ / 2) / count_);
+  }
+
+ private:
+  int32_t buf_[N];
+  int32_t sum_ = 0;
+  uint8_t count_ = 0;
+  uint8_t next_ = 0;
+};
+
+// y += (x - y) / 2^SHIFT, with the state held to 6 fractional bits so small steps
+// aren't lost to truncation
+template <uint8_t SHIFT>
+class IirFilter {
+  static const uint8_t FRAC = 6;
+
+ public:
+  void begin() { primed_ = false; }
+
+  int32_t process(int32_t x) {
+    int32_t xq = x * (1 << FRAC);
+    if (!primed_) {
+      y_ = xq;
+      primed_ = true;
+    }
+    y_ += (xq - y_) >> SHIFT;
+    return (y_ + (1 << (FRAC - 1))) >> FRAC;
+  }
+
+ private:
+  int32_t y_ = 0;
+  bool primed_ = false;
+};
+
+// Third order cascaded integrator-comb decimator by 2^shift. The integrators wrap
+// freely in unsigned 64 bit arithmetic, which the combs undo exactly, and the gain of
+// 2^(3 shift) is divided back out with a shift. The first three outputs are held back
+// while the combs fill.
+class CicDecimator {
+  static const uint8_t ORDER = 3;
+
+ public:
+  void begin(uint8_t shift) {
+    shift_ = shift > 5 ? 5 : shift;
+    for (uint8_t i = 0; i < ORDER; i++) integ_[i] = comb_[i] = 0;
+    phase_ = 0;
+    warmup_ = ORDER;
+  }
+
+  // Returns false until 2^shift inputs have gone in since the last output
+  bool process(int32_t x, int32_t &out) {
+    if (shift_ == 0) {
+      out = x;
+      return true;
+    }
+    uint64_t v = (uint64_t)(int64_t)x;
+    for (uint8_t i = 0; i < ORDER; i++) v = integ_[i] += v;
+    if (++phase_ < (1u << shift_)) return false;
+    phase_ = 0;
+    for (uint8_t i = 0; i < ORDER; i++) {
+      uint64_t delayed = comb_[i];
+      comb_[i] = v;
+      v -= delayed;
+    }
+    if (warmup_ > 0) {
+      warmup_--;
+      return false;
+    }
+    out = (int32_t)((int64_t)v >> (ORDER * shift_));
+    return true;
+  }
+
+ private:
+  uint64_t integ_[ORDER];
+  uint64_t comb_[ORDER];
+  uint8_t shift_ = 0;
+  uint8_t phase_ = 0;
+  uint8_t warmup_ = 0;
+};
+
+// median -> low pass -> decimate, as set up by begin()
+template <uint8_t MEDIAN_MAX, uint8_t BOXCAR_SIZE, uint8_t IIR_SHIFT>
+class FilterChain {
+ public:
+  // median: 0 off, else 3 or 5. lowpass: FILTER_LOWPASS_x. decimate_shift: log2 of the
+  // decimation factor, 0 off.
+  void begin(uint8_t median, uint8_t lowpass, uint8_t decimate_shift) {
+    median_on_ = median > 1;
+    lowpass_ = lowpass;
+    median_.begin(median);
+    boxcar_.begin();
+    iir_.begin();
+    cic_.begin(decimate_shift);
+  }
+
+  // Filter one conversion in place. Returns false if the decimator holds it back.
+  bool process(int32_t &raw) {
+    int32_t x = raw;
+    if (median_on_) x = median_.process(x);
+    if (lowpass_ == FILTER_LOWPASS_BOXCAR) x = boxcar_.process(x);
+    if (lowpass_ == FILTER_LOWPASS_IIR) x = iir_.process(x);
+    return cic_.process(x, raw);
+  }
+
+ private:
+  MedianFilter<MEDIAN_MAX> median_;
+  BoxcarFilter<BOXCAR_SIZE> boxcar_;
+  IirFilter<IIR_SHIFT> iir_;
+  CicDecimator cic_;
+  bool median_on_ = false;
+  uint8_t lowpass_ = FILTER_LOWPASS_NONE;
+};
+
+#endif // FILTER_CHAIN_H
@@ -0,0 +1,106 @@
+/*
+Integer load calibration and number formatting for the per-conversion path.
+
+The SAMD21 has no FPU and no divide instruction, so a float subtract and divide
+per conversion, and Print's float and 64 bit formatting, cost far more than the
+rest of logging a reading. Instead the calibration is turned into a 36.28 fixed
+point scale once, whenever it changes, and loads are carried as hundredths of a
+unit in a long. Formatting finds digits by subtracting powers of ten, which
+needs no division at all.
+
+The host decoder uses the same calculation, so a binary log decodes to exactly
+the loads the logger writes in a CSV.
+*/
+
+#ifndef FIXED_POINT_H
+#define FIXED_POINT_H
+
+#include <stdint.h>
+
+#define LOAD_SCALE_BITS 28
+
+// Hundredths of a load unit per raw count, with LOAD_SCALE_BITS fractional bits.
+// 0 if the load cell is not calibrated.
+inline int64_t loadScale(float cal_factor) {
+  if (cal_factor == 0) return 0;
+  double scale = 100.0 * (1L << LOAD_SCALE_BITS) / cal_factor;
+  return (int64_t)(scale < 0 ? scale - 0.5 : scale + 0.5);
+}
+
+// Calibrated load in hundredths, clamped at zero like NAU7802::getWeight()
+inline int32_t centiLoad(int32_t raw, int32_t zero_offset, int64_t scale) {
+  if (raw < zero_offset) raw = zero_offset;
+  int64_t centi = (int64_t)(raw - zero_offset) * scale;
+  return (int32_t)((centi + (1L << (LOAD_SCALE_BITS - 1))) >> LOAD_SCALE_BITS);
+}
+
+// Write the decimal digits of value at out, returning the end. No terminator.
+inline char *formatU64(char *out, uint64_t value) {
+  static const uint64_t powers[] = {
+    10000000000000000000ULL, 1000000000000000000ULL, 100000000000000000ULL, 10000000000000000ULL,
+    1000000000000000ULL, 100000000000000ULL, 10000000000000ULL, 1000000000000ULL, 100000000000ULL,
+    10000000000ULL, 1000000000ULL, 100000000ULL, 10000000ULL, 1000000ULL, 100000ULL, 10000ULL,
+    1000ULL, 100ULL, 10ULL};
+  bool started = false;
+  for (uint8_t i = 0; i < sizeof(powers) / sizeof(powers[0]); i++) {
+    char digit = '0';
+    while (value >= powers[i]) {
+      value -= powers[i];
+      digit++;
+    }
+    if (started || digit != '0') {
+      *out++ = digit;
+      started = true;
+    }
+  }
+  *out++ = '0' + (char)value;
+  return out;
+}
+
+inline char *formatU32(char *out, uint32_t value) {
+  static const uint32_t powers[] = {1000000000UL, 100000000UL, 10000000UL, 1000000UL, 100000UL,
+                                    10000UL, 1000UL, 100UL, 10UL};
+  bool started = false;
+  for (uint8_t i = 0; i < sizeof(powers) / sizeof(powers[0]); i++) {
+    char digit = '0';
+    while (value >= powers[i]) {
+      value -= powers[i];
+      digit++;
+    }
+    if (started || digit != '0') {
+      *out++ = digit;
+      started = true;
+    }
+  }
+  *out++ = '0' + (char)value;
+  return out;
+}
+
+inline char *formatI32(char *out, int32_t value) {
+  if (value < 0) {
+    *out++ = '-';
+    return formatU32(out, 0 - (uint32_t)value);
+  }
+  return formatU32(out, value);
+}
+
+// Hundredths as a number with two decimals, the way Print::print(float) shows them
+inline char *formatCenti(char *out, int32_t centi) {
+  uint32_t magnitude = centi;
+  if (centi < 0) {
+    *out++ = '-';
+    magnitude = 0 - (uint32_t)centi;
+  }
+  // Room for two leading zeros, so there is always a digit before the point
+  char digits[12];
+  char *start = digits + 2;
+  char *end = formatU32(start, magnitude);
+  while (end - start < 3) *--start = '0';
+  while (start < end - 2) *out++ = *start++;
+  *out++ = '.';
+  *out++ = start[0];
+  *out++ = start[1];
+  return out;
+}
+
+#endif // FIXED_POINT_H
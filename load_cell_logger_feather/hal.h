@@ -0,0 +1,45 @@
+/*
+Hardware abstraction for the load cell logger.
+
+The firmware only touches the hardware through this set of objects and calls:
+
+  sensor   NAU7802 (SparkFun Qwiic Scale library)
+  clock    millis(), micros(), delay(), RTC_PCF8523 and DateTime (RTClib)
+  storage  SdFat and File (SdFat library)
+  serial   Serial
+  LED      pinMode(), digitalWrite(), analogWrite()
+  ADC      analogRead()
+  IRQ      attachInterrupt(), digitalPinToInterrupt()
+  power    halSleep()
+
+On the Feather the backend is the Arduino core and those libraries themselves, so
+there is no extra layer on the device. Anywhere else host/hal_linux.h provides the
+same interface backed by a directory standing in for the SD card, a simulated load
+cell and a virtual clock, so setup() and loop() run unchanged as a Linux program.
+Anything new the firmware needs from the hardware has to be added to both.
+*/
+
+#ifndef HAL_H
+#define HAL_H
+
+#ifdef ARDUINO
+  #include <Arduino.h>
+  #include "SdFat.h" // SD card, used instead of SD.h for pre-allocation and raw sector writes
+  #include <Wire.h> // I2C
+  #include "RTClib.h" // Real time clock
+  #include "SparkFun_Qwiic_Scale_NAU7802_Arduino_Library.h" // Click here to get the library: http://librarymanager/All#SparkFun_NAU7802
+
+  // Stop the CPU clock until the next interrupt (SAMD21 IDLE mode 0). Peripherals, SysTick
+  // and USB keep running. If called with interrupts masked, an interrupt that is already
+  // pending still ends the sleep, it just isn't serviced until they are unmasked.
+  inline void halSleep() {
+    PM->SLEEP.reg = PM_SLEEP_IDLE_CPU;
+    SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+    __DSB();
+    __WFI();
+  }
+#else
+  #include "hal_linux.h"
+#endif // ARDUINO
+
+#endif // HAL_H
@@ -0,0 +1,49 @@
+/*
+Journal of the open log's partly filled last sector, so a power loss loses
+nothing that was synced.
+
+Log sectors go to the card once each, as they fill, into the log's erased
+extent. The partly filled sector at each sync is not written into the log,
+where rewriting it in place would put what an earlier sync left in that
+sector at risk if the write were cut off, but appended to JOURNAL.DAT: a ring
+of JOURNAL_RECORDS records of two sectors each, a JournalRecord then a copy of
+the log sector. Each record has a sequence number one higher than the one
+before and CRCs of both sectors, and the next record goes in the next slot, so
+a write cut off part way leaves the record before it intact.
+
+At boot the log left open by a power loss (OPENLOG.TXT, which also holds the
+journal sequence number when the log was opened) is trimmed to its last full
+sector. If the newest intact record was written since the log was opened, is
+for that log and for the sector just past the end, its copy is put back as the
+log's last sector. A CSV log is then cut back to its last whole line, as the
+sectors written since the last sync can stop partway through one.
+
+Everything is little endian, as in log_format.h.
+*/
+
+#ifndef JOURNAL_FORMAT_H
+#define JOURNAL_FORMAT_H
+
+#include <stdint.h>
+
+#define JOURNAL_FILE "JOURNAL.DAT" // Not .BIN, which the host tools take for a binary log
+#define JOURNAL_MAGIC 0x4A4C434CUL // "LCLJ" read as a little endian uint32
+#define JOURNAL_RECORDS 16         // Slots in the ring
+#define JOURNAL_RECORD_SECTORS 2   // JournalRecord sector, then the log sector copy
+
+struct __attribute__((packed)) JournalRecord {
+  uint32_t magic;      // JOURNAL_MAGIC
+  uint32_t seq;        // Records written, counting on across power cycles
+  uint32_t log_sector; // Card sector the log starts at
+  uint32_t sector;     // Sector of the log the copy belongs in, from 0
+  uint16_t bytes;      // Bytes of the copy that are log data
+  uint16_t reserved;
+  char name[13];       // Log file name, zero terminated
+  uint8_t reserved2[3];
+  uint32_t data_crc;   // CRC-32 (crc32.h) of the whole 512 byte copy
+  uint32_t crc;        // CRC-32 of everything before it
+};
+
+static_assert(sizeof(JournalRecord) == 44, "journal layout is fixed");
+
+#endif // JOURNAL_FORMAT_H
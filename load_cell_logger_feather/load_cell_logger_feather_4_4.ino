@@ -27,6 +27,68 @@ Version History:
                 not always be correctly received depending on what serial terminal
                 is used.  Increase the number of values averaged for a calibration reading.
 4.3: 3/30/2023 - Updated M. Martini provide means to get gain information to user in a meaningful way
+4.4: 10/15/2026 - Every NAU7802 conversion is queued in a ring buffer and drained by the
+                  logger, so spikes between log intervals are seen. log_interval = 0 logs
+                  every conversion.
+                  Optional binary log format (log_format = 1) written in whole 512 byte
+                  sectors, decoded on a PC with host/lcl_decode.
+                  Switched from SD.h to SdFat. The log file is pre-allocated as one erased,
+                  contiguous extent and written as a raw multi-block stream from two 512 byte
+                  buffers, so a sync no longer touches the FAT and sampling continues while
+                  the card is busy.
+                  The extent is sized from deploy_hours and the data rate. Logs are trimmed
+                  to their real length on a clean close (q) or at the next boot, and a new
+                  file is started if an extent fills up.
+                  Loop timing instrumentation: per stage min/max/mean/histogram and drop
+                  counters, shown with the i command and logged hourly as a footer.
+                  Timestamps come from millis() anchored to the RTC, which is only read at
+                  startup and each sync, with drift correction. The time column now has
+                  milliseconds.
+                  Each record carries a monotonic microsecond timestamp (micros column).
+                  With the PCF8523 square wave wired to RTC_SQW_PIN the clock is
+                  disciplined to its 1 Hz edges. Binary log format version 2.
+                  The processor sleeps between conversions and while waiting for menu
+                  input; the i command reports the duty cycle.
+                  Adaptive logging (adaptive = 1): log_interval during idle, every
+                  conversion with pre-trigger history once the load moves faster than
+                  trigger_rate or passes trigger_percent of trip_value.
+                  Each time the load rises through 50/75/100% of trip_value, 1.6 s either
+                  side of the crossing is captured at full rate to an EVENTnnn.EVT file.
+                  Summary records (log_record = 1): count, mean, min, max and standard
+                  deviation of every conversion in each log_interval.
+                  Optional integer filter chain on the conversions (filter_median,
+                  filter_lowpass, filter_decimate), replacing the unused avgWeights.
+                  Calibrated load is computed in fixed point and CSV lines are formatted
+                  with integer code, with no float math per conversion.
+                  Framed binary file download (file manager option b) in 512 byte blocks
+                  with a CRC-32 per frame and resume from an offset, for host/lcl_get.
+                  File list with sizes and CRC-32s (file manager option n), used by
+                  lcl_get --sync to offload every new log in one pass.
+                  The serial menu is a state machine run from loop(), so conversions are
+                  logged while prompts wait for input, and tares, calibrations and file
+                  transfers proceed a little each pass instead of stopping the logger.
+                  Live binary stream of every conversion (r command) in CRC checked,
+                  numbered frames over USB, in place of the text echo, for host/lcl_live.
+                  Faster startup: the NAU7802 is powered up straight at its final gain and
+                  rate with one AFE calibration, done after the clock start so the LDO
+                  settles meanwhile. config.txt is read in one block with no recursion
+                  when it is missing, and the next log and event file numbers come from
+                  one directory pass. The i command reports the time of each stage.
+                  Settings are saved as a CRC checked binary record in one sector of
+                  SETTINGS.DAT, written in place. config.txt is imported when it has been
+                  edited, and written out with the w command. cal_factor keeps its
+                  decimals when imported.
+                  The settings record alternates between two slots with sequence numbers,
+                  so a save cut off by a power loss leaves the previous one intact.
+                  Packed binary log format (log_format = 2): runs of records at a steady
+                  rate, each raw reading stored as a zigzag varint change from the last,
+                  with implicit times kept within PACKED_TIME_TOLERANCE_US.
+                  Rainflow cycle counts of the filtered load, as a range against mean
+                  histogram from power on, kept in an .RFC file named after the first log
+                  and rewritten in place at each sync. Decoded with host/lcl_decode.
+                  Each sync journals the log's partly filled sector to JOURNAL.DAT, a
+                  ring of CRC checked, numbered records, instead of rewriting it in the
+                  log, and boot recovery puts the newest one back after a power loss.
 
 Description:
 Logs values from a SparkFun Qwiic Scale NAU7802 to a SD card and specified intervals. 
@@ -36,16 +98,25 @@ Arduino boards with similar SD/RTC as Adalogger.
 
 */
 
-#include "SD.h" // SD card
-#include <Wire.h> // I2C
-#include "RTClib.h" // Real time clock
-#include "SparkFun_Qwiic_Scale_NAU7802_Arduino_Library.h" // Click here to get the library: http://librarymanager/All#SparkFun_NAU7802
+#include "hal.h" // Arduino core, SdFat, RTClib and NAU7802 library, or their Linux stand-ins
+#include "sample_ring.h" // Acquisition to logger queue
+#include "log_format.h" // Binary log file layout
+#include "stage_timer.h" // Loop timing instrumentation
+#include "interval_stats.h" // Summary record accumulator
+#include "filter_chain.h" // Fixed point conversion filters
+#include "fixed_point.h" // Integer calibration and number formatting
+#include "crc32.h" // Transfer and file checksums
+#include "transfer_format.h" // Framed file download layout
+#include "settings_format.h" // Saved settings record
+#include "journal_format.h" // Journal of the log's partly filled sector
+#include "varint.h" // Packed log delta coding
+#include "rainflow.h" // Fatigue cycle counting
 
 // ***********************************************************************
 // * MACROS
 // ***********************************************************************
 #define VERSION_MAJOR 4
-#define VERSION_MINOR 2
+#define VERSION_MINOR 4
 
 // Wait for serial input in setup()?? 0 or 1
 #define WAIT_TO_START    0
@@ -69,13 +140,73 @@ Arduino boards with similar SD/RTC as Adalogger.
 #define DEFAULT_ZERO_OFFSET 1000L
 // Default trip value in LBF
 #define DEFAULT_TRIP_VALUE 1700
+// Default log file format, LOG_FORMAT_CSV, LOG_FORMAT_BINARY or LOG_FORMAT_PACKED
+#define DEFAULT_LOG_FORMAT LOG_FORMAT_CSV
+// Default record layout, LOG_RECORD_SAMPLE or LOG_RECORD_SUMMARY
+#define DEFAULT_LOG_RECORD LOG_RECORD_SAMPLE
+// Default expected deployment length in hours, used to size the log file
+#define DEFAULT_DEPLOY_HOURS 144
+// Default filter chain: median length (0 off, 3 or 5), FILTER_LOWPASS_x, and decimation
+// factor (1 off, or a power of two up to 32)
+#define DEFAULT_FILTER_MEDIAN 0
+#define DEFAULT_FILTER_LOWPASS FILTER_LOWPASS_NONE
+#define DEFAULT_FILTER_DECIMATE 1
+// Default for adaptive logging, 0 or 1
+#define DEFAULT_ADAPTIVE 0
+// Default rate of change of load that starts full rate logging, in LBF per second
+#define DEFAULT_TRIGGER_RATE 100
+// Default percentage of trip_value that starts full rate logging
+#define DEFAULT_TRIGGER_PERCENT 25
 
 // Size of serial input
 #define SERIAL_SIZE 15
-
-// Number of weights to average when calibrating
+// A reply typed with no line ending is taken once nothing more arrives for this long
+#define MENU_LINE_GAP_MS 50
+// Card blocks a file transfer or file list reads per loop() pass
+#define MENU_FILE_BLOCKS 8
+// A partly filled live stream frame is sent once its first record is this old
+#define LIVE_FLUSH_MS 50
+// Conversions averaged to tare, and to find the zero and span when calibrating
+#define TARE_AVERAGE 8
+#define CAL_AVERAGE 64
+
+// Menu states. MENU_COMMAND takes single character commands, the states after it
+// wait for the reply to a prompt or for any key, and from MENU_TARE on the menu is
+// busy over several loop() passes and ignores input.
+#define MENU_COMMAND 0
+#define MENU_LOG_INTERVAL 1
+#define MENU_SYNC_INTERVAL 2
+#define MENU_RTC_YEAR 3
+#define MENU_RTC_MONTH 4
+#define MENU_RTC_DAY 5
+#define MENU_RTC_HOUR 6
+#define MENU_RTC_MINUTE 7
+#define MENU_RTC_SECOND 8
+#define MENU_RTC_CONFIRM 9    // Any key
+#define MENU_CAL_CONFIRM 10
+#define MENU_CAL_EMPTY 11     // Any key
+#define MENU_CAL_LOADED 12    // Any key
+#define MENU_CAL_WEIGHT 13
+#define MENU_MANUAL_CONFIRM 14
+#define MENU_MANUAL_ZERO 15
+#define MENU_MANUAL_FACTOR 16
+#define MENU_FILE_OPTION 17
+#define MENU_FILE_NAME 18
+#define MENU_FILE_OFFSET 19
+#define MENU_FILE_CLEAR 20
+#define MENU_TARE 21          // Averaging conversions
+#define MENU_CAL_ZEROING 22   // Averaging conversions
+#define MENU_CAL_SPANNING 23  // Averaging conversions
+#define MENU_FILE_DUMP 24     // Sending a file as text
+#define MENU_FILE_SEND 25     // Sending a file as frames
+#define MENU_FILE_LIST 26     // Sending the file list
+
+// Number of conversions averaged by the boxcar low pass filter
 // was 4
 #define AVG_SIZE 20
+// Time constant of the IIR low pass filter, as a power of two conversions. 4 is 16
+// conversions, 50 ms.
+#define FILTER_IIR_SHIFT 4
 
 // The digital pin to light when an error occurs. Pin 17 is built-in RX LED, usually used when receiving serial data.
 // The built in LED on pin 13 cannot be used since pin 13 is being used for the clock signal for the SD card.
@@ -97,6 +228,221 @@ Arduino boards with similar SD/RTC as Adalogger.
 // Low battery voltage
 #define LOW_BATTERY_VOLTAGE 3.5
 
+// Pin wired to the DRDY (INT) pad of the Qwiic Scale, or -1 if not connected.
+// With DRDY wired the conversion-ready check is an interrupt flag instead of an
+// I2C status register read on every pass through loop().
+#ifndef DRDY_PIN
+#define DRDY_PIN -1
+#endif
+
+// Pin wired to the INT/SQW pad of the PCF8523 on the Adalogger, or -1 if not connected.
+// With it wired the RTC puts out a 1 Hz square wave whose edges discipline the micros()
+// clock, giving timestamps good to tens of microseconds. Without it the clock is
+// checked against RTC register reads and is good to a few milliseconds.
+#ifndef RTC_SQW_PIN
+#define RTC_SQW_PIN -1
+#endif
+
+// Sleep the processor between conversions, 0 or 1. The SAMD21 goes into IDLE, which
+// stops the CPU clock but leaves SysTick, USB and the external interrupts running, so
+// millis()/micros() and the serial port carry on and any of them wakes it. STANDBY would
+// stop SysTick and the timestamps with it, and a conversion is due every 3 ms anyway.
+#define SLEEP_BETWEEN_SAMPLES 1
+
+// Number of conversions buffered between acquisition and the SD writer. Must be a
+// power of two. At 320 SPS, 256 samples rides out an 800 ms SD card stall.
+#define SAMPLE_RING_SIZE 256
+
+// Adaptive logging and event captures keep this many of the latest conversions so an
+// event can be logged from before it was detected. Must be a power of two. 512 is 1.6 s
+// at 320 SPS.
+#define EVENT_HISTORY_SIZE 512
+// Conversions captured from a trip threshold crossing on, for the event file
+#define EVENT_POST_SIZE 512
+// An event capture re-arms once the load falls below this percentage of trip_value
+#define EVENT_REARM_PERCENT 25
+// Conversions the load's rate of change is measured across, 32 is 100 ms
+#define EVENT_RATE_WINDOW 32
+// Full rate logging carries on this long after the last conversion that met a trigger
+#define EVENT_HOLD_MS 5000UL
+
+// NAU7802 conversion rate, also recorded in binary log headers
+#define LC_SAMPLE_RATE NAU7802_SPS_320
+// Time the NAU7802's LDO takes to settle after power up, before its AFE is calibrated
+#define LC_LDO_SETTLE_MS 250
+
+// Limits on the contiguous extent pre-allocated for each log file. FAT32 files stop at 4 GB.
+#define LOG_MIN_EXTENT_MB 4
+#define LOG_MAX_EXTENT_MB 4000
+// Longest deploy_hours taken, a year. Longer runs to LOG_MAX_EXTENT_MB anyway at any rate.
+#define MAX_DEPLOY_HOURS 8760
+// Approximate bytes per CSV line, for sizing the extent
+#define CSV_RECORD_BYTES 62
+#define CSV_SUMMARY_BYTES 90
+// Approximate bytes per packed record, for sizing the extent
+#define PACKED_RECORD_BYTES 2
+// Largest error allowed in the implicit record times of a packed log
+#define PACKED_TIME_TOLERANCE_US 500
+// CSV column headings for each log_record layout
+#define CSV_SAMPLE_HEADER "millis,time,raw_load,load,micros"
+#define CSV_SUMMARY_HEADER "millis,time,count,raw_mean,load_mean,load_min,load_max,load_stddev,micros"
+// Start a new file when fewer than this many sectors are left in the extent. A full
+// sample ring drained as CSV is about 24 sectors.
+#define LOG_ROLLOVER_SECTORS 64
+// Holds the name of the log being written, removed when it is closed cleanly. If it is
+// still there at boot, that log was cut off by a power loss and needs trimming.
+#define OPEN_LOG_FILE "OPENLOG.TXT"
+// config.txt is written here first and renamed into place
+#define CONFIG_TEMP_FILE "CONFIG.TMP"
+
+// Nominal NAU7802 conversion period at NAU7802_SPS_320, used to spot conversions the
+// ADC overwrote before we read them
+#define CONVERSION_PERIOD_MS 3.125
+#define CONVERSION_PERIOD_US 3125
+
+// Stages of setup(), timed for the startup report in printStats()
+#define BOOT_STAGE_CARD 0     // SD card
+#define BOOT_STAGE_SENSORS 1  // RTC, and powering up the NAU7802
+#define BOOT_STAGE_SETTINGS 2 // Settings, log recovery and file numbering
+#define BOOT_STAGE_CLOCK 3    // Waiting for the RTC to tick, see clockBegin()
+#define BOOT_STAGE_AFE 4      // NAU7802 LDO settling and AFE calibration
+#define BOOT_STAGE_LOG 5      // Allocating and erasing the log
+#define BOOT_STAGE_COUNT 6
+
+// How often timing statistics are written to the log as a footer record, in ms.
+// They are also written when the log is closed.
+#define STATS_INTERVAL_MS 3600000UL
+
+// Largest rate correction the millis() clock will apply, in parts per million. Both
+// crystals are good to tens of ppm, so anything beyond this is a bad RTC read.
+#define CLOCK_MAX_DRIFT_PPM 500
+// Without the square wave, the RTC is checked this many ms either side of where the
+// clock expects it to tick
+#define CLOCK_GUARD_MS 5
+// How often a clock anchor block is written to binary logs, in ms
+#define CLOCK_LOG_INTERVAL_MS 600000UL
+
+
+// ***********************************************************************
+// * FUNCTION PROTOTYPES
+// ***********************************************************************
+// The Arduino IDE generates these for a .ino, but the host build compiles this file
+// as plain C++. Keep in step with the definitions below.
+void drdyISR();
+void acquireSamples();
+void filterBegin();
+void calibrationBegin();
+float rawToLoad(long raw);
+void drainSamples();
+void logSample(uint64_t sample_us);
+void liveSample(uint32_t sample_us);
+void liveFlush();
+void logSummary();
+void printSummary(Print &out, float raw_mean, float raw_stddev);
+void checkTripValue();
+byte tripLevel(long centi);
+bool checkTrigger(const Sample &sample);
+void logHistory(uint32_t trigger_us);
+void fillLogCalibration(LogCalibration *cal);
+void startLogBlock(uint8_t type);
+void writeLogBlock();
+void writeLogHeader();
+void logRecord(uint64_t sample_us, long raw);
+void logPacked(uint64_t sample_us, long raw);
+void logCalibrationChange();
+void fillLogHeader(LogFileHeader *header);
+void captureBegin(byte level);
+void captureSample(const Sample &sample);
+void writeCapture();
+void fillLogStats(LogStats *stats);
+void logStats();
+void printStats();
+void printStartup();
+void powerIdle();
+float powerDutyCycle();
+uint64_t monoMicros();
+uint64_t monoFromMicros(uint32_t us);
+void sqwISR();
+void clockSet(uint32_t unix_seconds, uint64_t mono_us);
+void clockBegin();
+uint64_t clockUnixUs(uint64_t mono_us);
+void clockEstimateDrift();
+void clockResync();
+void clockService();
+void clockTick();
+void clockCheck();
+void fillLogClock(LogClock *clock);
+void logClock();
+char * utcString(uint64_t mono_us);
+void printMicros(Print &out, uint64_t us);
+void waitCardReady();
+bool writerBegin(uint32_t bytes);
+void writerService();
+void writerWriteSector(const uint8_t *sector);
+size_t writerAppend(const uint8_t *data, size_t size);
+void writerSync(const uint8_t *tail, bool in_place);
+void writerPause();
+void writerResume();
+uint32_t logExtentBytes();
+void dayLogName(char *name, const DateTime &date);
+bool openLog();
+void closeLog();
+void rainflowBegin();
+void rainflowSave();
+void rolloverLog();
+bool logSectorWritten(File &file, uint32_t sector, uint8_t *buffer);
+uint32_t findLogEnd(File &file, bool text);
+uint32_t lastLineEnd(File &file, uint32_t end);
+bool journalBegin();
+bool journalWrite(const uint8_t *tail, uint16_t bytes);
+bool journalRestore(File &file, const char *name, uint32_t open_seq, uint32_t *end);
+void recoverLog();
+void scanFileIndexes();
+void setRGB(int rgb_values[], int sizeOfArray);
+const char* rgb_color_string(int rgb_values[], int sizeOfArray);
+bool loadCellBegin();
+bool loadCellCalibrate();
+void calibrateScale(void);
+void readSystemSettings(void);
+bool settingsBegin();
+bool readSettingsSlot(uint8_t slot, SettingsRecord *record);
+bool loadSettings();
+bool checkSettings();
+bool checkSetting(int &setting, int low, int high, int fallback, const __FlashStringHelper *name);
+void parseSavedVar(char *buff);
+void saveSystemSettings(void);
+uint32_t printSettings(Print &out);
+bool exportSettings();
+void getCalibration();
+void manualCalibration();
+char * getUTC();
+void setRTC();
+void setLogInterval();
+void setSyncInterval();
+void menuService();
+void menuCommand(char input);
+void menuLine();
+void menuReply();
+void menuPrompt(byte state, const __FlashStringHelper *prompt);
+bool menuIdle();
+void menuAverageBegin(byte state, uint16_t size);
+void menuWork();
+void fileManager();
+void filePrompt();
+void fileOption(char option);
+void fileName();
+void fileService();
+bool isOpenLog(const char *name);
+uint32_t openLogBytes();
+void printDirectory(File dir, int numTabs);
+void getFile(char* fn);
+void sendFile(uint32_t offset);
+void sendFileList();
+void sendFrame(uint16_t type, uint32_t offset, const void* payload, uint16_t length);
+void delFile(char* fn);
+void clearCard();
+void error(const __FlashStringHelper*err);
+
 
 // ***********************************************************************
 // * GLOBALS
@@ -126,31 +472,112 @@ int all_off[] = {255,255,255};
 int gain_value_table[] = {1,2,4,8,16,32,64,128};
 
 bool settingsDetected = false; // Used to prompt user to calibrate their scale
-bool fm; // File manager is active/inactive
-char input;
-char serial_data[SERIAL_SIZE];
-
-// Create an array to take average of weights. This helps smooth out jitter.
-float avgWeights[AVG_SIZE];
-byte avgWeightSpot = 0;
+// Saved settings, see settings_format.h
+uint32_t settings_sector = 0; // First card sector of SETTINGS_FILE, 0 if it couldn't be set up
+uint32_t settings_seq = 0;    // Saves so far
+uint8_t settings_slot = 1;    // Slot holding the latest record, the next save goes in the other
+uint32_t config_crc = 0;      // CRC-32 of the config.txt last imported or exported
+// Serial menu, see menuService()
+byte menu_state = MENU_COMMAND;
+char serial_data[SERIAL_SIZE + 1]; // Reply being typed to the current prompt
+byte serial_length = 0;
+uint32_t serial_ms = 0; // millis() when its last character arrived
+long rtc_fields[6]; // Year to second, as entered
+float cal_weight; // Known weight entered for a calibration
+// Conversions being averaged for a tare or calibration, fed by drainSamples()
+int64_t menu_average_sum = 0;
+uint16_t menu_average_count = 0;
+uint16_t menu_average_size = 0;
+// File manager
+char fm_action; // Option waiting for a file name
+char fm_name[SERIAL_SIZE + 1];
+File fm_file; // File being sent, or checksummed for the file list
+File fm_dir; // Directory being listed
+uint32_t fm_pos = 0; // Next byte of fm_file to read
+uint32_t fm_offset = 0; // Where the host asked a framed transfer to start
+uint32_t fm_crc = 0;
+uint32_t fm_count = 0; // Entries sent in a file list
+TransferEntry fm_entry; // Entry for fm_file being checksummed
+// Live binary stream, see liveSample(). Not saved, it is off at power on.
+bool live = false;
+LiveRecord live_records[LIVE_RECORDS_PER_FRAME];
+byte live_count = 0;
+uint32_t live_seq = 0; // Frames since the stream was started, sent or not
+uint32_t live_ms = 0;  // millis() when the first record in live_records was added
+
+// Filters between the sample ring and everything that uses the readings. This helps
+// smooth out jitter.
+FilterChain<5, AVG_SIZE, FILTER_IIR_SHIFT> filter;
+byte filter_shift = 0; // log2 of filter_decimate
 
 // Variables for raw and calibrated load, max load encountered. 
 // Max load thus resets each power cycle
+// Loads are in hundredths of a unit, see fixed_point.h
 long raw_load; 
-float load;
-float max_load = 0;
-
-float cal_factor; // Value used to convert the load cell reading to lbs or kg
-float zero_offset; // Zero value that is found when scale is tared
+long load_centi;
+long max_load_centi = 0;
+// Highest trip value fraction reached so far: 0 none, 1 50%, 2 75%, 3 100%
+byte trip_level = 0;
+
+float cal_factor = DEFAULT_CAL_FACTOR; // Value used to convert the load cell reading to lbs or kg
+float zero_offset = DEFAULT_ZERO_OFFSET; // Zero value that is found when scale is tared
+// Calibration and thresholds in the integer form the per-conversion code uses, set by
+// calibrationBegin()
+int64_t load_scale = 0;   // Hundredths of a unit per count, LOAD_SCALE_BITS fractional bits
+long load_zero = 0;       // Zero offset in counts
+long trip_centi = 0;      // trip_value
+long trigger_centi = 0;   // trigger_percent of trip_value
+long rearm_centi = 0;     // EVENT_REARM_PERCENT of trip_value
+uint32_t trigger_counts = 0; // trigger_rate in counts per second
+
+// Queue of conversions from acquireSamples() to drainSamples()
+SampleRing<Sample, SAMPLE_RING_SIZE> sample_ring;
+// Set from the DRDY interrupt, along with the time the conversion became ready
+volatile bool drdy_flag = false;
+volatile uint32_t drdy_us = 0;
+// Time of the last conversion read, and count of conversions the ADC overwrote
+// before they could be read (estimated from gaps in the conversion times)
+uint32_t last_sample_us = 0;
+uint32_t missed_samples = 0;
+
+// Adaptive logging state, see checkTrigger()
+SampleHistory<Sample, EVENT_HISTORY_SIZE> history; // Latest conversions, logged or not
+bool event_active = false;     // Logging every conversion
+uint32_t event_trigger_us = 0; // Time of the last conversion that met a trigger condition
+uint32_t event_count = 0;      // Events since power on
+uint32_t logged_us = 0;        // Time of the last conversion logged
+
+// Conversions in the current log interval, for summary records
+IntervalStats summary;
+uint64_t summary_us = 0;       // Time of the first of them
+
+// Event capture state, see captureBegin(). The history up to a trip threshold crossing
+// is copied to the start of capture and the conversions after it appended.
+Sample capture[EVENT_HISTORY_SIZE + EVENT_POST_SIZE];
+uint16_t capture_count = 0;    // Conversions in capture, 0 if not capturing
+uint16_t capture_pre = 0;      // How many of them are from before the crossing
+bool capture_ready = false;    // capture is complete and waiting to be written
+byte capture_level = 0;        // Highest threshold crossed since the load was last low
+long capture_load_centi = 0;  // Load at the crossing
+uint16_t event_file_index = 0; // Number tried first for the next event file
  
 // Pin for the the SD card select line
 const int chip_select = 10;
 
 // Globals for settings. These are read/written to CONFIG file
-bool echo;
-int log_interval;
-int sync_interval;
-int trip_value;
+bool echo = DEFAULT_ECHO;
+int log_interval = DEFAULT_LOG_INTERVAL;
+int sync_interval = DEFAULT_SYNC_INTERVAL;
+int trip_value = DEFAULT_TRIP_VALUE;
+int log_format = DEFAULT_LOG_FORMAT;
+int log_record = DEFAULT_LOG_RECORD;
+int deploy_hours = DEFAULT_DEPLOY_HOURS;
+bool adaptive = DEFAULT_ADAPTIVE;
+int trigger_rate = DEFAULT_TRIGGER_RATE;
+int trigger_percent = DEFAULT_TRIGGER_PERCENT;
+int filter_median = DEFAULT_FILTER_MEDIAN;
+int filter_lowpass = DEFAULT_FILTER_LOWPASS;
+int filter_decimate = DEFAULT_FILTER_DECIMATE;
 int gain_setting = 0;
 
 // Time the last log was saved
@@ -169,16 +596,121 @@ NAU7802 load_cell;
 // Global now
 DateTime now;
 
+// micros() extended to 64 bits, so timestamps stay monotonic past its 71 minute wrap
+uint32_t mono_last_us = 0;
+uint64_t mono_high = 0;
+
+// UTC clock derived from the monotonic micros() clock, see CLOCK FUNCTIONS
+uint8_t clock_source = LOG_CLOCK_RTC_READ; // LOG_CLOCK_x, what is disciplining the clock
+uint64_t clock_base_us = 0;        // Monotonic micros() at the last anchor point
+uint64_t clock_base_unix_us = 0;   // UTC in us since 1970 at clock_base_us
+uint64_t clock_start_us = 0;       // Monotonic micros() when the clock was set
+uint64_t clock_start_unix_us = 0;
+int32_t clock_drift_ppm = 0;       // Rate correction applied to micros()
+bool clock_check_armed = false;    // An RTC check is scheduled for clock_check_ms
+bool clock_check_early = false;    // It is before the expected tick rather than after
+uint32_t clock_check_ms = 0;
+uint32_t clock_log_time = 0;       // Time the last clock block was logged
+// Set from the square wave interrupt: count of falling edges and micros() at the last one
+volatile uint32_t sqw_ticks = 0;
+volatile uint32_t sqw_us = 0;
+uint32_t clock_ticks_seen = 0;     // sqw_ticks already applied to the clock
+
 // If using the web IDE and errors are generated "does not name type" after instantiating these classes - this means the web IDE is referencing the wrong library. 
 // Load the library manually as per: https://forum.arduino.cc/index.php?topic=586330.0
 
 // Output log filename and object
-char filename[12];
+char filename[13];
 File logfile;
+uint8_t log_file_index = 0; // Number tried first for the next log file, see scanFileIndexes()
+uint8_t log_file_day = 0;   // Day of the month log_file_index is for
+bool logging = false; // A log file is open and being written
+
+// SD card - named SD so the calls read the same as with the Arduino SD library
+SdFat SD;
+
+// Sector writer state. One buffer is filled while the other waits for the card.
+uint8_t sd_buffers[2][LOG_SECTOR_SIZE];
+byte sd_fill = 0;                // Index of the buffer being filled
+uint16_t sd_fill_count = 0;      // Bytes used in the fill buffer
+bool sd_pending = false;         // The other buffer is full and waiting to be written
+bool sd_streaming = false;       // A multi-block write is open on the card
+uint32_t sd_sector = 0;          // Card sector the next buffer will be written to
+uint32_t log_first_sector = 0;   // Extent of the pre-allocated log file
+uint32_t log_last_sector = 0;
+uint32_t sd_pending_since = 0;   // micros() when the pending buffer filled
+// Writer statistics, echoed at each sync
+uint32_t sd_write_max_us = 0;    // Longest single sector transfer
+uint32_t sd_queue_max_us = 0;    // Longest a full buffer waited on a busy card
+uint32_t sd_sync_max_us = 0;     // Longest writerSync()
+uint32_t sd_overruns = 0;        // Times both buffers were full
+uint32_t sd_lost_bytes = 0;      // Bytes dropped because the extent was full
+// Journal of the log's partly filled sector, see journal_format.h
+uint32_t journal_sector = 0;     // First card sector of JOURNAL_FILE, 0 if it couldn't be set up
+uint32_t journal_seq = 0;        // Sequence number of the next record
+uint8_t journal_next = 0;        // Slot the next record goes in
+int8_t journal_newest = -1;      // Slot of the newest intact record at boot, -1 if none
+
+// Print adapter so the CSV text is formatted straight into the sector writer
+class WriterPrint : public Print {
+ public:
+  size_t write(uint8_t c) { return writerAppend(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) { return writerAppend(buffer, size); }
+  using Print::write;
+};
+WriterPrint logstream;
+
+// Print adapter that passes text on and keeps the CRC-32 of it, for config.txt
+class CrcPrint : public Print {
+ public:
+  CrcPrint(Print &out) : out_(out) {}
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) {
+    crc = crc32(buffer, size, crc);
+    return out_.write(buffer, size);
+  }
+  using Print::write;
+  uint32_t crc = 0;
+
+ private:
+  Print &out_;
+};
+
+// Binary log block being filled, and the sequence number it will be written with
+LogBlock log_block;
+uint32_t log_block_seq = 0;
+// Packed log run being filled, see logPacked()
+uint16_t packed_fill = 0;        // Payload bytes used in log_block
+uint16_t packed_run = 0;         // Offset of the open run's LogPackedRun in the payload
+uint64_t packed_base_us = 0;     // Time of the run's first record
+int32_t packed_last_raw = 0;     // Raw reading of the run's last record
+uint32_t packed_period_lo = 0;   // Range of record spacings, in 1/16 us, that keep every
+uint32_t packed_period_hi = 0;   // record of the run within PACKED_TIME_TOLERANCE_US
+
+// Rainflow cycle counts of the load since power on, saved to rainflow_name at each sync
+RainflowCounter rainflow;
+char rainflow_name[13] = "";    // .RFC file named after the first log, empty if none
+uint32_t rainflow_sector = 0;   // First card sector of it, 0 if it couldn't be set up
+uint32_t rainflow_seq = 0;      // Records written
+uint32_t rainflow_start_unix = 0;
 
 // Battery tracking variables
 float measuredvbat;
 
+// Timing of the hot path stages, indexed by LOG_STAGE_x
+StageTimer stage_timers[LOG_STAGE_COUNT];
+const char *stage_names[LOG_STAGE_COUNT] = {"loop", "getReading", "getUTC", "log write", "sync"};
+uint32_t loop_start_us = 0; // micros() at the start of the previous pass of loop()
+uint32_t stats_time = 0;    // Time the last stats footer was logged
+uint64_t sleep_us = 0;      // Time spent asleep in powerIdle() since power on
+
+// Startup timing: millis() at the end of each BOOT_STAGE_x, and when the first conversion
+// was read. millis() counts from reset.
+const char *boot_stage_names[BOOT_STAGE_COUNT] = {"card", "sensors", "settings", "clock", "AFE", "log"};
+uint32_t boot_stage_ms[BOOT_STAGE_COUNT];
+uint32_t first_sample_ms = 0;
+uint32_t lc_power_ms = 0; // When the NAU7802's LDO was turned on
+
 // ***********************************************************************
 // * SETUP
 // ***********************************************************************
@@ -227,6 +759,7 @@ void setup(void) {
   }
   Serial.println(F("SD card OK"));
   Serial.println();
+  boot_stage_ms[BOOT_STAGE_CARD] = millis();
   
   // Set up RTC
   Wire.begin();  
@@ -242,14 +775,7 @@ void setup(void) {
   Serial.println(F("RTC OK"));
   Serial.println();
   
-  // Set up load cell
-  if (load_cell.begin() == false) {
-      error(F("LC"));
-  }
-  Serial.println(F("LC OK"));
-  
-  // Increase to max sample rate
-  load_cell.setSampleRate(NAU7802_SPS_320); 
+  // Set up load cell, at the max sample rate (LC_SAMPLE_RATE).
   // Turn down load cell gain since we are using a large capacity cell
   // Gains of 1, 2, 4, 8, 16, 32, 64, and 128 are available. This can be adjusted
   // depending on the capacity of the cell.
@@ -257,12 +783,16 @@ void setup(void) {
   // for bench testing with nearly no load (say, 3kg=6.61 lb), try very high gain
   //gain_setting = NAU7802_GAIN_128;  
   gain_setting = NAU7802_GAIN_16;  // for real world
-  load_cell.setGain(gain_setting);
-  // Re-cal analog front end when we change gain, sample rate, or channel 
-  load_cell.calibrateAFE();
+  // Powered up now, but calibrated once the clock is started, so its LDO settles meanwhile
+  if (loadCellBegin() == false) {
+      error(F("LC"));
+  }
+  boot_stage_ms[BOOT_STAGE_SENSORS] = millis();
 
   // Load system settings from file
   readSystemSettings();
+  filterBegin();
+  calibrationBegin();
   
   // Retrieve load cell calibration settings
   getCalibration();
@@ -271,22 +801,35 @@ void setup(void) {
       Serial.println(F("LC !cal"));
   }
   
-  // Create new file based on current date and increment - 19122000.csv, 19122001.csv, 19122100.csv, etc
-  now = rtc.now();
-  sprintf(filename, "%02d%02d%02d00.CSV", now.year() % 1000, now.month(), now.day());
-  for (uint8_t i = 0; i < 100; i++) {
-    filename[6] = i/10 + '0';
-    filename[7] = i%10 + '0';
-    if (! SD.exists(filename)) {
-      // Only open a new file if it doesn't exist
-      logfile = SD.open(filename, FILE_WRITE); 
-      break;  // Leave the loop!
-    } // End if SD exists
-  } // End for loop
-  
-  if (!logfile) {
+  // Trim the previous log if power was cut while it was open, and put back its last
+  // synced sector from the journal
+  journalBegin();
+  recoverLog();
+  // Number the next log and event file
+  scanFileIndexes();
+  boot_stage_ms[BOOT_STAGE_SETTINGS] = millis();
+
+  // Start the millis() clock on an RTC second boundary
+  clockBegin();
+  boot_stage_ms[BOOT_STAGE_CLOCK] = millis();
+
+  // Re-cal analog front end now the gain and sample rate are set
+  if (loadCellCalibrate() == false) {
+      error(F("LC"));
+  }
+  Serial.println(F("LC OK"));
+  boot_stage_ms[BOOT_STAGE_AFE] = millis();
+
+  #if DRDY_PIN >= 0
+    pinMode(DRDY_PIN, INPUT);
+    attachInterrupt(digitalPinToInterrupt(DRDY_PIN), drdyISR, RISING);
+  #endif // DRDY_PIN
+
+  if (!openLog()) {
     error(F("logfile"));
   }
+  rainflowBegin();
+  boot_stage_ms[BOOT_STAGE_LOG] = millis();
   
   Serial.print(F("Logging to: "));
   Serial.print(filename);
@@ -296,17 +839,16 @@ void setup(void) {
   Serial.println();
   
   Serial.println();
-  Serial.println(F("Type the following menu commands at any time:\n l - Change logging interval\n s - Change card sync interval\n e - Toggle echo to serial\n z - Get current real-time clock time\n d - Set real-time clock time\n c - Calibrate load cell with known weight\n m - Manually calibrate load cell with known values\n v - Retrieve load cell calibration values \n t - Tare the load cell\n f - Enter the file manager."));
+  Serial.println(F("Type the following menu commands at any time:\n l - Change logging interval (0 logs every conversion)\n s - Change card sync interval\n e - Toggle echo to serial\n z - Get current real-time clock time\n d - Set real-time clock time\n c - Calibrate load cell with known weight\n m - Manually calibrate load cell with known values\n v - Retrieve load cell calibration values \n t - Tare the load cell\n f - Enter the file manager.\n r - Toggle the live binary stream (host/lcl_live).\n w - Write the settings to config.txt.\n q - Close the log file before powering off.\n i - Show loop timing and dropped sample counts."));
   Serial.println(F("Type menu CMD any time."));
   Serial.println();
   
-  // Write the file header 
-  logfile.println("millis,time,raw_load,load");    
   if (echo) {
-    Serial.println(F("millis,time,raw_load,load"));
-  }
-  if (!logfile) {
-    error(F("log file"));
+    if (log_record == LOG_RECORD_SUMMARY) {
+      Serial.println(F(CSV_SUMMARY_HEADER));
+    } else {
+      Serial.println(F(CSV_SAMPLE_HEADER));
+    }
   }
 
   // Set RGB to green for setup OK
@@ -321,143 +863,77 @@ void setup(void) {
 // * LOOOOOOOOOOOOOOOOOOOOOOOOOOP
 // ***********************************************************************
 void loop(void) {
-  // Check for incoming serial data in the serial buffer
-  if (Serial.available() > 0) {
-    input = Serial.read();
-    // Switch on incoming byte
-    switch(input) {
-      // Toggle echo to serial
-      case 'e': case 'E':
-        echo = !echo;
-        Serial.println();
-        if (echo) {
-          Serial.println(F("EOS ON"));
-        } else {
-          Serial.println(F("EOS OFF"));
-        }
-        Serial.println();
-        // Commit these values to SD config.txt
-        saveSystemSettings();
-        break;
-      // Set logging interval
-      case 'l': case 'L':
-        setLogInterval();
-        break;
-      // Set sync interval
-      case 's': case 'S':
-        setSyncInterval();
-        break;
-      // Get zulu time
-      case 'z': case 'Z':
-        Serial.println(getUTC());
-        break;
-      // Set RTC
-      case 'd': case 'D':
-        setRTC();
-        break;
-      // Tare the load cell
-      case 't': case 'T':
-        load_cell.calculateZeroOffset();
-        saveSystemSettings();
-        Serial.println();
-        Serial.println(F("LC zeroed."));
-        Serial.println();
-        break;
-      // Calibrate the scale
-      case 'c': case 'C':
-        calibrateScale();
-        break;
-      // Output calibration settings
-      case 'v': case 'V':
-        getCalibration();
-        break;
-      // Manual calibration
-      case 'm': case 'M':
-        manualCalibration();
-        break;
-      // Enter file manager
-      case 'f': case 'F':
-        fileManager();
-        break;
-      // Invalid character entered
-      default:
-        Serial.println(F("Invalid command "));
-        Serial.println(input);
-    } // End switch
-  } // End if serial available
-  // Clear anything in RX buffer
-  while (Serial.available()) Serial.read();
-  // If the log interval has not yet elapsed, skip the rest of the loop
-  if ((millis() - log_time) < log_interval) return;
-  
-  // Log milliseconds since starting
-  log_time = millis();
-  logfile.print(log_time);
-  logfile.print(",");    
-  if (echo) {
-    Serial.print(log_time);
-    Serial.print(F(","));
-  }
- 
-  // Log time
-  logfile.print(getUTC());
-  if (echo) {
-    Serial.print(getUTC());
-  }
-
-  // Read loadcell value and write this to line
-  if (load_cell.available() == true) {
-    raw_load = load_cell.getReading();
-    load = load_cell.getWeight();
-  } else {
-    raw_load = 99999;
-    load = 99999;
-  }
-  
-  // Write load cell value to log
-  logfile.print(",");
-  logfile.print(raw_load);
-  logfile.print(", ");
-  logfile.println(load); // println ends current line in file
-  if (echo) {
-    Serial.print(F(","));
-    Serial.print(raw_load);
-    Serial.print(F(","));
-    Serial.println(load);
-  }
-
-  // Check if load is greater than max_load and if so save load as max_load. Then set RGB LED.
-  if (load > max_load) {
-    max_load = load;
-    // Set RGB LED 
-    if (max_load/trip_value > 1.0) {
-      setRGB(red, 3); // Red, trip value has been reached.
-    } else if (max_load/trip_value > 0.75) {
-      setRGB(orange, 3);  // Orange, 75% of trip value has been reached. 
-    } else if (max_load/trip_value > 0.5) {
-      setRGB(yellow, 3); // Yellow, 50% of trip value has been reached.
-    }
+  uint32_t loop_us = micros();
+  if (loop_start_us != 0) stage_timers[LOG_STAGE_LOOP].add(loop_us - loop_start_us);
+  loop_start_us = loop_us;
+
+  // Act on serial input and move any menu operation along
+  menuService();
+
+  // Queue any new conversion, then log/monitor everything queued so far
+  acquireSamples();
+  drainSamples();
+  // Don't let a part frame sit when conversions are slow, decimated say
+  if (live_count > 0 && (millis() - live_ms) >= LIVE_FLUSH_MS) liveFlush();
+  // Save a finished event capture to its own file
+  writeCapture();
+  // Hand a full buffer to the card if it is ready for one
+  writerService();
+  // Compare the clock with the RTC if a check is due
+  clockService();
+  // Nothing left to do until the next conversion or serial input, so sleep
+  powerIdle();
+  // Move on to a new file before the extent runs out
+  if (logging && sd_sector + LOG_ROLLOVER_SECTORS > log_last_sector) {
+    rolloverLog();
   }
   
   // Now we write data to disk! Don't sync too often - requires 2048 bytes of I/O to SD card
   // which uses a bunch of power and takes time; but if power is cut to board, all data since last sync is lost.
-  if ((millis() - sync_time) < sync_interval) return; // Skips the rest of the loop function if not syncing
+  if ((millis() - sync_time) < (uint32_t)sync_interval) return; // Skips the rest of the loop function if not syncing
   sync_time = millis();  
   // Sync data to the card & update FAT
-  if (echo) {
+  if (echo && menuIdle()) {
     Serial.println();
     Serial.println(F("Writing to SD card."));
+    Serial.print(F("Samples dropped: ")); Serial.print(sample_ring.dropped());
+    Serial.print(F(" missed: ")); Serial.print(missed_samples);
+    Serial.print(F(" ring peak: ")); Serial.println(sample_ring.peak());
+    Serial.print(F("SD max write us: ")); Serial.print(sd_write_max_us);
+    Serial.print(F(" max queue us: ")); Serial.print(sd_queue_max_us);
+    Serial.print(F(" max sync us: ")); Serial.print(sd_sync_max_us);
+    Serial.print(F(" overruns: ")); Serial.print(sd_overruns);
+    Serial.print(F(" lost bytes: ")); Serial.println(sd_lost_bytes);
+    if (adaptive) {
+      Serial.print(F("Events: ")); Serial.print(event_count);
+      Serial.print(F(event_active ? " (logging full rate)" : " (idle)"));
+      Serial.println();
+    }
     Serial.println();
   }
-  logfile.flush();
+  if (logging && (millis() - stats_time) >= STATS_INTERVAL_MS) {
+    logStats();
+  }
+  if (logging && log_format != LOG_FORMAT_CSV && (millis() - clock_log_time) >= CLOCK_LOG_INTERVAL_MS) {
+    logClock();
+  }
+  // Put the partly filled sector in the journal. No FAT or directory update is needed.
+  writerSync(log_format != LOG_FORMAT_CSV ? (const uint8_t *)&log_block : NULL, false);
+  rainflowSave();
+  // Schedule a check of the millis() clock against the RTC
+  clockResync();
 
   // Check the battery level after syncing
   measuredvbat = analogRead(VBATPIN);
-  Serial.print(F("RGB pin value: ")); Serial.print(measuredvbat);
+  if (menuIdle()) {
+    Serial.print(F("RGB pin value: ")); Serial.print(measuredvbat);
+  }
   measuredvbat *= 2;    // we divided by 2, so multiply back
   measuredvbat *= 3.3;  // Multiply by 3.3V, our reference voltage
   measuredvbat /= 1024; // convert to voltage
-  Serial.print(F("= VBat: ")); Serial.println(measuredvbat);
+  if (menuIdle()) {
+    Serial.print(F("= VBat: ")); Serial.println(measuredvbat);
+  }
   // If battery voltage is below defined low battery value, set RGB light as blue
   // this overrides other states
   if (measuredvbat < LOW_BATTERY_VOLTAGE) {
@@ -465,12 +941,1400 @@ void loop(void) {
   } else {
     setRGB(rgb_state, 3);
   }
-  Serial.print(F("RGB is: "));
-  Serial.println(rgb_color_string(rgb_state, 3));
+  if (menuIdle()) {
+    Serial.print(F("RGB is: "));
+    Serial.println(rgb_color_string(rgb_state, 3));
+  }
   
 } // End loop
 
 
+// ***********************************************************************
+// * ACQUISITION FUNCTIONS
+// ***********************************************************************
+
+// NAU7802 DRDY interrupt, only flags the conversion - the I2C read happens in
+// acquireSamples() so it never collides with RTC traffic on the same bus
+void drdyISR() {
+  drdy_us = micros();
+  drdy_flag = true;
+}
+
+// Read a completed conversion, if there is one, and queue it for the logger.
+// Cheap enough to call as often as possible; never blocks waiting on the ADC.
+void acquireSamples() {
+  Sample sample;
+  #if DRDY_PIN >= 0
+    if (!drdy_flag) {
+      // DRDY only rises again once the last result has been read, so one left unread
+      // (while a menu had the serial port, say) holds it high and no edge ever comes
+      if ((micros() - last_sample_us) < 2 * CONVERSION_PERIOD_US || digitalRead(DRDY_PIN) == LOW) return;
+      drdy_us = micros();
+    }
+    sample.us = drdy_us;
+    drdy_flag = false;
+  #else
+    if (load_cell.available() == false) return;
+    sample.us = micros();
+  #endif // DRDY_PIN
+  uint32_t start_us = micros();
+  sample.raw = load_cell.getReading();
+  stage_timers[LOG_STAGE_READING].add(micros() - start_us);
+  // A gap of two or more conversion periods means the ADC overwrote results
+  if (last_sample_us != 0 && (sample.us - last_sample_us) >= 2 * CONVERSION_PERIOD_US) {
+    missed_samples += (sample.us - last_sample_us + CONVERSION_PERIOD_US / 2) / CONVERSION_PERIOD_US - 1;
+  }
+  last_sample_us = sample.us;
+  sample_ring.push(sample);
+  if (first_sample_ms == 0) first_sample_ms = millis();
+}
+
+// Set up the filter chain from the filter_x settings
+void filterBegin() {
+  filter_shift = 0;
+  while (filter_shift < 5 && (1 << filter_shift) < filter_decimate) filter_shift++;
+  filter.begin(filter_median, filter_lowpass, filter_shift);
+}
+
+// Work out the integer calibration and load thresholds. Called whenever the
+// calibration changes.
+void calibrationBegin() {
+  load_scale = loadScale(load_cell.getCalibrationFactor());
+  load_zero = load_cell.getZeroOffset();
+  trip_centi = (long)trip_value * 100;
+  trigger_centi = trip_centi * trigger_percent / 100;
+  rearm_centi = trip_centi * EVENT_REARM_PERCENT / 100;
+  trigger_counts = fabs(trigger_rate * load_cell.getCalibrationFactor());
+}
+
+// Convert a raw reading to calibrated load, same as NAU7802::getWeight() with
+// negative loads clamped to zero but without taking a fresh reading. For the
+// occasional reading only; per conversion, use centiLoad().
+float rawToLoad(long raw) {
+  return centiLoad(raw, load_zero, load_scale) / 100.0;
+}
+
+// Empty the sample ring. Every conversion updates max_load_centi and the status LED,
+// one per log_interval (or all of them if log_interval is 0) is written out.
+// In adaptive mode every conversion is written out during an event. With summary
+// records, every conversion goes into the summary written at the end of its interval
+// and adaptive mode does not apply.
+// Conversions go through the filter chain first, so from there on raw_load and
+// everything logged are filtered counts at the decimated rate.
+void drainSamples() {
+  Sample sample;
+  while (sample_ring.pop(sample)) {
+    if (!filter.process(sample.raw)) continue;
+    raw_load = sample.raw;
+    load_centi = centiLoad(raw_load, load_zero, load_scale);
+    // Feed a tare or calibration in progress
+    if (menu_average_count < menu_average_size) {
+      menu_average_sum += raw_load;
+      menu_average_count++;
+    }
+    liveSample(sample.us);
+    checkTripValue();
+    rainflow.add(load_centi);
+    bool event_start = adaptive && checkTrigger(sample);
+    byte level = tripLevel(load_centi);
+    if (level > capture_level) {
+      captureBegin(level);
+    } else if (load_centi < rearm_centi) {
+      capture_level = 0;
+    }
+    captureSample(sample);
+    history.push(sample);
+    if (!logging) continue;
+    uint64_t sample_us = monoFromMicros(sample.us);
+    uint32_t sample_ms = sample_us / 1000;
+    if (log_record == LOG_RECORD_SUMMARY) {
+      // This conversion starts a new interval once the current one is up
+      if (summary.count > 0 && (sample_ms - log_time) >= (uint32_t)log_interval) logSummary();
+      if (summary.count == 0) {
+        log_time = sample_ms;
+        summary_us = sample_us;
+      }
+      summary.add(sample.raw);
+      continue;
+    }
+    if (event_start) logHistory(sample.us);
+    if (!event_active && log_interval > 0 && (sample_ms - log_time) < (uint32_t)log_interval) continue;
+    log_time = sample_ms;
+    logged_us = sample.us;
+    logSample(sample_us);
+  }
+}
+
+// Write raw_load/load_centi to the log file, and to serial if echo is on. sample_us is
+// the monotonic micros() time of the conversion; millis is that in ms. The CSV line is
+// formatted into a buffer with the integer routines in fixed_point.h and handed over
+// in one piece.
+void logSample(uint64_t sample_us) {
+  uint32_t start_us = micros();
+  if (log_format != LOG_FORMAT_CSV) {
+    logRecord(sample_us, raw_load);
+    stage_timers[LOG_STAGE_LOG_WRITE].add(micros() - start_us);
+    if (!echo || live) return;
+  }
+  char line[CSV_RECORD_BYTES + 16];
+  char *end = formatU32(line, (uint32_t)(sample_us / 1000));
+  *end++ = ',';
+  for (const char *utc = utcString(sample_us); *utc; utc++) *end++ = *utc;
+  *end++ = ',';
+  end = formatI32(end, raw_load);
+  *end++ = ',';
+  *end++ = ' ';
+  end = formatCenti(end, load_centi);
+  *end++ = ',';
+  end = formatU64(end, sample_us);
+  *end++ = '\r'; // Line ending as println() writes it
+  *end++ = '\n';
+  if (log_format == LOG_FORMAT_CSV) {
+    writerAppend((const uint8_t *)line, end - line);
+    stage_timers[LOG_STAGE_LOG_WRITE].add(micros() - start_us);
+  }
+  if (echo && !live && menuIdle()) {
+    Serial.write((const uint8_t *)line, end - line);
+  }
+}
+
+// Add the conversion in raw_load/load_centi to the live stream, if it is on. Full
+// frames go straight out; the text echo is off meanwhile, so this is all the serial
+// traffic per conversion.
+void liveSample(uint32_t sample_us) {
+  if (!live) return;
+  if (live_count == 0) live_ms = millis();
+  LiveRecord &record = live_records[live_count++];
+  record.us = sample_us;
+  record.raw = raw_load;
+  record.load = load_centi;
+  if (live_count == LIVE_RECORDS_PER_FRAME) liveFlush();
+}
+
+// Send the live records so far as one frame. While a prompt or transfer has the serial
+// port the frame is dropped, but still numbered, so the host can see the gap.
+void liveFlush() {
+  if (live_count == 0) return;
+  if (menuIdle()) {
+    sendFrame(TRANSFER_LIVE, live_seq, live_records, live_count * sizeof(LiveRecord));
+  }
+  live_seq++;
+  live_count = 0;
+}
+
+// Write out and reset the summary of the current log interval. Statistics are kept in
+// raw counts and calibrated on the way out; the mean is not clamped at zero load.
+void logSummary() {
+  uint32_t start_us = micros();
+  float raw_mean = summary.mean();
+  float raw_stddev = summary.stddev();
+  if (log_format != LOG_FORMAT_CSV) {
+    if (log_block.header.type != LOG_BLOCK_SUMMARY) {
+      if (log_block.header.count > 0) writeLogBlock();
+      startLogBlock(LOG_BLOCK_SUMMARY);
+    }
+    LogSummary *record = &log_block.summaries[log_block.header.count++];
+    record->us = (uint32_t)summary_us;
+    record->count = summary.count;
+    record->raw_min = summary.min;
+    record->raw_max = summary.max;
+    record->raw_mean = raw_mean;
+    record->raw_stddev = raw_stddev;
+    if (log_block.header.count == LOG_SUMMARIES_PER_BLOCK) {
+      writeLogBlock();
+      startLogBlock(LOG_BLOCK_SUMMARY);
+    }
+    stage_timers[LOG_STAGE_LOG_WRITE].add(micros() - start_us);
+  }
+  if (log_format == LOG_FORMAT_CSV) {
+    printSummary(logstream, raw_mean, raw_stddev);
+    stage_timers[LOG_STAGE_LOG_WRITE].add(micros() - start_us);
+  }
+  if (echo && !live && menuIdle()) printSummary(Serial, raw_mean, raw_stddev);
+  summary.reset();
+}
+
+// Print the current summary as a CSV line
+void printSummary(Print &out, float raw_mean, float raw_stddev) {
+  float cal = load_cell.getCalibrationFactor();
+  out.print((uint32_t)(summary_us / 1000));
+  out.print(",");
+  out.print(utcString(summary_us));
+  out.print(",");
+  out.print(summary.count);
+  out.print(",");
+  out.print(raw_mean);
+  out.print(",");
+  out.print((raw_mean - load_cell.getZeroOffset()) / cal);
+  out.print(",");
+  out.print(rawToLoad(summary.min));
+  out.print(",");
+  out.print(rawToLoad(summary.max));
+  out.print(",");
+  out.print(raw_stddev / cal, 3);
+  out.print(",");
+  printMicros(out, summary_us);
+  out.println();
+}
+
+// Check if load is greater than max_load_centi and if so save it as max_load_centi. Then set RGB LED.
+// The LED is only touched when a new threshold is crossed, since at full rate max_load_centi
+// can climb on hundreds of consecutive samples during a haul.
+void checkTripValue() {
+  if (load_centi <= max_load_centi) return;
+  max_load_centi = load_centi;
+  byte level = tripLevel(max_load_centi);
+  if (level <= trip_level) return;
+  trip_level = level;
+  // Set RGB LED 
+  if (level == 3) {
+    setRGB(red, 3); // Red, trip value has been reached.
+  } else if (level == 2) {
+    setRGB(orange, 3);  // Orange, 75% of trip value has been reached. 
+  } else {
+    setRGB(yellow, 3); // Yellow, 50% of trip value has been reached.
+  }
+}
+
+// Fraction of trip_value a load in hundredths has passed: 0 none, 1 50%, 2 75%, 3 100%
+byte tripLevel(long centi) {
+  if (centi > trip_centi) return 3;
+  if (centi * 4 > trip_centi * 3) return 2;
+  if (centi * 2 > trip_centi) return 1;
+  return 0;
+}
+
+// Adaptive logging: decide whether the conversion in raw_load/load_centi, not yet in the
+// history, is part of an event. It is if the load is past trigger_percent of trip_value
+// or has changed faster than trigger_rate over the last EVENT_RATE_WINDOW conversions,
+// in either direction so a release counts as well as a haul. An event lasts until
+// EVENT_HOLD_MS after the last conversion that met either condition.
+// Returns true if this conversion starts an event.
+bool checkTrigger(const Sample &sample) {
+  bool trigger = load_centi >= trigger_centi;
+  if (!trigger && history.size() >= EVENT_RATE_WINDOW) {
+    const Sample &old = history.back(EVENT_RATE_WINDOW - 1);
+    uint32_t change = sample.raw > old.raw ? sample.raw - old.raw : old.raw - sample.raw;
+    trigger = (uint64_t)change * 1000000 >= (uint64_t)trigger_counts * (sample.us - old.us);
+  }
+  if (trigger) event_trigger_us = sample.us;
+  if (event_active) {
+    if (!trigger && (sample.us - event_trigger_us) >= EVENT_HOLD_MS * 1000) event_active = false;
+    return false;
+  }
+  if (!trigger) return false;
+  event_active = true;
+  event_count++;
+  return true;
+}
+
+// Write out the history the decimated log skipped before an event, oldest first. The
+// newest entry is the conversion at trigger_us, which the caller logs as usual.
+void logHistory(uint32_t trigger_us) {
+  long trigger_raw = raw_load;
+  long trigger_load_centi = load_centi;
+  // Compare ages rather than times, which stays correct across the micros() wrap
+  uint32_t logged_age = trigger_us - logged_us;
+  for (uint16_t i = history.size() - 1; i > 0; i--) {
+    const Sample &sample = history.back(i);
+    if (trigger_us - sample.us >= logged_age) continue;
+    raw_load = sample.raw;
+    load_centi = centiLoad(raw_load, load_zero, load_scale);
+    logged_us = sample.us;
+    logSample(monoFromMicros(sample.us));
+  }
+  raw_load = trigger_raw;
+  load_centi = trigger_load_centi;
+}
+
+// ***********************************************************************
+// * BINARY LOG FUNCTIONS
+// ***********************************************************************
+// See log_format.h for the layout. Blocks are only ever written as whole sectors.
+
+// Fill in the calibration currently loaded in the NAU7802 library
+void fillLogCalibration(LogCalibration *cal) {
+  cal->cal_factor = load_cell.getCalibrationFactor();
+  cal->zero_offset = load_cell.getZeroOffset();
+  cal->gain = gain_setting;
+  cal->sample_rate = LC_SAMPLE_RATE;
+  cal->filter = LOG_FILTER(filter_median, filter_lowpass, filter_shift);
+  cal->reserved = 0;
+}
+
+// Clear log_block and start a new block of the given type
+void startLogBlock(uint8_t type) {
+  memset(&log_block, 0, sizeof(log_block));
+  log_block.header.type = type;
+  log_block.header.seq = log_block_seq;
+}
+
+// Write log_block as the next sector of the file
+void writeLogBlock() {
+  writerAppend((const uint8_t *)&log_block, LOG_SECTOR_SIZE);
+  log_block_seq++;
+}
+
+// Write the header sector of a new binary log and start the first block
+void writeLogHeader() {
+  log_block_seq = 0;
+  memset(&log_block, 0, sizeof(log_block));
+  fillLogHeader((LogFileHeader *)&log_block);
+  writerAppend((const uint8_t *)&log_block, LOG_SECTOR_SIZE);
+  startLogBlock(LOG_BLOCK_SAMPLES);
+}
+
+// Fill in a file header as of now, in a zeroed sector
+void fillLogHeader(LogFileHeader *header) {
+  header->magic = LOG_MAGIC;
+  header->format_version = LOG_FORMAT_VERSION;
+  header->fw_major = VERSION_MAJOR;
+  header->fw_minor = VERSION_MINOR;
+  // start_ms is the millis() value at which the start_unix second began
+  uint64_t mono_us = monoMicros();
+  uint64_t unix_us = clockUnixUs(mono_us);
+  header->start_unix = unix_us / 1000000;
+  header->start_ms = (mono_us - unix_us % 1000000) / 1000;
+  fillLogClock(&header->clock);
+  header->log_interval = log_interval;
+  fillLogCalibration(&header->cal);
+}
+
+// Add a record to the current block, writing it out once it is full
+void logRecord(uint64_t sample_us, long raw) {
+  if (log_format == LOG_FORMAT_PACKED) {
+    logPacked(sample_us, raw);
+    return;
+  }
+  LogRecord *record = &log_block.records[log_block.header.count++];
+  record->us = (uint32_t)sample_us;
+  record->raw = raw;
+  if (log_block.header.count < LOG_RECORDS_PER_BLOCK) return;
+  writeLogBlock();
+  startLogBlock(LOG_BLOCK_SAMPLES);
+}
+
+// Add a record to the current packed block: to the open run if its time is close enough
+// to one the run's spacing can give it, otherwise as the start of a new run. Every record
+// of a run narrows the range of spacings that fit them all, so the run ends when no one
+// spacing fits, and its period is kept in the middle of the range as it goes.
+void logPacked(uint64_t sample_us, long raw) {
+  if (log_block.header.type != LOG_BLOCK_PACKED) {
+    if (log_block.header.count > 0) writeLogBlock();
+    startLogBlock(LOG_BLOCK_PACKED);
+    packed_fill = 0;
+  }
+  if (log_block.header.count > 0) {
+    LogPackedRun *run = (LogPackedRun *)&log_block.bytes[packed_run];
+    uint32_t n = run->count;
+    uint64_t elapsed = (sample_us - packed_base_us) * 16;
+    uint64_t tolerance = PACKED_TIME_TOLERANCE_US * 16;
+    uint64_t lo = elapsed > tolerance ? (elapsed - tolerance + n - 1) / n : 0;
+    uint64_t hi = (elapsed + tolerance) / n;
+    if (lo < packed_period_lo) lo = packed_period_lo;
+    if (hi > packed_period_hi) hi = packed_period_hi;
+    uint8_t delta[VARINT_MAX_BYTES];
+    uint8_t bytes = putVarint(delta, zigzagEncode(raw - packed_last_raw));
+    if (lo <= hi && n < UINT16_MAX && packed_fill + bytes <= LOG_BLOCK_PAYLOAD) {
+      memcpy(&log_block.bytes[packed_fill], delta, bytes);
+      packed_fill += bytes;
+      run->count++;
+      packed_period_lo = lo;
+      packed_period_hi = hi;
+      run->period = lo + (hi - lo) / 2;
+      packed_last_raw = raw;
+      return;
+    }
+  }
+  // Start a new run, in a new block if there is no room for it in this one
+  if (packed_fill + sizeof(LogPackedRun) > LOG_BLOCK_PAYLOAD || log_block.header.count == UINT8_MAX) {
+    writeLogBlock();
+    startLogBlock(LOG_BLOCK_PACKED);
+    packed_fill = 0;
+  }
+  packed_run = packed_fill;
+  LogPackedRun *run = (LogPackedRun *)&log_block.bytes[packed_run];
+  run->us = (uint32_t)sample_us;
+  run->raw = raw;
+  run->period = 0;
+  run->count = 1;
+  log_block.header.count++;
+  packed_fill += sizeof(LogPackedRun);
+  packed_base_us = sample_us;
+  packed_last_raw = raw;
+  packed_period_lo = 0;
+  packed_period_hi = UINT32_MAX;
+}
+
+// Record a new calibration in a binary log so later records decode with it.
+// Any partial sample block is closed out short first.
+void logCalibrationChange() {
+  if (log_format == LOG_FORMAT_CSV) return;
+  if (log_block.header.count > 0) {
+    writeLogBlock();
+  }
+  startLogBlock(LOG_BLOCK_CALIBRATION);
+  fillLogCalibration(&log_block.cal);
+  writeLogBlock();
+  startLogBlock(LOG_BLOCK_SAMPLES);
+}
+
+// ***********************************************************************
+// * EVENT CAPTURE FUNCTIONS
+// ***********************************************************************
+// Whenever the load rises through 50, 75 or 100% of trip_value, the conversions either
+// side of the crossing are saved at full rate to their own file, whatever the log is
+// recording. A capture re-arms once the load falls below EVENT_REARM_PERCENT, so every
+// haul gets one, and a capture in progress takes in any higher threshold crossed in it.
+
+// Freeze the history as the pre-trigger window and start collecting the rest
+void captureBegin(byte level) {
+  if (capture_count > 0 || capture_ready) {
+    // Already capturing this event, or the last one is still to be written. Either way
+    // only record that this threshold has been seen.
+    capture_level = level;
+    return;
+  }
+  capture_level = level;
+  capture_load_centi = load_centi;
+  capture_pre = history.size();
+  for (uint16_t i = 0; i < capture_pre; i++) {
+    capture[i] = history.back(capture_pre - 1 - i);
+  }
+  capture_count = capture_pre;
+}
+
+// Add a conversion to the capture in progress, if there is one
+void captureSample(const Sample &sample) {
+  if (capture_count == 0 || capture_ready) return;
+  capture[capture_count++] = sample;
+  if (capture_count == capture_pre + EVENT_POST_SIZE) capture_ready = true;
+}
+
+// Write a completed capture to the next free EVENTnnn.EVT, in the binary log layout:
+// header, event block, then the records
+void writeCapture() {
+  if (!capture_ready) return;
+  if (logging) {
+    writerPause();
+    char name[13];
+    File file;
+    for (; event_file_index < 1000; event_file_index++) {
+      sprintf(name, "EVENT%03u.EVT", (unsigned)event_file_index);
+      if (!SD.exists(name)) {
+        file = SD.open(name, O_WRONLY | O_CREAT | O_EXCL);
+        break;
+      }
+    }
+    if (file) {
+      LogBlock block;
+      memset(&block, 0, sizeof(block));
+      // fillLogClock() moves the clock anchor up to now, however long the logger has run
+      fillLogHeader((LogFileHeader *)&block);
+      ((LogFileHeader *)&block)->log_interval = 0;
+      file.write((const uint8_t *)&block, LOG_SECTOR_SIZE);
+      memset(&block, 0, sizeof(block));
+      block.header.type = LOG_BLOCK_EVENT;
+      block.event.trigger_us = monoFromMicros(capture[capture_pre].us);
+      block.event.load = capture_load_centi / 100.0;
+      block.event.trip_value = trip_value;
+      block.event.level = tripLevel(capture_load_centi);
+      block.event.pre_count = capture_pre;
+      block.event.post_count = capture_count - capture_pre;
+      file.write((const uint8_t *)&block, LOG_SECTOR_SIZE);
+      for (uint16_t i = 0; i < capture_count; i += LOG_RECORDS_PER_BLOCK) {
+        acquireSamples();
+        uint32_t seq = block.header.seq + 1;
+        memset(&block, 0, sizeof(block));
+        block.header.type = LOG_BLOCK_SAMPLES;
+        block.header.seq = seq;
+        while (block.header.count < LOG_RECORDS_PER_BLOCK && i + block.header.count < capture_count) {
+          const Sample &sample = capture[i + block.header.count];
+          block.records[block.header.count].us = sample.us;
+          block.records[block.header.count].raw = sample.raw;
+          block.header.count++;
+        }
+        file.write((const uint8_t *)&block, LOG_SECTOR_SIZE);
+      }
+      file.close();
+      if (menuIdle()) {
+        Serial.print(F("Event captured to "));
+        Serial.println(name);
+      }
+    }
+    writerResume();
+  }
+  capture_count = 0;
+  capture_ready = false;
+}
+
+// ***********************************************************************
+// * INSTRUMENTATION FUNCTIONS
+// ***********************************************************************
+// Stage timings and drop counters accumulate from power on. They are shown with the
+// i command and written into the log every STATS_INTERVAL_MS and when it is closed.
+
+// Snapshot the timers and counters in log layout
+void fillLogStats(LogStats *stats) {
+  memset(stats, 0, sizeof(LogStats));
+  stats->uptime_ms = millis();
+  for (uint8_t i = 0; i < LOG_STAGE_COUNT; i++) {
+    const StageTimer &timer = stage_timers[i];
+    stats->stages[i].count = timer.count;
+    stats->stages[i].min_us = timer.min();
+    stats->stages[i].max_us = timer.max_us;
+    stats->stages[i].mean_us = timer.mean();
+    memcpy(stats->stages[i].hist, timer.hist, sizeof(timer.hist));
+  }
+  stats->ring_dropped = sample_ring.dropped();
+  stats->ring_peak = sample_ring.peak();
+  stats->missed_samples = missed_samples;
+  stats->sd_overruns = sd_overruns;
+  stats->sd_lost_bytes = sd_lost_bytes;
+  stats->sd_write_max_us = sd_write_max_us;
+  stats->sd_queue_max_us = sd_queue_max_us;
+  stats->sleep_ms = sleep_us / 1000;
+}
+
+// Write a stats footer into the log. In a binary log it is a LOG_BLOCK_STATS block;
+// in a CSV log it is lines starting with # so they can't be mistaken for samples:
+//   #stats,<stage>,<count>,<min us>,<max us>,<mean us>,<8 histogram buckets>
+//   #counters,<uptime ms>,<ring dropped>,<ring peak>,<missed>,<overruns>,<lost bytes>,<asleep ms>
+void logStats() {
+  stats_time = millis();
+  if (log_format != LOG_FORMAT_CSV) {
+    if (log_block.header.count > 0) {
+      writeLogBlock();
+    }
+    startLogBlock(LOG_BLOCK_STATS);
+    fillLogStats(&log_block.stats);
+    writeLogBlock();
+    startLogBlock(LOG_BLOCK_SAMPLES);
+    return;
+  }
+  for (uint8_t i = 0; i < LOG_STAGE_COUNT; i++) {
+    const StageTimer &timer = stage_timers[i];
+    logstream.print("#stats,"); logstream.print(stage_names[i]);
+    logstream.print(","); logstream.print(timer.count);
+    logstream.print(","); logstream.print(timer.min());
+    logstream.print(","); logstream.print(timer.max_us);
+    logstream.print(","); logstream.print(timer.mean());
+    for (uint8_t b = 0; b < STAGE_HIST_BUCKETS; b++) {
+      logstream.print(","); logstream.print(timer.hist[b]);
+    }
+    logstream.println();
+  }
+  logstream.print("#counters,"); logstream.print(millis());
+  logstream.print(","); logstream.print(sample_ring.dropped());
+  logstream.print(","); logstream.print(sample_ring.peak());
+  logstream.print(","); logstream.print(missed_samples);
+  logstream.print(","); logstream.print(sd_overruns);
+  logstream.print(","); logstream.print(sd_lost_bytes);
+  logstream.print(","); logstream.println((uint32_t)(sleep_us / 1000));
+}
+
+// Serial report for the i command
+void printStats() {
+  Serial.println();
+  Serial.println(F("Stage         count      min us   max us   mean us"));
+  for (uint8_t i = 0; i < LOG_STAGE_COUNT; i++) {
+    const StageTimer &timer = stage_timers[i];
+    Serial.print(stage_names[i]);
+    for (uint8_t pad = strlen(stage_names[i]); pad < 12; pad++) Serial.print(' ');
+    Serial.print(timer.count); Serial.print(F("  "));
+    Serial.print(timer.min()); Serial.print(F("  "));
+    Serial.print(timer.max_us); Serial.print(F("  "));
+    Serial.println(timer.mean());
+    Serial.print(F("  histogram <16us/<64/<256/<1k/<4k/<16k/<64k/more:"));
+    for (uint8_t b = 0; b < STAGE_HIST_BUCKETS; b++) {
+      Serial.print(' '); Serial.print(timer.hist[b]);
+    }
+    Serial.println();
+  }
+  Serial.print(F("Samples dropped: ")); Serial.print(sample_ring.dropped());
+  Serial.print(F(" missed: ")); Serial.print(missed_samples);
+  Serial.print(F(" ring peak: ")); Serial.println(sample_ring.peak());
+  Serial.print(F("SD overruns: ")); Serial.print(sd_overruns);
+  Serial.print(F(" lost bytes: ")); Serial.print(sd_lost_bytes);
+  Serial.print(F(" max write us: ")); Serial.print(sd_write_max_us);
+  Serial.print(F(" max queue us: ")); Serial.print(sd_queue_max_us);
+  Serial.print(F(" max sync us: ")); Serial.println(sd_sync_max_us);
+  Serial.print(F("Rainflow cycles: ")); Serial.print(rainflow.cycles);
+  Serial.print(F(" open reversals: ")); Serial.print(rainflow.depth);
+  Serial.print(F(" in ")); Serial.println(rainflow_name);
+  Serial.print(F("Awake ")); Serial.print(powerDutyCycle(), 1);
+  Serial.print(F("% of the time, asleep ")); Serial.print((uint32_t)(sleep_us / 1000000));
+  Serial.println(F(" s since power on"));
+  printStartup();
+  Serial.println();
+}
+
+// How long each stage of setup() took, and when the first conversion was read
+void printStartup() {
+  Serial.print(F("Startup ms:"));
+  uint32_t start_ms = 0;
+  for (uint8_t i = 0; i < BOOT_STAGE_COUNT; i++) {
+    Serial.print(' '); Serial.print(boot_stage_names[i]);
+    Serial.print(' '); Serial.print(boot_stage_ms[i] - start_ms);
+    start_ms = boot_stage_ms[i];
+  }
+  Serial.print(F(", first conversion at ")); Serial.println(first_sample_ms);
+}
+
+// ***********************************************************************
+// * POWER FUNCTIONS
+// ***********************************************************************
+// Conversions arrive every 3 ms and take well under a millisecond to handle, so most of
+// each loop() pass used to be spent spinning. powerIdle() sleeps through that until the
+// next interrupt: DRDY or the RTC square wave if wired, USB, or the 1 ms SysTick.
+
+// Sleep until the next interrupt, unless there is work waiting
+void powerIdle() {
+  #if SLEEP_BETWEEN_SAMPLES
+    if (sample_ring.size() > 0) return;
+    if (sd_pending && !SD.card()->isBusy()) return;
+    if (Serial.available()) return;
+    if (menu_state >= MENU_FILE_DUMP) return;
+    #if DRDY_PIN < 0
+      // Polling for conversions: stay awake once the next one is nearly due
+      if ((micros() - last_sample_us) >= CONVERSION_PERIOD_US - 1000) return;
+    #endif // DRDY_PIN
+    uint32_t start_us = micros();
+    // With interrupts masked an edge between the check and the sleep still wakes it
+    noInterrupts();
+    if (!drdy_flag) halSleep();
+    interrupts();
+    sleep_us += micros() - start_us;
+  #endif // SLEEP_BETWEEN_SAMPLES
+}
+
+// Percentage of the time since power on the processor has been awake
+float powerDutyCycle() {
+  uint64_t up_us = monoMicros();
+  if (up_us == 0) return 100.0;
+  return 100.0 - 100.0 * sleep_us / up_us;
+}
+
+// ***********************************************************************
+// * CLOCK FUNCTIONS
+// ***********************************************************************
+// Timestamps come from micros(), extended to a 64 bit monotonic count and anchored to the
+// RTC, instead of an I2C read per sample. Every record carries the monotonic time; UTC is
+// derived from it with a rate correction for the difference between the two crystals.
+//
+// With RTC_SQW_PIN wired, each falling edge of the RTC's 1 Hz square wave is the exact
+// start of a second, so the clock is re-anchored every second and the rate measured
+// over the whole time since it was set. RTC registers are only read to number the
+// seconds, at startup and once per sync.
+//
+// Without it the RTC registers are read at startup and once per card sync. A read only
+// says which whole second it is, so each check is timed CLOCK_GUARD_MS before or after
+// (alternately) the moment the clock expects the RTC to tick. If the RTC disagrees the
+// clock has drifted at least that far; it is moved to the tick and the rate correction
+// re-estimated from the total it has been moved since it was set.
+
+// micros() as a 64 bit count that never wraps. Must be called at least once every 71
+// minutes, which loop() does many times over. Not for use in interrupts.
+uint64_t monoMicros() {
+  uint32_t us = micros();
+  if (us < mono_last_us) mono_high += 1ULL << 32;
+  mono_last_us = us;
+  return mono_high | us;
+}
+
+// Extend a recent micros() value, such as a sample time, to the monotonic count
+uint64_t monoFromMicros(uint32_t us) {
+  uint64_t now_us = monoMicros();
+  return now_us - (uint32_t)((uint32_t)now_us - us);
+}
+
+// RTC square wave falling edge, the start of a second
+void sqwISR() {
+  sqw_us = micros();
+  sqw_ticks++;
+}
+
+// Set the clock to unix_seconds at monotonic time mono_us, with no drift correction
+void clockSet(uint32_t unix_seconds, uint64_t mono_us) {
+  clock_base_us = mono_us;
+  clock_base_unix_us = (uint64_t)unix_seconds * 1000000;
+  clock_start_us = mono_us;
+  clock_start_unix_us = clock_base_unix_us;
+  clock_drift_ppm = 0;
+}
+
+// Start the clock as the RTC seconds tick over, so the fraction of a second starts out
+// right. Uses the square wave if it is wired and running, else polls the RTC. Takes up
+// to a second.
+void clockBegin() {
+  #if RTC_SQW_PIN >= 0
+    rtc.writeSqwPinMode(PCF8523_SquareWave1HZ);
+    pinMode(RTC_SQW_PIN, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(RTC_SQW_PIN), sqwISR, FALLING);
+    uint32_t ticks = sqw_ticks;
+    uint32_t wait_ms = millis();
+    while (sqw_ticks == ticks && (millis() - wait_ms) < 1100);
+    if (sqw_ticks != ticks) {
+      // The RTC has just ticked, so this reads the second that started at the edge
+      uint32_t unix_seconds = rtc.now().unixtime();
+      clock_ticks_seen = sqw_ticks;
+      clockSet(unix_seconds, monoFromMicros(sqw_us));
+      clock_source = LOG_CLOCK_RTC_SQW;
+      return;
+    }
+    detachInterrupt(digitalPinToInterrupt(RTC_SQW_PIN));
+    Serial.println(F("No RTC square wave, using RTC reads"));
+  #endif // RTC_SQW_PIN
+  clock_source = LOG_CLOCK_RTC_READ;
+  uint32_t first = rtc.now().unixtime();
+  uint32_t unix_seconds = first;
+  uint32_t start_ms = millis();
+  while (unix_seconds == first && (millis() - start_ms) < 1100) {
+    unix_seconds = rtc.now().unixtime();
+  }
+  clockSet(unix_seconds, monoMicros());
+}
+
+// UTC in us since 1970 at monotonic time mono_us. mono_us may be a little before the
+// last anchor point, for samples that were queued before it.
+uint64_t clockUnixUs(uint64_t mono_us) {
+  int64_t elapsed = (int64_t)(mono_us - clock_base_us);
+  return clock_base_unix_us + elapsed + elapsed * clock_drift_ppm / 1000000;
+}
+
+// Rate correction from the UTC time gained or lost against micros() since the clock was set
+void clockEstimateDrift() {
+  uint64_t span = clock_base_us - clock_start_us;
+  if (span == 0) return;
+  int64_t gained = (int64_t)(clock_base_unix_us - clock_start_unix_us) - (int64_t)span;
+  int64_t ppm = gained * 1000000 / (int64_t)span;
+  if (ppm > CLOCK_MAX_DRIFT_PPM) ppm = CLOCK_MAX_DRIFT_PPM;
+  if (ppm < -CLOCK_MAX_DRIFT_PPM) ppm = -CLOCK_MAX_DRIFT_PPM;
+  clock_drift_ppm = ppm;
+}
+
+// Schedule the next RTC register check. With the square wave it is mid second, where the
+// read can't straddle a tick; without it, alternately either side of the expected tick.
+void clockResync() {
+  uint32_t ms = millis();
+  uint16_t target = 500;
+  if (clock_source == LOG_CLOCK_RTC_READ) {
+    clock_check_early = !clock_check_early;
+    target = clock_check_early ? 1000 - CLOCK_GUARD_MS : CLOCK_GUARD_MS;
+  }
+  uint16_t phase = clockUnixUs(monoMicros()) / 1000 % 1000;
+  clock_check_ms = ms + (target + 1000 - phase) % 1000;
+  clock_check_armed = true;
+}
+
+// Apply any square wave edges and run a scheduled RTC check once it is due. Cheap enough
+// to call every loop().
+void clockService() {
+  if (clock_source == LOG_CLOCK_RTC_SQW && sqw_ticks != clock_ticks_seen) {
+    clockTick();
+  }
+  if (!clock_check_armed || (int32_t)(millis() - clock_check_ms) < 0) return;
+  clock_check_armed = false;
+  clockCheck();
+}
+
+// Re-anchor the clock on the latest square wave edge. Edges are counted, so one that
+// was handled late still lands on the right second.
+void clockTick() {
+  noInterrupts();
+  uint32_t ticks = sqw_ticks;
+  uint32_t tick_us = sqw_us;
+  interrupts();
+  uint32_t seconds = ticks - clock_ticks_seen;
+  clock_ticks_seen = ticks;
+  uint64_t tick_unix_us = clock_base_unix_us - clock_base_unix_us % 1000000 + (uint64_t)seconds * 1000000;
+  clock_base_us = monoFromMicros(tick_us);
+  clock_base_unix_us = tick_unix_us;
+  clockEstimateDrift();
+}
+
+// Read the RTC and correct the clock if it is in a different second
+void clockCheck() {
+  uint64_t mono_us = monoMicros();
+  uint64_t rtc_us = (uint64_t)rtc.now().unixtime() * 1000000;
+  uint64_t clock_us = clockUnixUs(mono_us);
+  if (clock_us + 5000000 < rtc_us || clock_us > rtc_us + 5000000) {
+    // Too far out to be drift or a missed edge, the RTC was set some other way. Start over.
+    clockSet(rtc_us / 1000000, mono_us);
+    return;
+  }
+  if (clock_us >= rtc_us && clock_us < rtc_us + 1000000) return;
+  if (clock_source == LOG_CLOCK_RTC_SQW) {
+    // Mid second, so the clock is numbering the edges wrongly. Shift it whole seconds.
+    int64_t shift = (int64_t)(rtc_us / 1000000) - (int64_t)(clock_us / 1000000);
+    clock_base_unix_us += shift * 1000000;
+    clock_start_unix_us += shift * 1000000;
+    return;
+  }
+  // Behind: the RTC has ticked, so it is at least the start of its second. Ahead: the RTC
+  // hasn't ticked, so it is at most the end of its second.
+  clock_base_us = mono_us;
+  clock_base_unix_us = clock_us < rtc_us ? rtc_us : rtc_us + 999999;
+  clockEstimateDrift();
+}
+
+// The clock's current anchor, for binary log headers and clock blocks. With RTC reads the
+// anchor only moves when a check finds the clock a second out, which may be hours ago,
+// so it is moved up to now along the current rate first. The square wave moves it every
+// second, and clockTick() needs it on a tick.
+void fillLogClock(LogClock *clock) {
+  if (clock_source == LOG_CLOCK_RTC_READ) {
+    uint64_t mono_us = monoMicros();
+    clock_base_unix_us = clockUnixUs(mono_us);
+    clock_base_us = mono_us;
+  }
+  clock->mono_us = clock_base_us;
+  clock->unix_us = clock_base_unix_us;
+  clock->drift_ppm = clock_drift_ppm;
+  clock->source = clock_source;
+  memset(clock->reserved, 0, sizeof(clock->reserved));
+}
+
+// Write a clock anchor block into a binary log, so the decoder can follow the drift
+// correction and keep record times monotonic past the micros() wrap
+void logClock() {
+  clock_log_time = millis();
+  if (log_block.header.count > 0) {
+    writeLogBlock();
+  }
+  startLogBlock(LOG_BLOCK_CLOCK);
+  fillLogClock(&log_block.clock);
+  writeLogBlock();
+  startLogBlock(LOG_BLOCK_SAMPLES);
+}
+
+// ISO UTC string with milliseconds for monotonic time mono_us, e.g. 2023-03-30T14:05:09.125Z.
+// The date and time part is only rebuilt when the second changes.
+char * utcString(uint64_t mono_us) {
+  uint32_t start_us = micros();
+  static char dtUTC[32];
+  static uint32_t formatted_unix = 0;
+  uint64_t unix_ms = clockUnixUs(mono_us) / 1000;
+  uint32_t unix_seconds = unix_ms / 1000;
+  if (unix_seconds != formatted_unix) {
+    DateTime t(unix_seconds);
+    sprintf(dtUTC, "%04u-%02u-%02uT%02u:%02u:%02u.000Z", t.year(), t.month(), t.day(), t.hour(), t.minute(), t.second());
+    formatted_unix = unix_seconds;
+  }
+  uint16_t frac = unix_ms % 1000;
+  dtUTC[20] = '0' + frac / 100;
+  dtUTC[21] = '0' + frac / 10 % 10;
+  dtUTC[22] = '0' + frac % 10;
+  stage_timers[LOG_STAGE_UTC].add(micros() - start_us);
+  return dtUTC;
+}
+
+// Print a 64 bit microsecond count, which Print has no overload for
+void printMicros(Print &out, uint64_t us) {
+  char digits[21];
+  *formatU64(digits, us) = '\0';
+  out.print(digits);
+}
+
+// ***********************************************************************
+// * SD WRITER FUNCTIONS
+// ***********************************************************************
+// The log file is pre-allocated as one contiguous extent, so its sectors can be written
+// with a raw multi-block write and the FAT never has to be read or updated while logging.
+// The card is only handed a buffer when it is not busy, so the main loop never waits on
+// flash programming and keeps reading the load cell instead.
+
+// Wait for the card to finish programming, still taking samples meanwhile
+void waitCardReady() {
+  while (SD.card()->isBusy()) {
+    acquireSamples();
+  }
+}
+
+// Pre-allocate and erase the extent for the open logfile and start streaming to it.
+// If the card has no free run that long, settle for the longest power of two fraction
+// of it that fits; the log rolls over to a new file when it fills.
+bool writerBegin(uint32_t bytes) {
+  while (!logfile.preAllocate(bytes)) {
+    bytes /= 2;
+    if (bytes < ((uint32_t)LOG_MIN_EXTENT_MB << 20)) return false;
+  }
+  if (!logfile.contiguousRange(&log_first_sector, &log_last_sector)) return false;
+  // Erased sectors read back as all 0 or all 1, never as left over log data
+  if (!SD.card()->erase(log_first_sector, log_last_sector)) return false;
+  sd_sector = log_first_sector;
+  sd_fill = 0;
+  sd_fill_count = 0;
+  sd_pending = false;
+  writerResume();
+  return sd_streaming;
+}
+
+// Write the pending buffer if the card is ready for it
+void writerService() {
+  if (!sd_pending || !sd_streaming || SD.card()->isBusy()) return;
+  uint32_t queued_us = micros() - sd_pending_since;
+  if (queued_us > sd_queue_max_us) sd_queue_max_us = queued_us;
+  writerWriteSector(sd_buffers[sd_fill ^ 1]);
+  sd_pending = false;
+}
+
+// Send one sector to the open multi-block write and time it
+void writerWriteSector(const uint8_t *sector) {
+  if (sd_sector > log_last_sector) {
+    sd_lost_bytes += LOG_SECTOR_SIZE;
+    return;
+  }
+  uint32_t start_us = micros();
+  SD.card()->writeData(sector);
+  uint32_t write_us = micros() - start_us;
+  if (write_us > sd_write_max_us) sd_write_max_us = write_us;
+  sd_sector++;
+}
+
+// Copy bytes into the fill buffer, queueing it for the card each time it fills.
+// Only waits on the card if both buffers are full.
+size_t writerAppend(const uint8_t *data, size_t size) {
+  size_t remaining = size;
+  while (remaining > 0) {
+    uint16_t chunk = LOG_SECTOR_SIZE - sd_fill_count;
+    if (chunk > remaining) chunk = remaining;
+    memcpy(&sd_buffers[sd_fill][sd_fill_count], data, chunk);
+    sd_fill_count += chunk;
+    data += chunk;
+    remaining -= chunk;
+    if (sd_fill_count < LOG_SECTOR_SIZE) break;
+    // Fill buffer is full, swap it with the pending one
+    if (sd_pending) {
+      sd_overruns++;
+      if (!sd_streaming) {
+        // Paused with nowhere to put it, drop the full buffer
+        sd_lost_bytes += LOG_SECTOR_SIZE;
+        sd_fill_count = 0;
+        continue;
+      }
+      while (sd_pending) {
+        acquireSamples();
+        writerService();
+      }
+    }
+    sd_pending = true;
+    sd_pending_since = micros();
+    sd_fill ^= 1;
+    sd_fill_count = 0;
+    writerService();
+  }
+  return size;
+}
+
+// Get everything logged so far onto the card. tail is a partly built sector to write
+// after the queued data, or NULL to use the partly filled buffer. The tail goes in the
+// journal, or with in_place or no journal, into the log without advancing so it is
+// overwritten once it is complete.
+void writerSync(const uint8_t *tail, bool in_place) {
+  if (!sd_streaming) return;
+  uint32_t start_us = micros();
+  while (sd_pending) {
+    acquireSamples();
+    writerService();
+  }
+  uint16_t tail_bytes = LOG_SECTOR_SIZE;
+  if (tail == NULL && sd_fill_count > 0) {
+    memset(&sd_buffers[sd_fill][sd_fill_count], 0, LOG_SECTOR_SIZE - sd_fill_count);
+    tail = sd_buffers[sd_fill];
+    tail_bytes = sd_fill_count;
+  }
+  if (tail != NULL && sd_sector <= log_last_sector) {
+    in_place = in_place || journal_sector == 0;
+    waitCardReady();
+    if (in_place) {
+      writerWriteSector(tail);
+      sd_sector--;
+    }
+    // End the multi-block write so the card commits what it has, then restart it on
+    // the same sector
+    writerPause();
+    if (!in_place) journalWrite(tail, tail_bytes);
+    writerResume();
+  }
+  uint32_t sync_us = micros() - start_us;
+  if (sync_us > sd_sync_max_us) sd_sync_max_us = sync_us;
+  stage_timers[LOG_STAGE_SYNC].add(sync_us);
+}
+
+// Close the multi-block write so other files on the card can be accessed
+void writerPause() {
+  if (!sd_streaming) return;
+  while (sd_pending) {
+    acquireSamples();
+    writerService();
+  }
+  waitCardReady();
+  SD.card()->writeStop();
+  sd_streaming = false;
+}
+
+// Reopen the multi-block write where it left off
+void writerResume() {
+  if (!logging || sd_streaming || sd_sector > log_last_sector) return;
+  waitCardReady();
+  sd_streaming = SD.card()->writeStart(sd_sector);
+}
+
+// ***********************************************************************
+// * LOG FILE FUNCTIONS
+// ***********************************************************************
+
+// Estimate the bytes logged over deploy_hours at the current interval and format,
+// plus 10% for slack
+uint32_t logExtentBytes() {
+  float records_per_second = 1000.0 / (log_interval > 0 ? log_interval : CONVERSION_PERIOD_MS * (1 << filter_shift));
+  float record_bytes = log_record == LOG_RECORD_SUMMARY ? CSV_SUMMARY_BYTES : CSV_RECORD_BYTES;
+  if (log_format != LOG_FORMAT_CSV) {
+    record_bytes = (float)LOG_SECTOR_SIZE /
+                   (log_record == LOG_RECORD_SUMMARY ? LOG_SUMMARIES_PER_BLOCK : LOG_RECORDS_PER_BLOCK);
+  }
+  if (log_format == LOG_FORMAT_PACKED && log_record == LOG_RECORD_SAMPLE) record_bytes = PACKED_RECORD_BYTES;
+  float bytes = records_per_second * record_bytes * 3600.0 * deploy_hours * 1.1;
+  if (bytes < ((uint32_t)LOG_MIN_EXTENT_MB << 20)) return (uint32_t)LOG_MIN_EXTENT_MB << 20;
+  if (bytes > ((uint32_t)LOG_MAX_EXTENT_MB << 20)) return (uint32_t)LOG_MAX_EXTENT_MB << 20;
+  return (uint32_t)bytes;
+}
+
+// First log name of the day of date, e.g. 26092100.BIN, into a 13 char name
+void dayLogName(char *name, const DateTime &date) {
+  uint8_t fields[3] = {(uint8_t)(date.year() % 100), date.month(), date.day()};
+  for (uint8_t i = 0; i < 3; i++) {
+    name[2 * i] = fields[i] / 10 % 10 + '0';
+    name[2 * i + 1] = fields[i] % 10 + '0';
+  }
+  strcpy(name + 6, log_format == LOG_FORMAT_CSV ? "00.CSV" : "00.BIN");
+}
+
+// Create new file based on current date and increment - 19122000.csv, 19122001.csv, 19122100.csv, etc
+// Binary logs get a .BIN extension instead. The file is pre-allocated and its header written.
+// Numbering starts from log_file_index, which scanFileIndexes() finds at boot, so usually
+// the first name tried is free.
+bool openLog() {
+  now = rtc.now();
+  // Numbers start again each day
+  if (now.day() != log_file_day) {
+    log_file_index = 0;
+    log_file_day = now.day();
+  }
+  dayLogName(filename, now);
+  for (; log_file_index < 100 && !logfile; log_file_index++) {
+    filename[6] = log_file_index / 10 + '0';
+    filename[7] = log_file_index % 10 + '0';
+    // Only open a new file if it doesn't exist
+    if (!SD.exists(filename)) {
+      logfile = SD.open(filename, FILE_WRITE);
+    }
+  }
+  if (!logfile) return false;
+
+  // Note the open log so it can be trimmed after a power loss, and where its journal
+  // records start
+  File marker = SD.open(OPEN_LOG_FILE, O_WRONLY | O_CREAT | O_TRUNC);
+  if (marker) {
+    marker.println(filename);
+    marker.println(journal_seq);
+    marker.close();
+  }
+
+  // Give the log one contiguous, erased extent and stream to it sector by sector
+  logging = true;
+  if (!writerBegin(logExtentBytes())) {
+    logging = false;
+    logfile.close();
+    return false;
+  }
+
+  // Write the file header 
+  if (log_format != LOG_FORMAT_CSV) {
+    writeLogHeader();
+  } else {
+    logstream.println(log_record == LOG_RECORD_SUMMARY ? CSV_SUMMARY_HEADER : CSV_SAMPLE_HEADER);
+  }
+  return true;
+}
+
+// Flush the log and trim the pre-allocated extent to the data actually written
+void closeLog() {
+  if (!logging) return;
+  if (summary.count > 0) logSummary();
+  logStats();
+  uint32_t tail_bytes = sd_fill_count;
+  const uint8_t *tail = NULL;
+  if (log_format != LOG_FORMAT_CSV && log_block.header.count > 0) {
+    tail = (const uint8_t *)&log_block;
+    tail_bytes = LOG_SECTOR_SIZE;
+  }
+  writerSync(tail, true);
+  rainflowSave();
+  writerPause();
+  logging = false;
+  logfile.truncate((uint64_t)(sd_sector - log_first_sector) * LOG_SECTOR_SIZE + tail_bytes);
+  logfile.close();
+  SD.remove(OPEN_LOG_FILE);
+}
+
+// Start counting cycles, and create the .RFC file for the counts alongside the first log.
+// Its sectors are erased so no record from an earlier file can be taken for this one.
+// Bins are set from trip_value now and kept until power off.
+void rainflowBegin() {
+  rainflow.begin(trip_centi / RAINFLOW_RANGE_BINS, trip_centi / RAINFLOW_MEAN_BINS);
+  rainflow_start_unix = rtc.now().unixtime();
+  strcpy(rainflow_name, filename);
+  strcpy(strchr(rainflow_name, '.'), ".RFC");
+  writerPause();
+  File file = SD.open(rainflow_name, O_RDWR | O_CREAT);
+  uint32_t last_sector;
+  if (!file || !file.preAllocate(RAINFLOW_SLOTS * LOG_SECTOR_SIZE) ||
+      !file.contiguousRange(&rainflow_sector, &last_sector) || !SD.card()->erase(rainflow_sector, last_sector)) {
+    rainflow_sector = 0;
+  }
+  if (file) file.close();
+  writerResume();
+}
+
+// Write the cycle counts so far to the next slot of the .RFC file
+void rainflowSave() {
+  if (rainflow_sector == 0) return;
+  RainflowRecord record;
+  memset(&record, 0, sizeof(record));
+  record.magic = RAINFLOW_MAGIC;
+  record.version = RAINFLOW_VERSION;
+  record.size = sizeof(record);
+  record.seq = rainflow_seq;
+  record.start_unix = rainflow_start_unix;
+  record.uptime_ms = millis();
+  record.range_bin = rainflow.range_bin;
+  record.mean_bin = rainflow.mean_bin;
+  record.gate = rainflow.gate;
+  record.max_load = rainflow.max_load;
+  record.samples = rainflow.samples;
+  record.cycles = rainflow.cycles;
+  record.residue = rainflow.snapshot(record.half_cycles);
+  record.crc = crc32(&record, offsetof(RainflowRecord, crc));
+  writerPause();
+  // The buffer not being filled is free once the writer has drained
+  uint8_t *sector = sd_buffers[sd_fill ^ 1];
+  memset(sector, 0, LOG_SECTOR_SIZE);
+  memcpy(sector, &record, sizeof(record));
+  waitCardReady();
+  if (SD.card()->writeSector(rainflow_sector + rainflow_seq % RAINFLOW_SLOTS, sector)) rainflow_seq++;
+  writerResume();
+}
+
+// Close a full log and carry on in the next file
+void rolloverLog() {
+  closeLog();
+  if (!openLog()) {
+    error(F("logfile"));
+  }
+  if (menuIdle()) {
+    Serial.print(F("Log extent full, continuing in "));
+    Serial.println(filename);
+  }
+}
+
+// True if a log sector holds data. Every sector is erased when the extent is
+// allocated, and neither CSV text nor a binary block starts with 0x00 or 0xFF.
+bool logSectorWritten(File &file, uint32_t sector, uint8_t *buffer) {
+  if (!file.seekSet((uint64_t)sector * LOG_SECTOR_SIZE)) return false;
+  if (file.read(buffer, LOG_SECTOR_SIZE) != LOG_SECTOR_SIZE) return false;
+  return buffer[0] != 0x00 && buffer[0] != 0xFF;
+}
+
+// Length of the data in a log that was never closed. Sectors are written strictly in
+// order into the erased extent, so the written ones are a prefix that can be binary
+// searched instead of read end to end.
+uint32_t findLogEnd(File &file, bool text) {
+  uint8_t *buffer = sd_buffers[0]; // Not in use before logging starts
+  uint32_t low = 0;
+  uint32_t high = file.fileSize() / LOG_SECTOR_SIZE;
+  while (low < high) {
+    uint32_t mid = low + (high - low) / 2;
+    if (logSectorWritten(file, mid, buffer)) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if (!text || low == 0) return low * LOG_SECTOR_SIZE;
+  // CSV ends partway through its last sector, the rest is padding
+  logSectorWritten(file, low - 1, buffer);
+  uint16_t used = LOG_SECTOR_SIZE;
+  while (used > 0 && (buffer[used - 1] == 0x00 || buffer[used - 1] == 0xFF)) used--;
+  return (low - 1) * LOG_SECTOR_SIZE + used;
+}
+
+// Length of a CSV log cut back to the end of its last whole line. Sectors are written
+// as they fill, so past the last sync the data may stop partway through a line.
+uint32_t lastLineEnd(File &file, uint32_t end) {
+  uint8_t *buffer = sd_buffers[0]; // Not in use before logging starts
+  while (end > 0) {
+    uint32_t start = (end - 1) / LOG_SECTOR_SIZE * LOG_SECTOR_SIZE;
+    int size = end - start;
+    if (!file.seekSet(start) || file.read(buffer, size) != size) return end;
+    while (size > 0 && buffer[size - 1] != '\n') size--;
+    if (size > 0) return start + size;
+    end = start;
+  }
+  return 0;
+}
+
+// Find the journal sectors, allocating JOURNAL_FILE the first time, and the newest
+// intact record in it, which the next record follows
+bool journalBegin() {
+  File file = SD.open(JOURNAL_FILE, O_RDWR | O_CREAT);
+  if (!file) return false;
+  uint32_t size = (uint32_t)JOURNAL_RECORDS * JOURNAL_RECORD_SECTORS * LOG_SECTOR_SIZE;
+  uint32_t last_sector;
+  bool ok = (file.fileSize() >= size || (file.truncate(0) && file.preAllocate(size))) &&
+            file.contiguousRange(&journal_sector, &last_sector);
+  file.close();
+  if (!ok) {
+    journal_sector = 0;
+    return false;
+  }
+  uint8_t *sector = sd_buffers[0]; // Not in use before logging starts
+  JournalRecord record;
+  for (uint8_t slot = 0; slot < JOURNAL_RECORDS; slot++) {
+    if (!SD.card()->readSector(journal_sector + slot * JOURNAL_RECORD_SECTORS, sector)) continue;
+    memcpy(&record, sector, sizeof(record));
+    if (record.magic != JOURNAL_MAGIC || crc32(&record, offsetof(JournalRecord, crc)) != record.crc) continue;
+    // The higher sequence number, allowing for it wrapping
+    if (journal_newest >= 0 && (int32_t)(record.seq - (journal_seq - 1)) <= 0) continue;
+    journal_newest = slot;
+    journal_seq = record.seq + 1;
+  }
+  journal_next = journal_newest >= 0 ? (journal_newest + 1) % JOURNAL_RECORDS : 0;
+  return true;
+}
+
+// Append the log's partly filled sector to the journal. The copy goes first and the
+// record that vouches for it after, each a single sector write.
+bool journalWrite(const uint8_t *tail, uint16_t bytes) {
+  JournalRecord record;
+  memset(&record, 0, sizeof(record));
+  record.magic = JOURNAL_MAGIC;
+  record.seq = journal_seq;
+  record.log_sector = log_first_sector;
+  record.sector = sd_sector - log_first_sector;
+  record.bytes = bytes;
+  strncpy(record.name, filename, sizeof(record.name));
+  record.data_crc = crc32(tail, LOG_SECTOR_SIZE);
+  record.crc = crc32(&record, offsetof(JournalRecord, crc));
+  // The buffer not being filled is free once the writer has drained
+  uint8_t *sector = sd_buffers[sd_fill ^ 1];
+  memset(sector, 0, LOG_SECTOR_SIZE);
+  memcpy(sector, &record, sizeof(record));
+  uint32_t first = journal_sector + journal_next * JOURNAL_RECORD_SECTORS;
+  if (!SD.card()->writeSector(first + 1, tail)) return false;
+  waitCardReady();
+  if (!SD.card()->writeSector(first, sector)) return false;
+  journal_seq++;
+  journal_next = (journal_next + 1) % JOURNAL_RECORDS;
+  return true;
+}
+
+// Put the log's last synced sector back from the newest journal record, if that is one
+// written since the log was opened and for the sector at end. Advances end past it.
+bool journalRestore(File &file, const char *name, uint32_t open_seq, uint32_t *end) {
+  if (journal_newest < 0 || *end % LOG_SECTOR_SIZE != 0) return false;
+  uint32_t log_sector, last_sector;
+  if (!file.contiguousRange(&log_sector, &last_sector)) return false;
+  uint8_t *sector = sd_buffers[0]; // Not in use before logging starts
+  uint8_t *copy = sd_buffers[1];
+  uint32_t first = journal_sector + journal_newest * JOURNAL_RECORD_SECTORS;
+  JournalRecord record;
+  if (!SD.card()->readSector(first, sector) || !SD.card()->readSector(first + 1, copy)) return false;
+  memcpy(&record, sector, sizeof(record));
+  if ((int32_t)(record.seq - open_seq) < 0 || record.log_sector != log_sector ||
+      strncmp(record.name, name, sizeof(record.name)) != 0 || record.sector != *end / LOG_SECTOR_SIZE ||
+      record.bytes > LOG_SECTOR_SIZE || crc32(copy, LOG_SECTOR_SIZE) != record.data_crc) {
+    return false;
+  }
+  if (!file.seekSet(*end) || file.write(copy, record.bytes) != record.bytes) return false;
+  *end += record.bytes;
+  return true;
+}
+
+// Trim the log named in OPEN_LOG_FILE, left at its full pre-allocated size by a power
+// loss, and restore its last synced sector from the journal
+void recoverLog() {
+  File marker = SD.open(OPEN_LOG_FILE);
+  if (!marker) return;
+  char name[13];
+  byte index = 0;
+  while (marker.available() && index < sizeof(name) - 1) {
+    char c = marker.read();
+    if (c == '\n' || c == '\r') break;
+    name[index++] = c;
+  }
+  name[index] = '\0';
+  // Journal sequence number when the log was opened, on the next line
+  uint32_t open_seq = 0;
+  bool have_seq = false;
+  while (marker.available()) {
+    char c = marker.read();
+    if (c >= '0' && c <= '9') {
+      open_seq = open_seq * 10 + (c - '0');
+      have_seq = true;
+    } else if (have_seq) {
+      break;
+    }
+  }
+  marker.close();
+  File file = SD.open(name, O_RDWR);
+  if (file) {
+    bool text = strstr(name, ".CSV") != NULL;
+    uint32_t end = findLogEnd(file, text);
+    bool restored = have_seq && journalRestore(file, name, open_seq, &end);
+    if (text) end = lastLineEnd(file, end);
+    file.truncate(end);
+    file.close();
+    Serial.print(F("Recovered "));
+    Serial.print(name);
+    Serial.print(F(": "));
+    Serial.print(end);
+    Serial.println(restored ? F(" bytes, last sector from the journal") : F(" bytes"));
+  }
+  SD.remove(OPEN_LOG_FILE);
+}
+
+// Find the next free log number for today and event file number in one pass over the
+// root directory, instead of an SD.exists() search through every name in use, each of
+// which reads the whole directory. Numbers after the highest in use are taken.
+void scanFileIndexes() {
+  now = rtc.now();
+  log_file_day = now.day();
+  log_file_index = 0;
+  event_file_index = 0;
+  // Today's first log name, to compare against
+  char today[13];
+  dayLogName(today, now);
+  File root = SD.open("/");
+  while (true) {
+    File entry = root.openNextFile();
+    if (!entry) break;
+    char name[13];
+    entry.getName(name, sizeof(name));
+    entry.close();
+    if (strlen(name) != 12 || !isdigit(name[6]) || !isdigit(name[7])) continue;
+    if (strncasecmp(name, "EVENT", 5) == 0 && strcasecmp(name + 8, ".EVT") == 0 && isdigit(name[5])) {
+      uint16_t number = atoi(name + 5);
+      if (number >= event_file_index) event_file_index = number + 1;
+    } else if (strncmp(name, today, 6) == 0 && strcasecmp(name + 8, today + 8) == 0) {
+      uint8_t number = (name[6] - '0') * 10 + name[7] - '0';
+      if (number >= log_file_index) log_file_index = number + 1;
+    }
+  }
+  root.close();
+}
+
 // ***********************************************************************
 // * LOGGER/LOAD CELL FUNCTIONS
 // ***********************************************************************
@@ -487,6 +2351,7 @@ void setRGB(int rgb_values[], int sizeOfArray) {
   analogWrite(STATUS_BLUE, blue_light_value);
   // Save RGB state
   rgb_state[0] = red_light_value; rgb_state[1] = green_light_value; rgb_state[2] = blue_light_value;
+  if (!menuIdle()) return;
   Serial.print(F("RGB changed to: "));
   Serial.print(rgb_color_string(rgb_state, 3));
   Serial.print(" ");
@@ -520,91 +2385,75 @@ const char* rgb_color_string(int rgb_values[], int sizeOfArray) {
   }
 }
 
-// Gives user the ability to set a known weight on the scale and calculate a calibration factor
+// Power up the NAU7802 as load_cell.begin() does, but straight at gain_setting and
+// LC_SAMPLE_RATE and without its AFE calibration, which would have to be repeated once
+// those were set. loadCellCalibrate() does that once the LDO has settled.
+bool loadCellBegin() {
+  if (load_cell.begin(Wire, false) == false) return false;
+  bool ok = load_cell.reset();
+  ok &= load_cell.powerUp();
+  ok &= load_cell.setLDO(NAU7802_LDO_3V3);
+  lc_power_ms = millis();
+  ok &= load_cell.setGain(gain_setting);
+  ok &= load_cell.setSampleRate(LC_SAMPLE_RATE);
+  // Turn off CLK_CHP, enable the channel 2 decoupling cap and clear LDOMODE, as begin() does
+  ok &= load_cell.setRegister(NAU7802_ADC, load_cell.getRegister(NAU7802_ADC) | 0x30);
+  ok &= load_cell.setBit(NAU7802_PGA_PWR_PGA_CAP_EN, NAU7802_PGA_PWR);
+  ok &= load_cell.clearBit(NAU7802_PGA_LDOMODE, NAU7802_PGA);
+  return ok;
+}
+
+// Calibrate the analog front end, once the LDO has had LC_LDO_SETTLE_MS. setup() has
+// usually spent that long on other things by now.
+bool loadCellCalibrate() {
+  while ((millis() - lc_power_ms) < LC_LDO_SETTLE_MS);
+  return load_cell.calibrateAFE();
+}
+
+// Gives user the ability to set a known weight on the scale and calculate a calibration factor.
+// The steps are run by menuReply() and menuWork().
 void calibrateScale(void) {
   Serial.println();
   Serial.println();
   Serial.println(F("LC calibration"));
-  Serial.print(F("Are you sure you want to calibrate? Enter y to continue, any other key to abort: "));
-  readSerial();
-  if ((serial_data[0] == 'y') || (serial_data[0] == 'Y')) { 
-    Serial.println(F("Setup load cell with no weight on it. Press a key when ready."));
-    clearSerialWait();
-    load_cell.calculateZeroOffset(64); // Zero or Tare the load cell. Average over 64 readings.
-    Serial.print(F("New zero offset: "));
-    Serial.println(load_cell.getZeroOffset());
-    // Commit zero offset to global variable
-    zero_offset = load_cell.getZeroOffset();
-    Serial.println(F("Place known weight on LC. Press a key."));
-    clearSerialWait();
-    Serial.print(F("Enter weight on the LC: "));
-    clearSerialWait();
-    // Read user input
-    float weightOnScale = Serial.parseFloat();
-    // confirm user input
-    Serial.println();
-    Serial.print(F("Calibration weight entered: "));
-    Serial.println(weightOnScale);
-    // Tell the library how much weight is currently on it
-    load_cell.calculateCalibrationFactor(weightOnScale, 64); 
-    Serial.println();
-    Serial.print(F("New cal factor: "));
-    Serial.println(load_cell.getCalibrationFactor(), 2);
-    // Commit cal factor to global variable
-    cal_factor = load_cell.getCalibrationFactor();
-    //Serial.print(F("New Scale Reading: "));
-    //Serial.println(load_cell.getWeight(), 2);
-    Serial.println();
-    // Commit global values to SD config.txt
-    saveSystemSettings();
-  } else {
-    Serial.println(F("Calibration aborted"));
-  }
-  getCalibration();
+  menuPrompt(MENU_CAL_CONFIRM, F("Are you sure you want to calibrate? Enter y to continue, any other key to abort: "));
 } // End calibrateScale
 
-// Reads the current system settings from the SD card
-// If anything looks weird, reset setting to default value
-// config.txt is key value declarations of variable values
+// Reads the current system settings: the saved record in SETTINGS_FILE, then config.txt
+// if it has been edited since the logger last read or wrote it, or if there is no
+// record yet. config.txt is read in one go and parsed line by line; settings it doesn't
+// mention keep their values. If there is no config.txt, one is written.
 void readSystemSettings(void) {
-  File configFile;
-  if (SD.exists("config.txt")) {
-    configFile = SD.open("config.txt");
-    if (configFile) {
-      char buffer[40];
-      byte index = 0;
-      while (configFile.available()) {
-       char c = configFile.read();
-       if(c == '\n' || c == '\r') { // Test for <cr> and <lf>
-           parseSavedVar(buffer);
-           index = 0;
-           buffer[index] = '\0'; // Keep buffer NULL terminated
-       }
-       else {
-           buffer[index++] = c;
-           buffer[index] = '\0'; // Keep buffer NULL terminated
-       }
+  bool saved = settingsBegin() && loadSettings();
+  File configFile = SD.open("config.txt");
+  if (configFile) {
+    // The log's sector buffers are free until logging starts
+    char *buffer = (char *)sd_buffers;
+    int size = configFile.read(buffer, sizeof(sd_buffers) - 1);
+    configFile.close();
+    if (size < 0) size = 0;
+    uint32_t crc = crc32(buffer, size);
+    if (!saved || crc != config_crc) {
+      buffer[size] = '\0';
+      char *line = buffer;
+      while (*line) {
+        char *end = line + strcspn(line, "\r\n"); // Test for <cr> and <lf>
+        char next = *end;
+        *end = '\0';
+        parseSavedVar(line);
+        line = next ? end + 1 : end;
       }
+      checkSettings();
+      config_crc = crc;
+      if (saved) Serial.println(F("Settings imported from config.txt"));
+      saveSystemSettings();
     }
-    configFile.close();
-    // Set load cell to saved calibration values
-    load_cell.setCalibrationFactor(cal_factor);
-    load_cell.setZeroOffset(zero_offset);
   } else {
-    // config.txt does not exist, create a new one with default values
-    configFile = SD.open("config.txt", FILE_WRITE);
-    if (configFile) {
-      configFile.print("echo = "); configFile.println(DEFAULT_ECHO);
-      configFile.print("log_interval = "); configFile.println(DEFAULT_LOG_INTERVAL);
-      configFile.print("sync_interval = "); configFile.println(DEFAULT_SYNC_INTERVAL);
-      configFile.print("cal_factor = "); configFile.println(DEFAULT_CAL_FACTOR);
-      configFile.print("zero_offset = "); configFile.println(DEFAULT_ZERO_OFFSET);
-      configFile.print("trip_value = "); configFile.println(DEFAULT_TRIP_VALUE);
-    }
-    configFile.close();
-    // Re-read system settings
-    readSystemSettings();
+    exportSettings();
   }
+  // Set load cell to saved calibration values
+  load_cell.setCalibrationFactor(cal_factor);
+  load_cell.setZeroOffset(zero_offset);
   // Assume for the moment that there are good cal values
   settingsDetected = true; 
   if (cal_factor == DEFAULT_CAL_FACTOR || zero_offset == DEFAULT_ZERO_OFFSET) {
@@ -612,6 +2461,104 @@ void readSystemSettings(void) {
   }
 } // End readSystemSettings
 
+// Find the settings sectors, allocating SETTINGS_FILE the first time
+bool settingsBegin() {
+  File file = SD.open(SETTINGS_FILE, O_RDWR | O_CREAT);
+  if (!file) return false;
+  uint32_t last_sector;
+  bool ok;
+  if (file.fileSize() >= SETTINGS_SLOTS * LOG_SECTOR_SIZE) {
+    ok = file.contiguousRange(&settings_sector, &last_sector);
+  } else {
+    // New, or too short for every slot: allocate it again, keeping what was in slot 0
+    uint8_t *old = sd_buffers[1]; // Not in use before logging starts
+    memset(old, 0, LOG_SECTOR_SIZE);
+    file.read(old, LOG_SECTOR_SIZE);
+    ok = file.truncate(0) && file.preAllocate(SETTINGS_SLOTS * LOG_SECTOR_SIZE) &&
+         file.contiguousRange(&settings_sector, &last_sector) && SD.card()->writeSector(settings_sector, old);
+  }
+  file.close();
+  if (!ok) settings_sector = 0;
+  return ok;
+}
+
+// Read the record in one slot, false unless it is intact
+bool readSettingsSlot(uint8_t slot, SettingsRecord *record) {
+  uint8_t *sector = sd_buffers[0]; // Not in use before logging starts
+  if (!SD.card()->readSector(settings_sector + slot, sector)) return false;
+  memcpy(record, sector, sizeof(*record));
+  return record->magic == SETTINGS_MAGIC && record->version == SETTINGS_VERSION &&
+         record->size == sizeof(*record) && crc32(record, offsetof(SettingsRecord, crc)) == record->crc;
+}
+
+// Apply the latest intact settings record. A save cut short by a power loss leaves the
+// slot it was writing bad, and the record before it in the other slot is used.
+bool loadSettings() {
+  SettingsRecord record = {}, other;
+  bool found = false;
+  for (uint8_t slot = 0; slot < SETTINGS_SLOTS; slot++) {
+    if (!readSettingsSlot(slot, &other)) continue;
+    // The higher sequence number, allowing for it wrapping
+    if (found && (int32_t)(other.seq - record.seq) <= 0) continue;
+    record = other;
+    settings_slot = slot;
+    found = true;
+  }
+  if (!found) return false;
+  settings_seq = record.seq;
+  config_crc = record.config_crc;
+  cal_factor = record.cal_factor;
+  zero_offset = record.zero_offset;
+  log_interval = record.log_interval;
+  sync_interval = record.sync_interval;
+  trip_value = record.trip_value;
+  deploy_hours = record.deploy_hours;
+  trigger_rate = record.trigger_rate;
+  trigger_percent = record.trigger_percent;
+  echo = record.echo;
+  log_format = record.log_format;
+  log_record = record.log_record;
+  adaptive = record.adaptive;
+  filter_median = record.filter_median;
+  filter_lowpass = record.filter_lowpass;
+  filter_decimate = record.filter_decimate;
+  checkSettings();
+  return true;
+}
+
+// Put back to its default any setting the log, filter and trigger code can't take, as a
+// record from other firmware or an edited config.txt may hold anything. Returns true if
+// any was.
+bool checkSettings() {
+  bool changed = false;
+  changed |= checkSetting(log_interval, 0, INT32_MAX, DEFAULT_LOG_INTERVAL, F("log_interval"));
+  changed |= checkSetting(sync_interval, 1, INT32_MAX, DEFAULT_SYNC_INTERVAL, F("sync_interval"));
+  changed |= checkSetting(log_format, LOG_FORMAT_CSV, LOG_FORMAT_PACKED, DEFAULT_LOG_FORMAT, F("log_format"));
+  changed |= checkSetting(log_record, LOG_RECORD_SAMPLE, LOG_RECORD_SUMMARY, DEFAULT_LOG_RECORD, F("log_record"));
+  changed |= checkSetting(filter_median, 0, 5, DEFAULT_FILTER_MEDIAN, F("filter_median"));
+  changed |= checkSetting(filter_lowpass, FILTER_LOWPASS_NONE, FILTER_LOWPASS_IIR, DEFAULT_FILTER_LOWPASS,
+                          F("filter_lowpass"));
+  changed |= checkSetting(filter_decimate, 1, 32, DEFAULT_FILTER_DECIMATE, F("filter_decimate"));
+  // Past these the thresholds in load hundredths overflow, and at 0 they trip on any load
+  changed |= checkSetting(trip_value, 1, 100000, DEFAULT_TRIP_VALUE, F("trip_value"));
+  changed |= checkSetting(trigger_rate, 1, 100000, DEFAULT_TRIGGER_RATE, F("trigger_rate"));
+  changed |= checkSetting(trigger_percent, 1, 100, DEFAULT_TRIGGER_PERCENT, F("trigger_percent"));
+  changed |= checkSetting(deploy_hours, 1, MAX_DEPLOY_HOURS, DEFAULT_DEPLOY_HOURS, F("deploy_hours"));
+  return changed;
+}
+
+// Set setting to fallback if it is outside low to high, saying so
+bool checkSetting(int &setting, int low, int high, int fallback, const __FlashStringHelper *name) {
+  if (setting >= low && setting <= high) return false;
+  Serial.print(name);
+  Serial.print(F(" = "));
+  Serial.print(setting);
+  Serial.print(F(" is not valid, using "));
+  Serial.println(fallback);
+  setting = fallback;
+  return true;
+}
+
 // Parse a line from config.txt to the appropriate variable, see https://forum.arduino.cc/index.php?topic=210904.0
 void parseSavedVar(char *buff) {
    char *name = strtok(buff, " =");
@@ -630,41 +2577,133 @@ void parseSavedVar(char *buff) {
                if(strcmp(name, "sync_interval") == 0) {
                    sync_interval = val;
                }
+               if(strcmp(name, "log_format") == 0) {
+                   log_format = val;
+               }
+               if(strcmp(name, "log_record") == 0) {
+                   log_record = val;
+               }
+               if(strcmp(name, "filter_median") == 0) {
+                   filter_median = val;
+               }
+               if(strcmp(name, "filter_lowpass") == 0) {
+                   filter_lowpass = val;
+               }
+               if(strcmp(name, "filter_decimate") == 0) {
+                   filter_decimate = val;
+               }
+               if(strcmp(name, "deploy_hours") == 0) {
+                   deploy_hours = val;
+               }
+               if(strcmp(name, "adaptive") == 0) {
+                   adaptive = val;
+               }
+               if(strcmp(name, "trigger_rate") == 0) {
+                   trigger_rate = val;
+               }
+               if(strcmp(name, "trigger_percent") == 0) {
+                   trigger_percent = val;
+               }
+               // The calibration keeps its decimals
                if(strcmp(name, "cal_factor") == 0) {
-                   cal_factor = val;
+                   cal_factor = atof(valu);
                }
                if(strcmp(name, "trip_value") == 0) {
                    trip_value = val;
                }
                else if(strcmp(name, "zero_offset") == 0) {
-                   zero_offset = val;
+                   zero_offset = atof(valu);
                }
            }
         }
      }
 }
 
-// Save the current configuration to file, when settings change
+// Save the current settings, when they change. One sector written in place, with no
+// file system update, to the slot not holding the latest record, so the settings
+// already saved are never overwritten by a write that may not complete.
 void saveSystemSettings(void) {
-  File configFile;
-  // Remove existing config file
-  if (SD.exists("config.txt")) {
-    SD.remove("config.txt");
+  if (settings_sector == 0) return;
+  SettingsRecord record;
+  memset(&record, 0, sizeof(record));
+  record.magic = SETTINGS_MAGIC;
+  record.version = SETTINGS_VERSION;
+  record.size = sizeof(record);
+  record.seq = ++settings_seq;
+  record.config_crc = config_crc;
+  record.cal_factor = cal_factor;
+  record.zero_offset = zero_offset;
+  record.log_interval = log_interval;
+  record.sync_interval = sync_interval;
+  record.trip_value = trip_value;
+  record.deploy_hours = deploy_hours;
+  record.trigger_rate = trigger_rate;
+  record.trigger_percent = trigger_percent;
+  record.echo = echo;
+  record.log_format = log_format;
+  record.log_record = log_record;
+  record.adaptive = adaptive;
+  record.filter_median = filter_median;
+  record.filter_lowpass = filter_lowpass;
+  record.filter_decimate = filter_decimate;
+  record.crc = crc32(&record, offsetof(SettingsRecord, crc));
+  uint8_t sector[LOG_SECTOR_SIZE];
+  memset(sector, 0, sizeof(sector));
+  memcpy(sector, &record, sizeof(record));
+  // The log's multi-block write has to be closed while another sector is written
+  writerPause();
+  waitCardReady();
+  uint8_t slot = settings_slot ^ 1;
+  if (SD.card()->writeSector(settings_sector + slot, sector)) {
+    settings_slot = slot;
+  } else {
+    Serial.println(F("Settings could not be saved."));
   }
-  // Recreate file and write variable values
-  configFile = SD.open("config.txt", FILE_WRITE);
+  writerResume();
+}
+
+// Print the settings in config.txt form, returning the CRC-32 of the text
+uint32_t printSettings(Print &out) {
+  CrcPrint text(out);
+  text.print("echo = "); text.println(echo);
+  text.print("log_interval = "); text.println(log_interval);
+  text.print("sync_interval = "); text.println(sync_interval);
+  text.print("cal_factor = "); text.println(cal_factor, 4);
+  text.print("zero_offset = "); text.println((long)zero_offset);
+  text.print("trip_value = "); text.println(trip_value);
+  text.print("log_format = "); text.println(log_format);
+  text.print("log_record = "); text.println(log_record);
+  text.print("filter_median = "); text.println(filter_median);
+  text.print("filter_lowpass = "); text.println(filter_lowpass);
+  text.print("filter_decimate = "); text.println(filter_decimate);
+  text.print("deploy_hours = "); text.println(deploy_hours);
+  text.print("adaptive = "); text.println(adaptive);
+  text.print("trigger_rate = "); text.println(trigger_rate);
+  text.print("trigger_percent = "); text.println(trigger_percent);
+  return text.crc;
+}
+
+// Write the settings out as config.txt, for reading or editing on a computer. The
+// record keeps its CRC, so the logger doesn't import the same file back. The text goes
+// to CONFIG_TEMP_FILE first, so a power loss can't leave a part written config.txt to be
+// imported at the next boot.
+bool exportSettings() {
+  writerPause();
+  SD.remove(CONFIG_TEMP_FILE);
+  File configFile = SD.open(CONFIG_TEMP_FILE, FILE_WRITE);
+  bool ok = false;
   if (configFile) {
-      configFile.print("echo = "); configFile.println(echo);
-      configFile.print("log_interval = "); configFile.println(log_interval);
-      configFile.print("sync_interval = "); configFile.println(sync_interval);
-      configFile.print("cal_factor = "); configFile.println(cal_factor);
-      configFile.print("zero_offset = "); configFile.println(zero_offset);
-      configFile.print("trip_value = "); configFile.println(trip_value);
+    uint32_t crc = printSettings(configFile);
+    configFile.close();
+    SD.remove("config.txt");
+    ok = SD.rename(CONFIG_TEMP_FILE, "config.txt");
+    if (ok) config_crc = crc;
   }
-  configFile.close();
+  writerResume();
+  saveSystemSettings();
+  return ok;
 }
 
-
 // Prints the current load cell calibration
 void getCalibration() {
   Serial.println();
@@ -675,154 +2714,392 @@ void getCalibration() {
   Serial.print(F("LC gain: "));
   Serial.println(gain_value_table[gain_setting]);
   Serial.print(F("LC trip value: "));
-  Serial.println(DEFAULT_TRIP_VALUE);
+  Serial.println(trip_value);
   Serial.println();
 }
 
-// Manually calibrate load cell with known values
+// Manually calibrate load cell with known values. menuReply() takes the values.
 void manualCalibration() {
-  delay(100);
-  float settingCalibrationFactor; // Value used to convert the load cell reading to lbs or kg
-  long settingZeroOffset; // Zero value that is found when scale is tared
   Serial.println();
-  Serial.print(F("Are you sure you want to change the calibration? Enter y to continue, any other key to abort: "));
-  readSerial();
-  if ((serial_data[0] == 'y') || (serial_data[0] == 'Y')) { 
-    Serial.println(F("Enter the 0 offset: "));
-    clearSerialWait();
-    zero_offset = Serial.parseFloat();
-    Serial.println();
-    Serial.println(F("Enter the cali factor: "));
-    clearSerialWait();
-    cal_factor = Serial.parseFloat();
-    // Save to config.txt
-    saveSystemSettings();
-    // Pass these values to the library
-    load_cell.setZeroOffset(zero_offset);
-    load_cell.setCalibrationFactor(cal_factor);
-    Serial.println(F("LC calibrated"));
-    Serial.println();
-  } else {
-    Serial.println(F("Manual calibration update aborted"));
-  }
-  getCalibration();
+  menuPrompt(MENU_MANUAL_CONFIRM, F("Are you sure you want to change the calibration? Enter y to continue, any other key to abort: "));
 }
 
-// Get the current time from the real time clock as an ISO UTC char array
+// Get the current time as an ISO UTC char array with milliseconds
 char * getUTC() {
-  // Fetch the time
-  now = rtc.now();
-  // Build ISO UTC date string
-  static char dtUTC[22];
-  sprintf(dtUTC,"%04u-%02u-%02uT%02u:%02u:%02uZ", now.year(), now.month(), now.day(), now.hour(), now.minute(), now.second());
-  return(dtUTC);
+  return utcString(monoMicros());
 }
 
-// Set the real time clock
+// Set the real time clock. menuReply() takes each field in turn.
 void setRTC() {
   Serial.println();
   Serial.println(F("--- Set RTC ---"));
   Serial.println();
   Serial.println(F("Provide a UTC datetime."));
-  delay(100); // Pause to avoid bounces
-  Serial.println(F("Enter year:"));
-  clearSerialWait();
-  uint16_t year = Serial.parseInt();
-  Serial.println(F("Enter month:"));
-  clearSerialWait();
-  uint8_t month = Serial.parseInt();
-  Serial.println(F("Enter day:"));
-  clearSerialWait();
-  uint8_t day = Serial.parseInt();
-  Serial.println(F("Enter hour (24 format):"));
-  clearSerialWait(); 
-  uint8_t hour = Serial.parseInt();
-  Serial.println(F("Enter minute:"));
-  clearSerialWait(); 
-  uint8_t min = Serial.parseInt();
-  Serial.println(F("Enter second:"));
-  clearSerialWait();
-  uint8_t sec = Serial.parseInt();
-  Serial.println(F("Press any key when ready to set time..."));
-  clearSerialWait();
-  // Build datetime
-  now = DateTime(year, month, day, hour, min, sec);
-  // Set RTC
-  rtc.adjust(now);
+  menuPrompt(MENU_RTC_YEAR, F("Enter year:"));
 } // End setRTC
 
 void setLogInterval() {
-  delay(100); // Pause to avoid bounces
-  Serial.println(F("Enter the LI in ms: "));
-  clearSerialWait();
-  // Read user input
-  log_interval = Serial.parseInt();
-  // Check that log_interval not greater than sync_interval
-  if (log_interval > sync_interval) {
-    Serial.println(F("Val is > than the sync int!"));
-    setLogInterval();
-    return;
-  }
-  // Commit values to SD config.txt
-  saveSystemSettings();
-  // Message
-  Serial.print(F("LI set at: "));
-  Serial.print(log_interval);
-  Serial.println(F(" ms."));
+  menuPrompt(MENU_LOG_INTERVAL, F("Enter the LI in ms: "));
 } // End setLogInterval
 
 void setSyncInterval() {
-  delay(100); // Pause to avoid bounces
- Serial.println(F("Enter SI in ms: "));
-  clearSerialWait();
-  // Read user input
-  sync_interval = Serial.parseInt();
-  // Check that log_interval not greater than sync_interval
-  if (log_interval > sync_interval) {
-    Serial.println(F("Val is < than LI!"));
-    setSyncInterval();
-    return;
-  }
-  // Commit these values to SD config.txt
-  saveSystemSettings();
-  // Message
-  Serial.print(F("SI set at: "));
-  Serial.print(sync_interval);
-  Serial.println(F(" ms."));
+  menuPrompt(MENU_SYNC_INTERVAL, F("Enter SI in ms: "));
 } // End setSyncInterval
 
 // ***********************************************************************
-// * SERIAL FUNCTIONS
+// * MENU FUNCTIONS
 // ***********************************************************************
+// The serial menu is a state machine moved along once per loop() pass, so conversions
+// keep being logged while someone works through it. menu_state says what the next
+// input is for: a command, the reply to a prompt, any key, or nothing while a tare,
+// calibration or file transfer runs over several passes.
+
+// Act on waiting serial input, and move along whatever the menu is doing
+void menuService() {
+  menuWork();
+  while (Serial.available() > 0) {
+    char ch = Serial.read();
+    if (menu_state == MENU_COMMAND) {
+      if (ch == '\r' || ch == '\n') continue;
+      menuCommand(ch);
+      // Clear anything else in RX buffer
+      while (Serial.available()) Serial.read();
+      return;
+    }
+    // Typed while the menu is busy, ignored
+    if (menu_state >= MENU_TARE) continue;
+    if (menu_state == MENU_RTC_CONFIRM || menu_state == MENU_CAL_EMPTY || menu_state == MENU_CAL_LOADED) {
+      while (Serial.available()) Serial.read();
+      menuReply();
+      return;
+    }
+    if (ch == '\r' || ch == '\n') {
+      if (serial_length == 0) continue;
+      menuLine();
+      return;
+    }
+    if (ch != ',' && serial_length < SERIAL_SIZE) serial_data[serial_length++] = ch;
+    serial_ms = millis();
+  }
+  // Terminals set to send no line ending: take the reply once the typing stops
+  if (serial_length > 0 && millis() - serial_ms >= MENU_LINE_GAP_MS) menuLine();
+}
 
-// Clear the serial buffer and wait for new data
-void clearSerialWait() {
-  while (Serial.available()) Serial.read(); // Clear anything in RX buffer
-  while (Serial.available() == 0) delay(10); // Wait for user to press key
+// Single character commands
+void menuCommand(char input) {
+  switch(input) {
+    // Toggle echo to serial
+    case 'e': case 'E':
+      echo = !echo;
+      Serial.println();
+      if (echo) {
+        Serial.println(F("EOS ON"));
+      } else {
+        Serial.println(F("EOS OFF"));
+      }
+      Serial.println();
+      // Save these values to the settings sector
+      saveSystemSettings();
+      break;
+    // Toggle the live binary stream, see liveSample()
+    case 'r': case 'R':
+      live = !live;
+      live_count = 0;
+      live_seq = 0;
+      Serial.println();
+      if (live) {
+        Serial.println(F("Live stream ON"));
+      } else {
+        Serial.println(F("Live stream OFF"));
+      }
+      Serial.println();
+      break;
+    // Set logging interval
+    case 'l': case 'L':
+      setLogInterval();
+      break;
+    // Set sync interval
+    case 's': case 'S':
+      setSyncInterval();
+      break;
+    // Get zulu time
+    case 'z': case 'Z':
+      Serial.println(getUTC());
+      Serial.print(F("Clock drift correction ppm: "));
+      Serial.println(clock_drift_ppm);
+      break;
+    // Set RTC
+    case 'd': case 'D':
+      setRTC();
+      break;
+    // Tare the load cell, finished by menuWork()
+    case 't': case 'T':
+      menuAverageBegin(MENU_TARE, TARE_AVERAGE);
+      break;
+    // Calibrate the scale
+    case 'c': case 'C':
+      calibrateScale();
+      break;
+    // Output calibration settings
+    case 'v': case 'V':
+      getCalibration();
+      break;
+    // Manual calibration
+    case 'm': case 'M':
+      manualCalibration();
+      break;
+    // Enter file manager
+    case 'f': case 'F':
+      fileManager();
+      break;
+    // Write the settings out as config.txt
+    case 'w': case 'W':
+      Serial.println();
+      if (exportSettings()) {
+        Serial.println(F("Settings written to config.txt"));
+      } else {
+        Serial.println(F("config.txt could not be written."));
+      }
+      Serial.println();
+      break;
+    // Close the log so it is trimmed and complete before power is switched off
+    case 'q': case 'Q':
+      closeLog();
+      Serial.println();
+      Serial.println(F("Log closed, safe to power off. Power cycle to start a new log."));
+      Serial.println();
+      break;
+    // Show loop timing and drop counters
+    case 'i': case 'I':
+      printStats();
+      break;
+    // Invalid character entered
+    default:
+      Serial.println(F("Invalid command "));
+      Serial.println(input);
+  } // End switch
+} // End menuCommand
+
+// A reply line is complete
+void menuLine() {
+  serial_data[serial_length] = 0;
+  serial_length = 0;
+  // Anything typed after the line ending is dropped, as at every prompt
+  while (Serial.available()) Serial.read();
+  menuReply();
 }
 
-// Read incoming serial data into serial_data array
-void readSerial(void) {
-  // Clear serial data array
-  memset(serial_data, 0, sizeof(serial_data));
-  int data_index = 0;
-  clearSerialWait();
-  // Once it is available
-  while (Serial.available()) {
-    char ch = Serial.read();
-    //Serial.print(ch);
-    if (data_index <= SERIAL_SIZE && ch != '\n' && ch != '\r' && ch != ',') {
-      serial_data[data_index] = ch;
-      data_index++;
-    } // End if
-    // Make sure serial buffer is not read too fast, can cause errors
-    delay(3);
-  } // End while serial available
-} // End readSerial
+// Act on the reply in serial_data to the prompt for menu_state
+void menuReply() {
+  bool yes = serial_data[0] == 'y' || serial_data[0] == 'Y';
+  switch (menu_state) {
+    case MENU_LOG_INTERVAL: {
+      long value = atol(serial_data);
+      // Check that log_interval not greater than sync_interval
+      if (value > sync_interval) {
+        Serial.println(F("Val is > than the sync int!"));
+        setLogInterval();
+        return;
+      }
+      log_interval = value;
+      // Save these values to the settings sector
+      saveSystemSettings();
+      Serial.print(F("LI set at: "));
+      Serial.print(log_interval);
+      Serial.println(F(" ms."));
+      break;
+    }
+    case MENU_SYNC_INTERVAL: {
+      long value = atol(serial_data);
+      // Check that log_interval not greater than sync_interval
+      if (log_interval > value) {
+        Serial.println(F("Val is < than LI!"));
+        setSyncInterval();
+        return;
+      }
+      sync_interval = value;
+      // Save these values to the settings sector
+      saveSystemSettings();
+      Serial.print(F("SI set at: "));
+      Serial.print(sync_interval);
+      Serial.println(F(" ms."));
+      break;
+    }
+    // Set RTC, one field at a time
+    case MENU_RTC_YEAR:
+      rtc_fields[0] = atol(serial_data);
+      menuPrompt(MENU_RTC_MONTH, F("Enter month:"));
+      return;
+    case MENU_RTC_MONTH:
+      rtc_fields[1] = atol(serial_data);
+      menuPrompt(MENU_RTC_DAY, F("Enter day:"));
+      return;
+    case MENU_RTC_DAY:
+      rtc_fields[2] = atol(serial_data);
+      menuPrompt(MENU_RTC_HOUR, F("Enter hour (24 format):"));
+      return;
+    case MENU_RTC_HOUR:
+      rtc_fields[3] = atol(serial_data);
+      menuPrompt(MENU_RTC_MINUTE, F("Enter minute:"));
+      return;
+    case MENU_RTC_MINUTE:
+      rtc_fields[4] = atol(serial_data);
+      menuPrompt(MENU_RTC_SECOND, F("Enter second:"));
+      return;
+    case MENU_RTC_SECOND:
+      rtc_fields[5] = atol(serial_data);
+      menuPrompt(MENU_RTC_CONFIRM, F("Press any key when ready to set time..."));
+      return;
+    case MENU_RTC_CONFIRM:
+      // Build datetime
+      now = DateTime(rtc_fields[0], rtc_fields[1], rtc_fields[2], rtc_fields[3], rtc_fields[4], rtc_fields[5]);
+      // Set RTC
+      rtc.adjust(now);
+      clockSet(now.unixtime(), monoMicros());
+      break;
+    // Calibrate with a known weight
+    case MENU_CAL_CONFIRM:
+      if (yes) {
+        menuPrompt(MENU_CAL_EMPTY, F("Setup load cell with no weight on it. Press a key when ready."));
+        return;
+      }
+      Serial.println(F("Calibration aborted"));
+      getCalibration();
+      break;
+    case MENU_CAL_EMPTY:
+      // Zero or tare the load cell, finished by menuWork()
+      menuAverageBegin(MENU_CAL_ZEROING, CAL_AVERAGE);
+      return;
+    case MENU_CAL_LOADED:
+      menuPrompt(MENU_CAL_WEIGHT, F("Enter weight on the LC: "));
+      return;
+    case MENU_CAL_WEIGHT:
+      cal_weight = atof(serial_data);
+      // confirm user input
+      Serial.println();
+      Serial.print(F("Calibration weight entered: "));
+      Serial.println(cal_weight);
+      menuAverageBegin(MENU_CAL_SPANNING, CAL_AVERAGE);
+      return;
+    // Manual calibration
+    case MENU_MANUAL_CONFIRM:
+      if (yes) {
+        menuPrompt(MENU_MANUAL_ZERO, F("Enter the 0 offset: "));
+        return;
+      }
+      Serial.println(F("Manual calibration update aborted"));
+      getCalibration();
+      break;
+    case MENU_MANUAL_ZERO:
+      zero_offset = atol(serial_data);
+      Serial.println();
+      menuPrompt(MENU_MANUAL_FACTOR, F("Enter the cali factor: "));
+      return;
+    case MENU_MANUAL_FACTOR:
+      cal_factor = atof(serial_data);
+      // Save these values to the settings sector
+      saveSystemSettings();
+      // Pass these values to the library
+      load_cell.setZeroOffset(zero_offset);
+      load_cell.setCalibrationFactor(cal_factor);
+      calibrationBegin();
+      logCalibrationChange();
+      Serial.println(F("LC calibrated"));
+      Serial.println();
+      getCalibration();
+      break;
+    // File manager
+    case MENU_FILE_OPTION:
+      fileOption(serial_data[0]);
+      return;
+    case MENU_FILE_NAME:
+      fileName();
+      return;
+    case MENU_FILE_OFFSET:
+      sendFile(strtoul(serial_data, NULL, 10));
+      return;
+    case MENU_FILE_CLEAR:
+      if (yes) clearCard();
+      filePrompt();
+      return;
+  } // End switch
+  menu_state = MENU_COMMAND;
+} // End menuReply
+
+// Print a prompt and wait for its reply
+void menuPrompt(byte state, const __FlashStringHelper *prompt) {
+  Serial.println(prompt);
+  menu_state = state;
+  serial_length = 0;
+}
+
+// True unless a prompt or file transfer is using the serial port. Echo and status
+// messages are held back until then.
+bool menuIdle() {
+  return menu_state == MENU_COMMAND;
+}
+
+// Average the next size conversions, then carry on in menuWork() from state
+void menuAverageBegin(byte state, uint16_t size) {
+  menu_state = state;
+  menu_average_sum = 0;
+  menu_average_count = 0;
+  menu_average_size = size;
+}
+
+// Advance a file transfer, or finish a tare or calibration once its conversions are in
+void menuWork() {
+  if (menu_state >= MENU_FILE_DUMP) {
+    fileService();
+    return;
+  }
+  if (menu_average_size == 0 || menu_average_count < menu_average_size) return;
+  // Round to nearest
+  long average = (menu_average_sum + (menu_average_sum >= 0 ? 1 : -1) * (menu_average_count / 2)) / menu_average_count;
+  menu_average_size = 0;
+  switch (menu_state) {
+    case MENU_TARE:
+      zero_offset = average;
+      load_cell.setZeroOffset(zero_offset);
+      saveSystemSettings();
+      calibrationBegin();
+      logCalibrationChange();
+      Serial.println();
+      Serial.println(F("LC zeroed."));
+      Serial.println();
+      break;
+    case MENU_CAL_ZEROING:
+      // Commit zero offset to global variable
+      zero_offset = average;
+      load_cell.setZeroOffset(zero_offset);
+      Serial.print(F("New zero offset: "));
+      Serial.println(load_cell.getZeroOffset());
+      menuPrompt(MENU_CAL_LOADED, F("Place known weight on LC. Press a key."));
+      return;
+    case MENU_CAL_SPANNING:
+      // Counts per unit of the known weight, as NAU7802::calculateCalibrationFactor()
+      cal_factor = (average - zero_offset) / cal_weight;
+      load_cell.setCalibrationFactor(cal_factor);
+      Serial.println();
+      Serial.print(F("New cal factor: "));
+      Serial.println(cal_factor, 2);
+      Serial.println();
+      // Save these values to the settings sector
+      saveSystemSettings();
+      calibrationBegin();
+      logCalibrationChange();
+      getCalibration();
+      break;
+  }
+  menu_state = MENU_COMMAND;
+} // End menuWork
 
 // ***********************************************************************
 // * FILE MANAGER FUNCTIONS
 // ***********************************************************************
+// The log's multi-block write is only paused while another file is being read or
+// changed, so logging carries on while the file manager is open. Transfers and the
+// file list read MENU_FILE_BLOCKS blocks per loop() pass.
 
 void(* resetFunc) (void) = 0; // Declare reset function at address 0
 
@@ -830,47 +3107,172 @@ void fileManager() {
   Serial.println();
   Serial.println(F("--- FILE MANAGER ---"));
   Serial.println();
-  fm = true;
-  do {
-    Serial.println();
-    Serial.println(F("Choose: l - list files; t - transfer a file; d - delete a file; c - clear the entire SD card; x - exit file manager."));
-    Serial.println(F("Enter file option:"));
-    // Get incoming data
-    readSerial();
-    // Switch on incoming byte
-    switch(serial_data[0]) {
-      // List files on SD card
-      case 'l': case 'L': {
-        File root = SD.open("/");
-        printDirectory(root, 0);
-        root.close();
-        break;
-      }
-      // Transfer file
-      case 't': case 'T': {
-        getFileName('t');
-        break;
-      }
-      // Delete file
-      case 'd': case 'D': {
-        getFileName('d');
+  filePrompt();
+} // End fileManager
+
+// Show the options and wait for one
+void filePrompt() {
+  Serial.println();
+  Serial.println(F("Choose: l - list files; t - transfer a file; b - binary transfer for lcl_get; n - file list for lcl_get; d - delete a file; c - clear the entire SD card; x - exit file manager."));
+  menuPrompt(MENU_FILE_OPTION, F("Enter file option:"));
+}
+
+void fileOption(char option) {
+  switch(option) {
+    // List files on SD card
+    case 'l': case 'L': {
+      writerPause();
+      File root = SD.open("/");
+      printDirectory(root, 0);
+      root.close();
+      writerResume();
+      break;
+    }
+    // Transfer, framed transfer or delete a file, once it is named
+    case 't': case 'T': case 'b': case 'B': case 'd': case 'D':
+      fm_action = option | 0x20; // Lower case
+      menuPrompt(MENU_FILE_NAME, F("Enter FN:"));
+      return;
+    // Framed file list
+    case 'n': case 'N':
+      sendFileList();
+      return;
+    // Clear card
+    case 'c': case 'C':
+      Serial.println();
+      menuPrompt(MENU_FILE_CLEAR, F("WARNING: All data on card will be cleared - type Y to continue, or any other key to abort."));
+      return;
+    // Exit
+    case 'x': case 'X':
+      menu_state = MENU_COMMAND;
+      return;
+    default:
+      Serial.println(F("Invalid option entered!"));
+  } // End switch
+  filePrompt();
+} // End fileOption
+
+// Act on the file name entered for the chosen option
+void fileName() {
+  Serial.print("FILE: ");
+  Serial.println(serial_data);
+  strcpy(fm_name, serial_data);
+  switch (fm_action) {
+    // Transfer file
+    case 't':
+      getFile(fm_name);
+      return;
+    // Framed binary transfer
+    case 'b':
+      menuPrompt(MENU_FILE_OFFSET, F("Enter offset:"));
+      return;
+    // Delete file
+    case 'd':
+      writerPause();
+      delFile(fm_name);
+      writerResume();
+      break;
+  } // End switch
+  filePrompt();
+} // End fileName
+
+// Send the next few blocks of a transfer or file list
+void fileService() {
+  uint8_t buf[TRANSFER_BLOCK_SIZE];
+  writerPause();
+  for (byte i = 0; i < MENU_FILE_BLOCKS && menu_state >= MENU_FILE_DUMP; i++) {
+    switch (menu_state) {
+      case MENU_FILE_DUMP: {
+        int n = fm_file.read(buf, sizeof(buf));
+        if (n > 0) {
+          Serial.write(buf, n);
+          break;
+        }
+        fm_file.close();
+        Serial.println();
+        Serial.println(F("--------------------------"));
+        Serial.println();
+        Serial.println(F("Done!"));
+        filePrompt();
         break;
       }
-      // Clear card
-      case 'c': case 'C': {
-        clearCard();
+      case MENU_FILE_SEND: {
+        uint32_t size = fm_file.size();
+        if (fm_pos >= size) {
+          fm_file.close();
+          TransferEnd end = {size, fm_crc};
+          sendFrame(TRANSFER_END, size, &end, sizeof(end));
+          filePrompt();
+          break;
+        }
+        uint32_t want = size - fm_pos < TRANSFER_BLOCK_SIZE ? size - fm_pos : TRANSFER_BLOCK_SIZE;
+        // The end frame checks the whole file, so checksum the part the host already has
+        if (fm_pos < fm_offset && fm_offset - fm_pos < want) want = fm_offset - fm_pos;
+        int n = fm_file.read(buf, want);
+        if (n <= 0) {
+          const char msg[] = "Error reading file.";
+          sendFrame(TRANSFER_ERROR, fm_pos, msg, sizeof(msg) - 1);
+          fm_file.close();
+          filePrompt();
+          break;
+        }
+        fm_crc = crc32(buf, n, fm_crc);
+        if (fm_pos >= fm_offset) sendFrame(TRANSFER_DATA, fm_pos, buf, n);
+        fm_pos += n;
         break;
       }
-      // Exit
-      case 'x': case 'X': {
-        fm = false;
+      case MENU_FILE_LIST: {
+        if (fm_file) {
+          // Checksum the current file, then send its entry
+          int n = fm_file.read(buf, sizeof(buf));
+          if (n > 0) {
+            fm_entry.crc = crc32(buf, n, fm_entry.crc);
+            break;
+          }
+          fm_file.close();
+          sendFrame(TRANSFER_LIST, fm_count, &fm_entry, sizeof(fm_entry));
+          fm_count++;
+          break;
+        }
+        fm_file = fm_dir.openNextFile();
+        if (!fm_file) {
+          fm_dir.close();
+          TransferEnd end = {fm_count, 0};
+          sendFrame(TRANSFER_END, fm_count, &end, sizeof(end));
+          filePrompt();
+          break;
+        }
+        if (fm_file.isDirectory()) {
+          fm_file.close();
+          break;
+        }
+        memset(&fm_entry, 0, sizeof(fm_entry));
+        fm_file.getName(fm_entry.name, sizeof(fm_entry.name));
+        fm_entry.size = fm_file.size();
+        if (isOpenLog(fm_entry.name)) {
+          // Still pre-allocated to its full extent, report only what has been written
+          fm_file.close();
+          fm_entry.flags = TRANSFER_ENTRY_OPEN;
+          fm_entry.size = openLogBytes();
+          sendFrame(TRANSFER_LIST, fm_count, &fm_entry, sizeof(fm_entry));
+          fm_count++;
+        }
         break;
       }
-      default:
-        Serial.println(F("Invalid option entered!"));
     } // End switch
-  } while (fm); // End while
-} // End fileManager
+  }
+  writerResume();
+} // End fileService
+
+// True for the log being written, whose file is still its whole pre-allocated extent
+bool isOpenLog(const char *name) {
+  return logging && strcasecmp(name, filename) == 0;
+}
+
+// Bytes of the open log written to the card so far, in whole sectors
+uint32_t openLogBytes() {
+  return (sd_sector - log_first_sector) * LOG_SECTOR_SIZE;
+}
 
 // Function to print the contents of a directory
 // Can be called recursively to indent nested directories using numTabs arg
@@ -886,75 +3288,106 @@ void printDirectory(File dir, int numTabs) {
      for (uint8_t i=0; i<numTabs; i++) {
        Serial.print('\t');
      }
-     Serial.print(entry.name());
+     char name[13];
+     entry.getName(name, sizeof(name));
+     Serial.print(name);
      if (entry.isDirectory()) {
        Serial.println("/");
        printDirectory(entry, numTabs+1);
      } else {
        // files have sizes, directories do not
        Serial.print("\t\t");
-       Serial.println(entry.size(), DEC);
+       if (isOpenLog(name)) {
+         Serial.print((unsigned long)openLogBytes(), DEC);
+         Serial.println(F(" (open)"));
+       } else {
+         Serial.println((unsigned long)entry.size(), DEC);
+       }
      }
      entry.close();
    }
 }
 
-// Gets a file name from the serial terminal
-void getFileName(char action) {
-  Serial.println(F("Enter FN:"));
-  // Get incoming data
-  readSerial();
-  //String readString(serial_data); 
-  if (1) {
-    Serial.print("FILE: ");
-    Serial.println(serial_data);
-    // Do something with file based on action
-    switch (action) {
-      // Transfer file
-      case 't':
-        getFile(serial_data);
-        break;
-      // Delete file
-      case 'd':
-        delFile(serial_data);
-        break;
-    } // End switch
-  } // End If
-} // End getFileName
-
-
-// Transfers a CSV file over serial
+// Transfers a CSV file over serial, the blocks are sent by fileService()
 void getFile(char* fn) {
   Serial.println();
+  if (isOpenLog(fn)) {
+    Serial.println(F("Log is open, close it with q first."));
+    filePrompt();
+    return;
+  }
+  writerPause();
   // Check that file exists
   if (!SD.exists(fn)) {
+    writerResume();
     Serial.println(F("File does not exist."));
+    filePrompt();
     return;
   }
   // Open file
-  File dumpFile = SD.open(fn);
-  if (dumpFile) {
+  fm_file = SD.open(fn);
+  writerResume();
+  if (fm_file) {
     Serial.print(F("File dump from "));
     Serial.println(fn);
     Serial.println();
     Serial.println(F("--------------------------"));
     Serial.println();
-    // Dump file to serial
-    while (dumpFile.available()) {
-      Serial.write(dumpFile.read());
-    }
-    // Close file
-    dumpFile.close();
-    Serial.println();
-    Serial.println(F("--------------------------"));
-    Serial.println();
-    Serial.println(F("Done!")); 
-    
+    menu_state = MENU_FILE_DUMP;
   } else {
     Serial.println(F("Error opening file."));
+    filePrompt();
   }
 } // End getFile
 
+// Sends fm_name as CRC checked frames from a requested offset, see transfer_format.h.
+// The frames are sent by fileService().
+void sendFile(uint32_t offset) {
+  writerPause();
+  fm_file = SD.open(fm_name);
+  writerResume();
+  const char *msg = NULL;
+  if (isOpenLog(fm_name)) {
+    // Its size is the pre-allocated extent, not the data, so no size or CRC would hold
+    msg = "Log is open, close it with q first.";
+  } else if (!fm_file || fm_file.isDirectory()) {
+    msg = "File does not exist.";
+  } else if (offset > fm_file.size()) {
+    msg = "Offset past end of file.";
+  }
+  if (msg) {
+    if (fm_file) fm_file.close();
+    sendFrame(TRANSFER_ERROR, offset, msg, strlen(msg));
+    filePrompt();
+    return;
+  }
+  fm_offset = offset;
+  fm_pos = 0;
+  fm_crc = 0;
+  menu_state = MENU_FILE_SEND;
+} // End sendFile
+
+// Sends an entry with the size and CRC of each file in the root, see transfer_format.h.
+// The entries are sent by fileService().
+void sendFileList() {
+  writerPause();
+  fm_dir = SD.open("/");
+  fm_dir.rewindDirectory();
+  writerResume();
+  fm_count = 0;
+  menu_state = MENU_FILE_LIST;
+} // End sendFileList
+
+// Writes one transfer frame: header, payload and CRC
+void sendFrame(uint16_t type, uint32_t offset, const void* payload, uint16_t length) {
+  TransferFrame frame = {TRANSFER_MAGIC, offset, length, type};
+  uint32_t crc = crc32(&frame, sizeof(frame));
+  crc = crc32(payload, length, crc);
+  Serial.write((const uint8_t*)&frame, sizeof(frame));
+  Serial.write((const uint8_t*)payload, length);
+  Serial.write((const uint8_t*)&crc, sizeof(crc));
+} // End sendFrame
+
 // Delete file
 void delFile(char* fn) {
   // Check that file exists
@@ -962,6 +3395,12 @@ void delFile(char* fn) {
     Serial.println(F("File entered does not exist."));
     return;
   }
+  // These are written straight to their sectors, which mustn't be given to another file
+  if (strcasecmp(fn, SETTINGS_FILE) == 0 || strcasecmp(fn, JOURNAL_FILE) == 0 || strcasecmp(fn, rainflow_name) == 0 ||
+      (logging && strcasecmp(fn, filename) == 0)) {
+    Serial.println(F("File is in use."));
+    return;
+  }
   // Delete file
   if (SD.remove(fn)) {
     Serial.println(F("File removed."));
@@ -971,15 +3410,9 @@ void delFile(char* fn) {
   Serial.println();
 } // End delFile
 
-// Clear all files on the SD card
+// Clear all files on the SD card, once confirmed with Y
 void clearCard() {
-  Serial.println();
-  Serial.println(F("WARNING: All data on card will be cleared - type Y to continue, or any other key to abort."));
-  // Get incoming data
-  readSerial();
-  // If anything but Y sent, abort
-  if(!(serial_data[0] == 'Y' || serial_data[0] == 'y')) {return;}
-  // Proceed with card clear
+  writerPause();
   File root = SD.open("/");
   root.rewindDirectory();
   while (true) {
@@ -988,19 +3421,27 @@ void clearCard() {
       // No more files
       break;
     }
-    // Skip current logfile TODO not working as expected
-    if (strcmp(entry.name(), filename) == 0) {entry.close(); continue;}
-    // Skip config file
-    if (strcmp(entry.name(), "CONFIG.TXT") == 0) {entry.close(); continue;}
-    Serial.print(entry.name());
+    char name[13];
+    entry.getName(name, sizeof(name));
+    // Skip current logfile
+    if (strcmp(name, filename) == 0) {entry.close(); continue;}
+    // Skip the settings, and the marker for the current logfile
+    if (strcasecmp(name, "CONFIG.TXT") == 0) {entry.close(); continue;}
+    if (strcasecmp(name, SETTINGS_FILE) == 0) {entry.close(); continue;}
+    if (strcasecmp(name, JOURNAL_FILE) == 0) {entry.close(); continue;}
+    if (strcasecmp(name, rainflow_name) == 0) {entry.close(); continue;}
+    if (strcasecmp(name, OPEN_LOG_FILE) == 0) {entry.close(); continue;}
+    Serial.print(name);
     // Delete file
-    if (SD.remove(entry.name())) {
+    if (SD.remove(name)) {
       Serial.println(F(" removed."));
     } else {
       Serial.println(F(" could not be removed."));
     }
     entry.close();
   } // End while
+  root.close();
+  writerResume();
   // Restart logger
   //resetFunc();
 } // End clearCard
@@ -1017,5 +3458,5 @@ void error(const __FlashStringHelper*err) {
   setRGB(magenta, 3);
   // Halts program execution
   Serial.println(F("Program suspended"));
-  while(1);
+  while(1) delay(1000);
 } // End error
\ No newline at end of file
@@ -0,0 +1,200 @@
+/*
+Binary log file layout, shared by the logger firmware and the host decoder.
+
+A binary log is a sequence of 512 byte sectors so that every write to the SD
+card is one whole, aligned block:
+
+  sector 0     LogFileHeader, zero padded to 512 bytes
+  sector 1..n  LogBlock, each holding up to LOG_RECORDS_PER_BLOCK records or
+               LOG_SUMMARIES_PER_BLOCK interval summaries, a calibration
+               change, or a timing statistics footer
+
+Packed logs (log_format = 2) are the same, except that their records are in
+LOG_BLOCK_PACKED blocks. Each of these holds header.count runs of records at a
+steady rate: a LogPackedRun with the time and raw counts of the first record
+and the spacing of the rest, then for each of the others the change in raw
+counts from the record before as a zigzag varint (varint.h). A record's time is
+implicit, us + (i * period + 8) / 16 for the i-th record of the run from 0,
+which the logger keeps within PACKED_TIME_TOLERANCE_US of the conversion's
+actual time; a record it can't fit that way starts a new run. While the line
+is idle most changes fit one byte, against eight for a LogRecord.
+
+Event captures (.EVT files) use the same layout: the header, one event block
+describing the trigger, then the captured records, whose times the decoder
+extends from the trigger time.
+
+Everything is little endian, which both the SAMD21 and x86/ARM hosts are.
+Records hold raw counts only; calibrated load is computed by the decoder from
+the calibration in the file header, or from the most recent calibration block.
+
+Record times are the low 32 bits of the logger's monotonic microsecond clock.
+The decoder extends each to 64 bits from the record before it, starting from
+the clock anchor in the header, and turns them into UTC with the anchor and
+drift correction in the header and the latest clock block. The logger moves
+its anchor up to the time of writing for each header and clock block.
+*/
+
+#ifndef LOG_FORMAT_H
+#define LOG_FORMAT_H
+
+#include <stdint.h>
+
+#define LOG_SECTOR_SIZE 512
+#define LOG_MAGIC 0x424C434CUL // "LCLB" read as a little endian uint32
+#define LOG_FORMAT_VERSION 3 // 2 had no packed blocks, 1 had millis() record times and no clock anchors
+
+// Values of log_format in config.txt
+#define LOG_FORMAT_CSV 0
+#define LOG_FORMAT_BINARY 1
+#define LOG_FORMAT_PACKED 2 // Binary, with the records delta coded
+
+// Values of log_record in config.txt
+#define LOG_RECORD_SAMPLE 0  // One conversion per log_interval
+#define LOG_RECORD_SUMMARY 1 // Statistics of every conversion in each log_interval
+
+// Block types
+#define LOG_BLOCK_SAMPLES 1     // Payload is an array of LogRecord
+#define LOG_BLOCK_CALIBRATION 2 // Payload is a LogCalibration, applies to later blocks
+#define LOG_BLOCK_STATS 3       // Payload is a LogStats, written periodically and at close
+#define LOG_BLOCK_CLOCK 4       // Payload is a LogClock, applies to later blocks
+#define LOG_BLOCK_EVENT 5       // Payload is a LogEvent, first block of an event capture
+#define LOG_BLOCK_SUMMARY 6     // Payload is an array of LogSummary
+#define LOG_BLOCK_PACKED 7      // Payload is header.count runs of LogPackedRun and varints
+
+// What the clock in a LogClock was disciplined by
+#define LOG_CLOCK_RTC_READ 0 // RTC register reads, good to a few ms
+#define LOG_CLOCK_RTC_SQW 1  // RTC 1 Hz square wave edges
+
+// Timed stages in LogStats, in order
+#define LOG_STAGE_LOOP 0       // One pass of loop(), start to start
+#define LOG_STAGE_READING 1    // load_cell.getReading()
+#define LOG_STAGE_UTC 2        // getUTC()
+#define LOG_STAGE_LOG_WRITE 3  // Formatting one logged sample into the writer
+#define LOG_STAGE_SYNC 4       // writerSync()
+#define LOG_STAGE_COUNT 5
+#define LOG_STAGE_HIST_BUCKETS 8 // Powers of four from <16 us, see stage_timer.h
+
+struct __attribute__((packed)) LogCalibration {
+  float cal_factor;    // Counts per unit load
+  int32_t zero_offset; // Raw counts at zero load
+  uint8_t gain;        // NAU7802_GAIN_x register code
+  uint8_t sample_rate; // NAU7802_SPS_x register code
+  uint8_t filter;      // Filter chain applied to the raw counts, see LOG_FILTER()
+  uint8_t reserved;
+};
+
+// LogCalibration.filter: median length (0 off) in bits 0-2, FILTER_LOWPASS_x in bits
+// 3-4, log2 of the decimation factor in bits 5-7. 0 is unfiltered.
+#define LOG_FILTER(median, lowpass, decimate_shift) \
+  ((uint8_t)(((median) & 7) | (((lowpass) & 3) << 3) | (((decimate_shift) & 7) << 5)))
+#define LOG_FILTER_MEDIAN(filter) ((filter) & 7)
+#define LOG_FILTER_LOWPASS(filter) (((filter) >> 3) & 3)
+#define LOG_FILTER_DECIMATE_SHIFT(filter) ((filter) >> 5)
+
+// Anchor point of the logger's UTC clock: UTC at a monotonic time and the rate
+// correction applied after it
+struct __attribute__((packed)) LogClock {
+  uint64_t mono_us;  // Monotonic microseconds since power on
+  uint64_t unix_us;  // UTC at mono_us, microseconds since 1970
+  int32_t drift_ppm; // UTC runs this many ppm faster than the monotonic clock
+  uint8_t source;    // LOG_CLOCK_x
+  uint8_t reserved[3];
+};
+
+struct __attribute__((packed)) LogStageStats {
+  uint32_t count;
+  uint32_t min_us;
+  uint32_t max_us;
+  uint32_t mean_us;
+  uint32_t hist[LOG_STAGE_HIST_BUCKETS];
+};
+
+// Counters since power on
+struct __attribute__((packed)) LogStats {
+  uint32_t uptime_ms;       // millis() when written
+  LogStageStats stages[LOG_STAGE_COUNT];
+  uint32_t ring_dropped;    // Conversions dropped because the sample ring was full
+  uint16_t ring_peak;       // Most conversions waiting in the ring at once
+  uint16_t reserved;
+  uint32_t missed_samples;  // Conversions the ADC overwrote before they were read
+  uint32_t sd_overruns;     // Times both sector buffers were full
+  uint32_t sd_lost_bytes;   // Bytes dropped because the extent was full
+  uint32_t sd_write_max_us; // Longest single sector transfer
+  uint32_t sd_queue_max_us; // Longest a full buffer waited on a busy card
+  uint32_t sleep_ms;        // Time the processor spent asleep
+};
+
+// Trip threshold crossing that started an event capture
+struct __attribute__((packed)) LogEvent {
+  uint64_t trigger_us;  // Monotonic time of the first conversion past the threshold
+  float load;           // Its calibrated load
+  float trip_value;     // trip_value setting at the time
+  uint8_t level;        // Threshold crossed: 1 50%, 2 75%, 3 100% of trip_value
+  uint8_t reserved;
+  uint16_t pre_count;   // Records before the trigger
+  uint16_t post_count;  // Records from the trigger on
+};
+
+struct __attribute__((packed)) LogFileHeader {
+  uint32_t magic;          // LOG_MAGIC
+  uint16_t format_version; // LOG_FORMAT_VERSION
+  uint8_t fw_major;        // Firmware VERSION_MAJOR
+  uint8_t fw_minor;        // Firmware VERSION_MINOR
+  uint32_t start_unix;     // RTC time the file was created, UTC seconds since 1970
+  uint32_t start_ms;       // millis() at start_unix
+  int32_t log_interval;    // log_interval setting in ms, 0 = every conversion
+  LogCalibration cal;      // Calibration in effect when the file was created
+  LogClock clock;          // Clock anchor when the file was created
+};
+
+struct __attribute__((packed)) LogBlockHeader {
+  uint8_t type;      // LOG_BLOCK_x
+  uint8_t count;     // Number of records used in this block
+  uint16_t reserved; // Written as 0
+  uint32_t seq;      // Block number, counting from 0 at sector 1
+};
+
+struct __attribute__((packed)) LogRecord {
+  uint32_t us; // Low 32 bits of the monotonic microsecond time of the conversion
+  int32_t raw; // Raw NAU7802 reading
+};
+
+// Statistics of the raw conversions in one log interval
+struct __attribute__((packed)) LogSummary {
+  uint32_t us;       // Low 32 bits of the monotonic time of the first conversion
+  uint32_t count;    // Conversions in the interval
+  int32_t raw_min;
+  int32_t raw_max;
+  float raw_mean;
+  float raw_stddev;  // Sample standard deviation
+};
+
+// Start of a run of records in a LOG_BLOCK_PACKED block, followed by count - 1 varints
+struct __attribute__((packed)) LogPackedRun {
+  uint32_t us;     // Low 32 bits of the monotonic time of the first record
+  int32_t raw;     // Its raw reading
+  uint32_t period; // Spacing of the records in sixteenths of a microsecond, 0 for one record
+  uint16_t count;  // Records in the run
+};
+
+#define LOG_BLOCK_PAYLOAD (LOG_SECTOR_SIZE - sizeof(LogBlockHeader))
+#define LOG_RECORDS_PER_BLOCK (LOG_BLOCK_PAYLOAD / sizeof(LogRecord))
+#define LOG_SUMMARIES_PER_BLOCK (LOG_BLOCK_PAYLOAD / sizeof(LogSummary))
+
+struct __attribute__((packed)) LogBlock {
+  LogBlockHeader header;
+  union {
+    LogRecord records[LOG_RECORDS_PER_BLOCK];
+    LogSummary summaries[LOG_SUMMARIES_PER_BLOCK];
+    LogCalibration cal;
+    LogStats stats;
+    LogClock clock;
+    LogEvent event;
+    uint8_t bytes[LOG_BLOCK_PAYLOAD];
+  };
+};
+
+static_assert(sizeof(LogFileHeader) <= LOG_SECTOR_SIZE, "file header must fit in one sector");
+static_assert(sizeof(LogBlock) == LOG_SECTOR_SIZE, "a block must be exactly one sector");
+
+#endif // LOG_FORMAT_H
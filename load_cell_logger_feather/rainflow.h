@@ -0,0 +1,125 @@
+/*
+Incremental rainflow cycle counting of the load, for fatigue.
+
+Each conversion's load goes to add(). A reversal, a peak or valley, is taken
+once the load has come back from it by more than the gate, so noise smaller
+than the gate doesn't make cycles. Reversals go on a stack, and each one added
+closes any cycles it can by the four point method: of the last four reversals,
+if the middle range is no larger than the ranges either side of it, those two
+middle reversals are a closed cycle, counted and removed. This gives the same
+counts as the ASTM E1049 rainflow method without going back over the history.
+What stays on the stack is the residue, a sequence of ranges growing then
+shrinking, which is short in practice.
+
+Adding a conversion is a couple of compares; the stack work and the divisions
+to find a bin only happen at reversals.
+*/
+
+#ifndef RAINFLOW_H
+#define RAINFLOW_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "rainflow_format.h"
+
+#define RAINFLOW_STACK 32 // Reversals kept; past this the oldest range is counted as a half cycle
+
+struct RainflowCounter {
+  int32_t range_bin = 0; // Bin widths and gate, all 0 turns counting off
+  int32_t mean_bin = 0;
+  int32_t gate = 0;
+  int32_t stack[RAINFLOW_STACK];
+  uint8_t depth = 0;
+  int32_t extreme = 0;  // Highest or lowest load since the last reversal
+  int8_t direction = 0; // 1 rising, -1 falling, 0 not yet moved past the gate
+  int32_t max_load = 0;
+  uint32_t samples = 0;
+  uint32_t cycles = 0;
+  uint32_t half_cycles[RAINFLOW_RANGE_BINS][RAINFLOW_MEAN_BINS];
+
+  void begin(int32_t range_bin_width, int32_t mean_bin_width) {
+    range_bin = range_bin_width > 0 ? range_bin_width : 0;
+    mean_bin = mean_bin_width > 0 ? mean_bin_width : 0;
+    gate = range_bin / 2;
+    depth = 0;
+    direction = 0;
+    max_load = 0;
+    samples = 0;
+    cycles = 0;
+    memset(half_cycles, 0, sizeof(half_cycles));
+  }
+
+  void add(int32_t load) {
+    if (range_bin == 0 || mean_bin == 0) return;
+    if (samples++ == 0) extreme = load;
+    if (load > max_load) max_load = load;
+    if (direction == 0) {
+      // The first load is a reversal once the load has moved away from it
+      if (load - extreme > gate || extreme - load > gate) {
+        push(extreme);
+        direction = load > extreme ? 1 : -1;
+        extreme = load;
+      }
+    } else if (direction > 0 ? load > extreme : load < extreme) {
+      extreme = load;
+    } else if (direction > 0 ? extreme - load > gate : load - extreme > gate) {
+      push(extreme);
+      direction = -direction;
+      extreme = load;
+    }
+  }
+
+  // The histogram so far with the residue counted as half cycles, into out. The load
+  // since the last reversal counts as the end of the residue. Returns the residue's
+  // half cycles.
+  uint16_t snapshot(uint32_t out[RAINFLOW_RANGE_BINS][RAINFLOW_MEAN_BINS]) const {
+    memcpy(out, half_cycles, sizeof(half_cycles));
+    uint16_t residue = 0;
+    for (uint8_t i = 1; i <= depth; i++) {
+      if (i == depth && direction == 0) break;
+      int32_t to = i < depth ? stack[i] : extreme;
+      out[rangeIndex(stack[i - 1], to)][meanIndex(stack[i - 1], to)]++;
+      residue++;
+    }
+    return residue;
+  }
+
+ private:
+  void push(int32_t reversal) {
+    if (depth == RAINFLOW_STACK) {
+      // Out of room, so give up on closing the oldest range and count it as a half cycle
+      count(stack[0], stack[1], 1);
+      memmove(stack, stack + 1, (RAINFLOW_STACK - 1) * sizeof(stack[0]));
+      depth--;
+    }
+    stack[depth++] = reversal;
+    while (depth >= 4) {
+      int32_t *s = stack + depth - 4;
+      uint32_t inner = range(s[1], s[2]);
+      if (inner > range(s[0], s[1]) || inner > range(s[2], s[3])) break;
+      count(s[1], s[2], 2);
+      cycles++;
+      s[1] = s[3];
+      depth -= 2;
+    }
+  }
+
+  static uint32_t range(int32_t a, int32_t b) { return a > b ? (uint32_t)(a - b) : (uint32_t)(b - a); }
+
+  uint8_t rangeIndex(int32_t a, int32_t b) const {
+    uint32_t bin = range(a, b) / (uint32_t)range_bin;
+    return bin < RAINFLOW_RANGE_BINS ? bin : RAINFLOW_RANGE_BINS - 1;
+  }
+
+  uint8_t meanIndex(int32_t a, int32_t b) const {
+    int32_t mean = (int32_t)(((int64_t)a + b) / 2);
+    if (mean < 0) return 0;
+    uint32_t bin = (uint32_t)mean / (uint32_t)mean_bin;
+    return bin < RAINFLOW_MEAN_BINS ? bin : RAINFLOW_MEAN_BINS - 1;
+  }
+
+  void count(int32_t a, int32_t b, uint32_t halves) { half_cycles[rangeIndex(a, b)][meanIndex(a, b)] += halves; }
+};
+
+#endif // RAINFLOW_H
@@ -0,0 +1,60 @@
+/*
+Layout of the rainflow cycle count summary, shared by the logger firmware and
+the host decoder (host/lcl_decode).
+
+Each power on, the logger counts the load cycles in every filtered conversion
+(rainflow.h) and keeps the result in a file named after the first log of the
+power on with an .RFC extension, e.g. 23051100.RFC. The file is RAINFLOW_SLOTS
+512 byte sectors, allocated and erased once, then written in place with raw
+sector writes at each sync and when the log is closed, alternating between the
+slots, so the FAT is never touched while logging and a write cut off by a power
+loss leaves the one before it intact. The intact record with the higher
+sequence number is the latest.
+
+half_cycles is a histogram of cycle range against cycle mean, in half cycles.
+Closed cycles count two. The reversals not yet closed when the record was
+written, the residue, are counted in it too, as one half cycle per range
+between consecutive reversals, so every record covers the whole power on so
+far. Range bin i holds ranges from i * range_bin up to (i + 1) * range_bin,
+mean bin j means from j * mean_bin up to (j + 1) * mean_bin; the last bin of
+each is open ended. Loads are in hundredths of a load unit, as in
+fixed_point.h.
+
+Everything is little endian, as in log_format.h.
+*/
+
+#ifndef RAINFLOW_FORMAT_H
+#define RAINFLOW_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RAINFLOW_MAGIC 0x524C434CUL // "LCLR" read as a little endian uint32
+#define RAINFLOW_VERSION 1
+#define RAINFLOW_SLOTS 2
+#define RAINFLOW_RANGE_BINS 16
+#define RAINFLOW_MEAN_BINS 6
+
+struct __attribute__((packed, aligned(4))) RainflowRecord {
+  uint32_t magic;       // RAINFLOW_MAGIC
+  uint16_t version;     // RAINFLOW_VERSION
+  uint16_t size;        // sizeof(RainflowRecord)
+  uint32_t seq;         // Records written this power on
+  uint32_t start_unix;  // RTC time counting started, UTC seconds since 1970
+  uint32_t uptime_ms;   // millis() when written
+  int32_t range_bin;    // Width of a range bin in load hundredths, trip_value / RAINFLOW_RANGE_BINS
+  int32_t mean_bin;     // Width of a mean bin in load hundredths, trip_value / RAINFLOW_MEAN_BINS
+  int32_t gate;         // Smallest load reversal counted, half a range bin
+  int32_t max_load;     // Highest load counted
+  uint32_t samples;     // Conversions counted
+  uint32_t cycles;      // Closed cycles, not counting the residue
+  uint16_t residue;     // Half cycles of the residue included in half_cycles
+  uint16_t reserved;
+  uint32_t half_cycles[RAINFLOW_RANGE_BINS][RAINFLOW_MEAN_BINS];
+  uint32_t crc;         // CRC-32 (crc32.h) of everything before it
+};
+
+static_assert(sizeof(RainflowRecord) <= 512, "rainflow record must fit in one sector");
+static_assert(offsetof(RainflowRecord, half_cycles) % 4 == 0, "histogram is word aligned");
+
+#endif // RAINFLOW_FORMAT_H
@@ -0,0 +1,100 @@
+/*
+Single-producer/single-consumer ring buffer used between the load cell
+acquisition stage and the SD/serial writer.
+
+The producer only ever writes head_ and the consumer only ever writes tail_,
+so no interrupt masking is needed as long as there is exactly one of each.
+Capacity must be a power of two so the free-running 16 bit indices can be
+masked instead of divided.
+
+SampleHistory is the plain overwrite-oldest buffer of the most recent samples,
+used by the logger for pre-trigger history. It is only touched from the
+consumer side so it needs no barriers.
+*/
+
+#ifndef SAMPLE_RING_H
+#define SAMPLE_RING_H
+
+#include <stdint.h>
+
+// Compiler barrier - keeps the slot write ordered before the index update.
+// The Cortex-M0 is single core so no hardware fence is needed.
+#define RING_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+// One conversion from the NAU7802
+struct Sample {
+  uint32_t us;  // micros() when the conversion became ready
+  int32_t raw;  // Raw 24 bit conversion, sign extended
+};
+
+template <typename T, uint16_t N>
+class SampleRing {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "ring size must be a power of two");
+  static_assert(N <= 32768, "ring size must fit the 16 bit index arithmetic");
+
+ public:
+  // Producer side. Returns false and counts a drop if the ring is full.
+  bool push(const T& item) {
+    uint16_t head = head_;
+    if ((uint16_t)(head - tail_) >= N) {
+      dropped_++;
+      return false;
+    }
+    buf_[head & (N - 1)] = item;
+    RING_BARRIER();
+    head_ = head + 1;
+    uint16_t used = head + 1 - tail_;
+    if (used > peak_) peak_ = used;
+    return true;
+  }
+
+  // Consumer side. Returns false if there is nothing to read.
+  bool pop(T& item) {
+    uint16_t tail = tail_;
+    if (tail == head_) return false;
+    item = buf_[tail & (N - 1)];
+    RING_BARRIER();
+    tail_ = tail + 1;
+    return true;
+  }
+
+  uint16_t size() const { return (uint16_t)(head_ - tail_); }
+  uint16_t capacity() const { return N; }
+  uint32_t dropped() const { return dropped_; }
+  // Most samples ever waiting at once, shows how close the consumer came to falling behind
+  uint16_t peak() const { return peak_; }
+
+ private:
+  T buf_[N];
+  volatile uint16_t head_ = 0;
+  volatile uint16_t tail_ = 0;
+  volatile uint32_t dropped_ = 0;
+  uint16_t peak_ = 0;
+};
+
+// The last N items pushed, oldest overwritten first
+template <typename T, uint16_t N>
+class SampleHistory {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "history size must be a power of two");
+  static_assert(N <= 32768, "history size must fit the 16 bit index arithmetic");
+
+ public:
+  void push(const T& item) {
+    buf_[head_ & (N - 1)] = item;
+    head_++;
+    if (size_ < N) size_++;
+  }
+
+  // Item i places back from the newest, 0 being the newest. i must be less than size().
+  const T& back(uint16_t i) const { return buf_[(uint16_t)(head_ - 1 - i) & (N - 1)]; }
+
+  uint16_t size() const { return size_; }
+  void clear() { size_ = 0; }
+
+ private:
+  T buf_[N];
+  uint16_t head_ = 0;
+  uint16_t size_ = 0;
+};
+
+#endif // SAMPLE_RING_H
@@ -0,0 +1,58 @@
+/*
+Layout of the logger's saved settings.
+
+The settings live in SETTINGS.DAT (not .BIN, which the host tools take for a
+binary log), a file of SETTINGS_SLOTS 512 byte sectors allocated once and then
+written in place with raw sector writes, so saving them never touches the FAT or
+the directory. Each save is one sector write to the slot
+not holding the latest record, with a sequence number one higher, so the record
+before it is never at risk. The record is at the start of its sector and the rest
+is zero. At boot the intact record with the highest sequence number is used; one
+with the wrong magic, an unknown version or a bad CRC is ignored, as is left by a
+write cut short. With neither slot intact the defaults are used.
+
+config.txt is only an import and export format now: the logger imports it when
+its contents differ from the last config.txt it imported or exported, which it
+tells by config_crc, and the w command writes it out again.
+
+Everything is little endian, as in log_format.h.
+*/
+
+#ifndef SETTINGS_FORMAT_H
+#define SETTINGS_FORMAT_H
+
+#include <stdint.h>
+
+#define SETTINGS_FILE "SETTINGS.DAT"
+#define SETTINGS_MAGIC 0x534C434CUL // "LCLS" read as a little endian uint32
+#define SETTINGS_VERSION 1
+#define SETTINGS_SLOTS 2
+
+struct __attribute__((packed)) SettingsRecord {
+  uint32_t magic;      // SETTINGS_MAGIC
+  uint16_t version;    // SETTINGS_VERSION
+  uint16_t size;       // sizeof(SettingsRecord)
+  uint32_t seq;        // Times the settings have been saved, the latest record has the highest
+  uint32_t config_crc; // CRC-32 (crc32.h) of the config.txt last imported or exported
+  float cal_factor;
+  float zero_offset;
+  int32_t log_interval;
+  int32_t sync_interval;
+  int32_t trip_value;
+  int32_t deploy_hours;
+  int32_t trigger_rate;
+  int32_t trigger_percent;
+  uint8_t echo;
+  uint8_t log_format;
+  uint8_t log_record;
+  uint8_t adaptive;
+  uint8_t filter_median;
+  uint8_t filter_lowpass;
+  uint8_t filter_decimate;
+  uint8_t reserved;
+  uint32_t crc;        // CRC-32 of everything before it
+};
+
+static_assert(sizeof(SettingsRecord) == 60, "settings layout is fixed");
+
+#endif // SETTINGS_FORMAT_H
@@ -0,0 +1,40 @@
+/*
+Timing statistics for one stage of the main loop: count, min, max, mean and a
+histogram of durations in microseconds.
+
+Adding a sample is a handful of compares and adds, so timers can stay in the
+hot path of a deployed logger. Histogram buckets are powers of four:
+
+  bucket  0      1      2       3        4        5         6          7
+  us      <16    <64    <256    <1024    <4096    <16384    <65536     >=65536
+*/
+
+#ifndef STAGE_TIMER_H
+#define STAGE_TIMER_H
+
+#include <stdint.h>
+
+#define STAGE_HIST_BUCKETS 8
+
+struct StageTimer {
+  uint32_t count = 0;
+  uint32_t min_us = UINT32_MAX;
+  uint32_t max_us = 0;
+  uint64_t total_us = 0;
+  uint32_t hist[STAGE_HIST_BUCKETS] = {0};
+
+  void add(uint32_t us) {
+    count++;
+    total_us += us;
+    if (us < min_us) min_us = us;
+    if (us > max_us) max_us = us;
+    uint8_t bucket = 0;
+    for (uint32_t limit = 16; bucket < STAGE_HIST_BUCKETS - 1 && us >= limit; limit <<= 2) bucket++;
+    hist[bucket]++;
+  }
+
+  uint32_t mean() const { return count ? (uint32_t)(total_us / count) : 0; }
+  uint32_t min() const { return count ? min_us : 0; }
+};
+
+#endif // STAGE_TIMER_H
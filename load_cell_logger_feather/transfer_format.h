@@ -0,0 +1,85 @@
+/*
+Framed binary file download over the USB serial port, shared by the logger
+firmware and the host client (host/lcl_get).
+
+The file manager's 'b' option asks for a file name and a starting offset, then
+sends the file from that offset as a run of frames with no further handshake;
+USB flow control paces the logger to the host. Each frame is
+
+  TransferFrame   12 bytes, magic, offset of the payload in the file, length, type
+  payload         length bytes, at most TRANSFER_BLOCK_SIZE
+  crc             CRC-32 (crc32.h) of the frame header and payload, uint32
+
+and the last one is always TRANSFER_END or TRANSFER_ERROR. The TRANSFER_END
+payload holds the file size and the CRC-32 of the whole file, from offset 0, so
+a download resumed part way is checked end to end. A host that sees a bad frame
+keeps what it has up to the last good one and asks again from there.
+
+The 'n' option lists the files in the card's root instead, as TRANSFER_LIST
+frames of TransferEntry, one per file, then a TRANSFER_END frame whose size is
+the number of entries. Every closed file's entry carries the CRC-32 of the whole
+file, so a host can tell a file it already has without downloading it again.
+Reading the card for the CRCs takes a second or so per megabyte, so hosts should
+allow for long gaps between list frames.
+
+The r command streams every conversion live instead of the text echo, as
+TRANSFER_LIVE frames of LIVE_RECORDS_PER_FRAME LiveRecords, about 4 kB/s at 320
+samples per second. These are sent unasked between menu output, so a host reads
+past any text to the next magic. The frame offset is a sequence number counting
+every frame since the stream was started, including any the logger held back
+while a prompt or transfer had the port, so a host sees lost frames as a gap.
+There is no end frame; the stream runs until r is sent again.
+
+Everything is little endian, as in log_format.h.
+*/
+
+#ifndef TRANSFER_FORMAT_H
+#define TRANSFER_FORMAT_H
+
+#include <stdint.h>
+
+#define TRANSFER_MAGIC 0x544C434CUL // "LCLT" read as a little endian uint32
+#define TRANSFER_BLOCK_SIZE 512     // One SD sector per data frame
+
+// Frame types
+#define TRANSFER_DATA 1  // Payload is file data at offset
+#define TRANSFER_END 2   // Payload is a TransferEnd, the download is complete
+#define TRANSFER_ERROR 3 // Payload is a message, no end frame follows
+#define TRANSFER_LIST 4  // Payload is a TransferEntry
+#define TRANSFER_LIVE 5  // Payload is LiveRecords, offset is the frame sequence number
+
+#define LIVE_RECORDS_PER_FRAME 16 // 50 ms at 320 samples per second
+
+// TransferEntry flags
+#define TRANSFER_ENTRY_OPEN 1 // The log being written: size is what has reached the card, no CRC
+
+struct __attribute__((packed)) TransferFrame {
+  uint32_t magic;  // TRANSFER_MAGIC
+  uint32_t offset; // Offset in the file of the first payload byte, or entry number in a list
+  uint16_t length; // Payload bytes, not counting the trailing CRC
+  uint16_t type;   // TRANSFER_x
+};
+
+struct __attribute__((packed)) TransferEnd {
+  uint32_t size; // File size in bytes, or the number of entries in a list
+  uint32_t crc;  // CRC-32 of the whole file, 0 for a list
+};
+
+struct __attribute__((packed)) TransferEntry {
+  char name[13];   // 8.3 name, zero terminated
+  uint8_t flags;   // TRANSFER_ENTRY_x
+  uint16_t reserved;
+  uint32_t size;   // File size in bytes
+  uint32_t crc;    // CRC-32 of the whole file, 0 if TRANSFER_ENTRY_OPEN
+};
+
+struct __attribute__((packed)) LiveRecord {
+  uint32_t us;   // micros() at the conversion, wraps every 71 minutes
+  int32_t raw;   // Filtered counts, as logged
+  int32_t load;  // Calibrated load in hundredths, see fixed_point.h
+};
+
+static_assert(sizeof(TransferFrame) == 12, "frame header layout is fixed");
+static_assert(sizeof(LiveRecord) * LIVE_RECORDS_PER_FRAME <= TRANSFER_BLOCK_SIZE, "live frame fits a block");
+
+#endif // TRANSFER_FORMAT_H
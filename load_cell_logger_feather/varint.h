@@ -0,0 +1,49 @@
+/*
+Zigzag varints for the packed binary log (log_format = 2), shared by the logger
+firmware and the host decoder.
+
+Zigzag folds a signed difference into an unsigned one, small magnitudes of
+either sign to small values: 0, -1, 1, -2 become 0, 1, 2, 3. The varint then
+stores it seven bits a byte, low bits first, with the top bit set on every byte
+but the last, so a change of under 64 counts takes one byte and the largest
+int32 five.
+*/
+
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <stdint.h>
+
+#define VARINT_MAX_BYTES 5
+
+inline uint32_t zigzagEncode(int32_t value) {
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+inline int32_t zigzagDecode(uint32_t value) {
+  return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+// Write value at out, returning the bytes used
+inline uint8_t putVarint(uint8_t *out, uint32_t value) {
+  uint8_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = (uint8_t)value | 0x80;
+    value >>= 7;
+  }
+  out[n++] = (uint8_t)value;
+  return n;
+}
+
+// Read a value from in, stopping at end. Returns the bytes used, 0 if the varint runs
+// past end or is too long.
+inline uint8_t getVarint(const uint8_t *in, const uint8_t *end, uint32_t *value) {
+  *value = 0;
+  for (uint8_t n = 0; n < VARINT_MAX_BYTES && in + n < end; n++) {
+    *value |= (uint32_t)(in[n] & 0x7F) << (7 * n);
+    if (!(in[n] & 0x80)) return n + 1;
+  }
+  return 0;
+}
+
+#endif // VARINT_H